@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <uuid/uuid.h>
+#include "../database/key.h"
+
+//Compares ways of searching a node: linear and binary search with
+//uuid_compare, and binary search with the inlined key comparators.
+
+#define NODE_KEYS 204
+#define NUM_NODES 1024
+#define NUM_LOOKUPS 4000000
+
+typedef int (*Compare)(const void* a, const void* b);
+
+int compare_uuid(const void* a, const void* b) {
+	return uuid_compare(a, b);
+}
+
+int compare_scalar(const void* a, const void* b) {
+	return db_key_compare_scalar(a, b);
+}
+
+#ifdef __SSE2__
+int compare_sse2(const void* a, const void* b) {
+	return db_key_compare_sse2(a, b);
+}
+#endif
+
+uint32_t linear_search(uuid_t* keys, uint32_t n, const uuid_t key, Compare compare) {
+	uint32_t i = 0;
+	while(i < n && compare(keys[i], key) < 0) {
+		++i;
+	}
+	return i;
+}
+
+uint32_t binary_search(uuid_t* keys, uint32_t n, const uuid_t key, Compare compare) {
+	uint32_t low = 0;
+	uint32_t high = n;
+	while(low < high) {
+		uint32_t mid = (low + high) / 2;
+		if(compare(keys[mid], key) < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+//The inlined comparator as the node search uses it, without a call per key.
+uint32_t binary_search_inline(uuid_t* keys, uint32_t n, const uuid_t key) {
+	uint32_t low = 0;
+	uint32_t high = n;
+	while(low < high) {
+		uint32_t mid = (low + high) / 2;
+		if(db_key_compare(keys[mid], key) < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+int compare_keys(const void* a, const void* b) {
+	return uuid_compare(a, b);
+}
+
+double seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef uint32_t (*Search)(uuid_t* keys, uint32_t n, const uuid_t key, Compare compare);
+
+uint32_t run(const char* name, uuid_t* nodes, uuid_t* lookups, Search search, Compare compare) {
+	uint32_t sum = 0;
+	double start = seconds();
+	for(uint32_t i=0; i<NUM_LOOKUPS; ++i) {
+		uuid_t* keys = nodes + (size_t)(i % NUM_NODES)*NODE_KEYS;
+		if(search == NULL) {
+			sum += binary_search_inline(keys, NODE_KEYS, lookups[i % NUM_NODES]);
+		} else {
+			sum += search(keys, NODE_KEYS, lookups[i % NUM_NODES], compare);
+		}
+	}
+	double elapsed = seconds() - start;
+	printf("%-24s %8.1f ns/search\n", name, elapsed * 1e9 / NUM_LOOKUPS);
+	return sum;
+}
+
+int main() {
+	uuid_t* nodes = malloc(sizeof(uuid_t)*NODE_KEYS*NUM_NODES);
+	uuid_t* lookups = malloc(sizeof(uuid_t)*NUM_NODES);
+	for(uint32_t i=0; i<NUM_NODES; ++i) {
+		uuid_t* keys = nodes + (size_t)i*NODE_KEYS;
+		for(uint32_t k=0; k<NODE_KEYS; ++k) {
+			uuid_generate(keys[k]);
+		}
+		qsort(keys, NODE_KEYS, sizeof(uuid_t), compare_keys);
+		uuid_generate(lookups[i]);
+	}
+
+	uint32_t expected = run("linear uuid_compare", nodes, lookups, linear_search, compare_uuid);
+	uint32_t results[4];
+	results[0] = run("binary uuid_compare", nodes, lookups, binary_search, compare_uuid);
+	results[1] = run("binary scalar", nodes, lookups, binary_search, compare_scalar);
+#ifdef __SSE2__
+	results[2] = run("binary sse2", nodes, lookups, binary_search, compare_sse2);
+#else
+	results[2] = expected;
+#endif
+	results[3] = run("binary db_key_compare", nodes, lookups, NULL, NULL);
+	for(int i=0; i<4; ++i) {
+		if(results[i] != expected) {
+			printf("Search variant %i disagrees\n", i);
+			return EXIT_FAILURE;
+		}
+	}
+
+	free(nodes);
+	free(lookups);
+	return EXIT_SUCCESS;
+}
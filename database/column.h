@@ -0,0 +1,167 @@
+#ifndef COLUMN_H
+#define COLUMN_H
+
+#include <stdint.h>
+#include <string.h>
+#include "database.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/*
+A field at a fixed offset of fixed size rows makes a column inside each leaf,
+one value every cell_size bytes. The kernels here work on such a column in
+place, a leaf run at a time: one marks the rows whose value lies in a range,
+the other adds the marked values to an aggregate.
+
+The scalar versions are branchless so the compiler can vectorize them. The
+AVX2 versions gather eight int32 or four int64 values with one load. Building
+with DB_SIMD_COLUMNS, which compiles for AVX2, makes the kernels use them.
+
+Sums wrap around instead of overflowing.
+*/
+
+static inline int64_t db_column_value(const DbField* field, const uint8_t* cell) {
+	if(field->type == DB_FIELD_INT32) {
+		int32_t v;
+		memcpy(&v, cell + field->offset, sizeof(v));
+		return v;
+	}
+	int64_t v;
+	memcpy(&v, cell + field->offset, sizeof(v));
+	return v;
+}
+
+static inline void db_column_match_scalar(const DbField* field, const uint8_t* cells, uint32_t stride, uint32_t n, int64_t low, int64_t high, uint8_t* match) {
+	for(uint32_t i=0; i<n; ++i) {
+		int64_t v = db_column_value(field, cells + (size_t)i*stride);
+		match[i] = (v >= low) & (v <= high);
+	}
+}
+
+static inline void db_column_aggregate_scalar(const DbField* field, const uint8_t* cells, uint32_t stride, uint32_t n, const uint8_t* match, DbAggregate* out) {
+	uint64_t count = 0;
+	uint64_t sum = 0;
+	int64_t min = INT64_MAX;
+	int64_t max = INT64_MIN;
+	for(uint32_t i=0; i<n; ++i) {
+		int64_t v = db_column_value(field, cells + (size_t)i*stride);
+		count += match[i];
+		sum += (uint64_t)v & -(uint64_t)match[i];
+		min = match[i] && v < min ? v : min;
+		max = match[i] && v > max ? v : max;
+	}
+	out->count += count;
+	out->sum = (int64_t)((uint64_t)out->sum + sum);
+	out->min = min < out->min ? min : out->min;
+	out->max = max > out->max ? max : out->max;
+}
+
+#ifdef __AVX2__
+//Byte offsets of eight cells from the first
+static inline __m256i db_column_offsets(const DbField* field, uint32_t stride) {
+	__m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	return _mm256_add_epi32(_mm256_mullo_epi32(lanes, _mm256_set1_epi32(stride)), _mm256_set1_epi32(field->offset));
+}
+
+static inline void db_column_match_avx2(const DbField* field, const uint8_t* cells, uint32_t stride, uint32_t n, int64_t low, int64_t high, uint8_t* match) {
+	__m256i offsets = db_column_offsets(field, stride);
+	uint32_t i = 0;
+	if(field->type == DB_FIELD_INT32) {
+		//Outside of int32 the range either holds every value or none
+		__m256i lo = _mm256_set1_epi32(low < INT32_MIN ? INT32_MIN : low > INT32_MAX ? INT32_MAX : low);
+		__m256i hi = _mm256_set1_epi32(high < INT32_MIN ? INT32_MIN : high > INT32_MAX ? INT32_MAX : high);
+		bool none = low > INT32_MAX || high < INT32_MIN;
+		for(; i + 8 <= n && !none; i+=8) {
+			__m256i v = _mm256_i32gather_epi32((const int*)(cells + (size_t)i*stride), offsets, 1);
+			__m256i out = _mm256_or_si256(_mm256_cmpgt_epi32(lo, v), _mm256_cmpgt_epi32(v, hi));
+			uint32_t bits = ~_mm256_movemask_ps(_mm256_castsi256_ps(out));
+			for(uint32_t j=0; j<8; ++j) {
+				match[i+j] = bits >> j & 1;
+			}
+		}
+	} else {
+		__m128i half = _mm256_castsi256_si128(offsets);
+		__m256i lo = _mm256_set1_epi64x(low);
+		__m256i hi = _mm256_set1_epi64x(high);
+		for(; i + 4 <= n; i+=4) {
+			__m256i v = _mm256_i32gather_epi64((const long long*)(cells + (size_t)i*stride), half, 1);
+			__m256i out = _mm256_or_si256(_mm256_cmpgt_epi64(lo, v), _mm256_cmpgt_epi64(v, hi));
+			uint32_t bits = ~_mm256_movemask_pd(_mm256_castsi256_pd(out));
+			for(uint32_t j=0; j<4; ++j) {
+				match[i+j] = bits >> j & 1;
+			}
+		}
+	}
+	db_column_match_scalar(field, cells + (size_t)i*stride, stride, n - i, low, high, match + i);
+}
+
+static inline void db_column_aggregate_avx2(const DbField* field, const uint8_t* cells, uint32_t stride, uint32_t n, const uint8_t* match, DbAggregate* out) {
+	__m256i offsets = db_column_offsets(field, stride);
+	__m256i sum = _mm256_setzero_si256();
+	__m256i min = _mm256_set1_epi64x(INT64_MAX);
+	__m256i max = _mm256_set1_epi64x(INT64_MIN);
+	uint64_t count = 0;
+	uint32_t i = 0;
+	if(field->type == DB_FIELD_INT32) {
+		for(; i + 8 <= n; i+=8) {
+			__m256i v = _mm256_i32gather_epi32((const int*)(cells + (size_t)i*stride), offsets, 1);
+			uint64_t bytes;
+			memcpy(&bytes, match + i, sizeof(bytes));
+			count += __builtin_popcountll(bytes);
+			__m256i marked = _mm256_cmpgt_epi32(_mm256_cvtepu8_epi32(_mm_cvtsi64_si128(bytes)), _mm256_setzero_si256());
+			v = _mm256_and_si256(v, marked);
+			__m256i parts[2] = {_mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)), _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1))};
+			__m256i masks[2] = {_mm256_cvtepi32_epi64(_mm256_castsi256_si128(marked)), _mm256_cvtepi32_epi64(_mm256_extracti128_si256(marked, 1))};
+			for(uint32_t h=0; h<2; ++h) {
+				sum = _mm256_add_epi64(sum, parts[h]);
+				min = _mm256_blendv_epi8(min, parts[h], _mm256_and_si256(masks[h], _mm256_cmpgt_epi64(min, parts[h])));
+				max = _mm256_blendv_epi8(max, parts[h], _mm256_and_si256(masks[h], _mm256_cmpgt_epi64(parts[h], max)));
+			}
+		}
+	} else {
+		__m128i half = _mm256_castsi256_si128(offsets);
+		for(; i + 4 <= n; i+=4) {
+			__m256i v = _mm256_i32gather_epi64((const long long*)(cells + (size_t)i*stride), half, 1);
+			uint32_t bytes;
+			memcpy(&bytes, match + i, sizeof(bytes));
+			count += __builtin_popcount(bytes);
+			__m256i marked = _mm256_cmpgt_epi64(_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(bytes)), _mm256_setzero_si256());
+			sum = _mm256_add_epi64(sum, _mm256_and_si256(v, marked));
+			min = _mm256_blendv_epi8(min, v, _mm256_and_si256(marked, _mm256_cmpgt_epi64(min, v)));
+			max = _mm256_blendv_epi8(max, v, _mm256_and_si256(marked, _mm256_cmpgt_epi64(v, max)));
+		}
+	}
+	int64_t lanes[3][4];
+	_mm256_storeu_si256((__m256i*)lanes[0], sum);
+	_mm256_storeu_si256((__m256i*)lanes[1], min);
+	_mm256_storeu_si256((__m256i*)lanes[2], max);
+	out->count += count;
+	for(uint32_t j=0; j<4; ++j) {
+		out->sum = (int64_t)((uint64_t)out->sum + (uint64_t)lanes[0][j]);
+		out->min = lanes[1][j] < out->min ? lanes[1][j] : out->min;
+		out->max = lanes[2][j] > out->max ? lanes[2][j] : out->max;
+	}
+	db_column_aggregate_scalar(field, cells + (size_t)i*stride, stride, n - i, match + i, out);
+}
+#endif
+
+//Sets match[i] to 1 if the field of cell i lies from low to high, else 0.
+static inline void db_column_match(const DbField* field, const uint8_t* cells, uint32_t stride, uint32_t n, int64_t low, int64_t high, uint8_t* match) {
+#if defined(DB_SIMD_COLUMNS) && defined(__AVX2__)
+	db_column_match_avx2(field, cells, stride, n, low, high, match);
+#else
+	db_column_match_scalar(field, cells, stride, n, low, high, match);
+#endif
+}
+
+//Adds the field of the cells marked in match to out.
+static inline void db_column_aggregate(const DbField* field, const uint8_t* cells, uint32_t stride, uint32_t n, const uint8_t* match, DbAggregate* out) {
+#if defined(DB_SIMD_COLUMNS) && defined(__AVX2__)
+	db_column_aggregate_avx2(field, cells, stride, n, match, out);
+#else
+	db_column_aggregate_scalar(field, cells, stride, n, match, out);
+#endif
+}
+
+#endif
@@ -1,7 +1,17 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sched.h>
 #include "database.h"
+#include "sort.h"
+#include "key.h"
+#include "column.h"
 /*
 uint32_t _db_get_unused_page(int line, Pager* pager) {
 	printf("db_get_unused_page called from: %i\n", line);
@@ -60,7 +70,7 @@ void hexDumps (char *desc, void *addr, int len) {
     printf ("  %s\n", buff);
 }
 
-typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
+typedef enum { NODE_INTERNAL, NODE_LEAF, NODE_FREE, NODE_OVERFLOW } NodeType;
 
 typedef struct {
 	uuid_t key;
@@ -68,361 +78,4097 @@ typedef struct {
 } Child;
 
 #define NODE_HEADER struct { \
+	uint32_t latch; \
+	uint32_t version; \
 	uint8_t type; \
-	uint8_t num_cells; \
+	uint8_t packed; \
+	uint16_t num_cells; \
 	uint32_t parent; \
 	uint32_t next_leaf; \
 }
 
-#define NODE_SPACE_FOR_CELLS (PAGE_SIZE-sizeof(NODE_HEADER))
-#define INTERNAL_NODE_MAX_CELLS (NODE_SPACE_FOR_CELLS/sizeof(Child))
+#define MAX_NODE_SPACE (MAX_PAGE_SIZE-sizeof(NODE_HEADER))
+#define MAX_TREE_DEPTH 32
 
+//Sized for the largest page, a node only uses as much as its table's pages hold.
 typedef struct {
 	NODE_HEADER;
 	union {
-		uint8_t cellspace[NODE_SPACE_FOR_CELLS];
-		Child children[INTERNAL_NODE_MAX_CELLS];
+		uint8_t cellspace[MAX_NODE_SPACE];
+		Child children[MAX_NODE_SPACE/sizeof(Child)];
 	};
 } Node;
 
+//Bytes of a page past the node header.
+static uint32_t node_space(Table* table) {
+	return table->options.page_size - sizeof(NODE_HEADER);
+}
+
+static uint32_t internal_max_cells(Table* table) {
+	return node_space(table) / sizeof(Child);
+}
+
+//The latch and version words belong to the node's page, not its contents.
+#define NODE_SYNC_SIZE offsetof(Node, type)
+//The latch word alone only means something while the page is in memory.
+#define NODE_LATCH_SIZE offsetof(Node, version)
+
+/*
+Each node carries a reader/writer latch in its first word, the word the
+pager clears when it reads a page in. Readers hold a shared latch and writers
+an exclusive one, and a waiting writer keeps new readers out so it is not
+starved. Latches are always taken top down, or on a single node, so the
+descents can couple them without deadlocking.
+
+Releasing an exclusive latch bumps the node's version. Readers mostly take
+no latch at all: they note the version, read the node, and check that no
+writer held or released the latch in between, restarting if one did.
+Anything read from a node is only trusted after that check.
+*/
+#define LATCH_WRITER 0x80000000u
+#define LATCH_WAITING 0x40000000u
+#define LATCH_SPINS 64
+#define OPTIMISTIC_TRIES 16
+
+static void latch_wait(uint32_t* spins) {
+	if(++*spins >= LATCH_SPINS) {
+		*spins = 0;
+		sched_yield();
+	}
+}
+
+static void node_latch_shared(Node* node) {
+	uint32_t spins = 0;
+	uint32_t latch = __atomic_load_n(&node->latch, __ATOMIC_RELAXED);
+	while(true) {
+		if((latch & (LATCH_WRITER | LATCH_WAITING)) == 0) {
+			if(__atomic_compare_exchange_n(&node->latch, &latch, latch + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				return;
+			}
+			continue;
+		}
+		latch_wait(&spins);
+		latch = __atomic_load_n(&node->latch, __ATOMIC_RELAXED);
+	}
+}
+
+static void node_unlatch_shared(Node* node) {
+	__atomic_fetch_sub(&node->latch, 1, __ATOMIC_RELEASE);
+}
+
+static void node_latch_exclusive(Node* node) {
+	uint32_t spins = 0;
+	uint32_t latch = __atomic_load_n(&node->latch, __ATOMIC_RELAXED);
+	while(true) {
+		if((latch & ~LATCH_WAITING) == 0) {
+			if(__atomic_compare_exchange_n(&node->latch, &latch, LATCH_WRITER, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				//Optimistic readers must see the latch taken before any change
+				__atomic_thread_fence(__ATOMIC_RELEASE);
+				return;
+			}
+			continue;
+		}
+		if((latch & LATCH_WAITING) == 0) {
+			__atomic_fetch_or(&node->latch, LATCH_WAITING, __ATOMIC_RELAXED);
+		}
+		latch_wait(&spins);
+		latch = __atomic_load_n(&node->latch, __ATOMIC_RELAXED);
+	}
+}
+
+static void node_unlatch_exclusive(Node* node) {
+	__atomic_fetch_add(&node->version, 1, __ATOMIC_RELEASE);
+	__atomic_fetch_and(&node->latch, ~LATCH_WRITER, __ATOMIC_RELEASE);
+}
+
+//Starts an optimistic read, false while a writer holds the node.
+static bool node_read_begin(Node* node, uint32_t* version) {
+	*version = __atomic_load_n(&node->version, __ATOMIC_ACQUIRE);
+	return (__atomic_load_n(&node->latch, __ATOMIC_ACQUIRE) & LATCH_WRITER) == 0;
+}
+
+//True if nothing changed the node since node_read_begin gave version.
+static bool node_read_valid(Node* node, uint32_t version) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	uint32_t latch = __atomic_load_n(&node->latch, __ATOMIC_ACQUIRE);
+	return (latch & LATCH_WRITER) == 0 && __atomic_load_n(&node->version, __ATOMIC_ACQUIRE) == version;
+}
+
+//Pages read back from a file carry whatever latch word they were written
+//with, which means nothing to this process.
+static void node_reset_latch(void* page) {
+	memset(page, 0, NODE_LATCH_SIZE);
+}
+
+//Pins a page and latches it.
+static Node* db_latch_page(Table* table, uint32_t page, bool exclusive) {
+	Node* node = db_get_page(table->pager, page);
+	if(node != NULL) {
+		if(exclusive) {
+			node_latch_exclusive(node);
+		} else {
+			node_latch_shared(node);
+		}
+	}
+	return node;
+}
+
+static void db_unlatch_page(Table* table, uint32_t page, Node* node, bool exclusive) {
+	if(exclusive) {
+		node_unlatch_exclusive(node);
+	} else {
+		node_unlatch_shared(node);
+	}
+	db_release_page(table->pager, page);
+}
+
+//Clears a node except for its latch and version.
+static void node_clear(Table* table, Node* node) {
+	memset((uint8_t*)node + NODE_SYNC_SIZE, 0, table->options.page_size - NODE_SYNC_SIZE);
+}
+
+//Copies a node except for its latch and version.
+static void node_copy(Table* table, Node* to, Node* from) {
+	memcpy((uint8_t*)to + NODE_SYNC_SIZE, (uint8_t*)from + NODE_SYNC_SIZE, table->options.page_size - NODE_SYNC_SIZE);
+}
+
+/*
+Leaves of tables with variable_rows are slotted: a count of the bytes the
+cells take is followed by a slot per cell giving its offset and size in key
+order, and the cells themselves are stacked down from the end of the page.
+Cells start with the row's key like fixed size cells do. A row too large
+to share a leaf keeps its first bytes in its cell, followed by its size and
+the first page of a chain of overflow pages holding the rest. Offsets fit
+in 16 bits as pages are at most 64 KiB, and cells stay below a quarter of
+that, leaving the top bit of a slot's size for SLOT_OVERFLOW.
+*/
+typedef struct {
+	uint16_t offset;
+	uint16_t size;
+} LeafSlot;
+
+#define SLOTTED_HEADER sizeof(uint32_t)
+#define SLOT_OVERFLOW 0x8000
+#define OVERFLOW_INLINE 64
+#define OVERFLOW_CELL_SIZE (OVERFLOW_INLINE + 2*sizeof(uint32_t))
+
+//A cell on its way into a leaf: a whole row, or for a row kept in overflow
+//pages its first bytes and where the rest went.
+typedef struct {
+	const uint8_t* data;
+	uint32_t size;
+	bool overflow;
+} LeafCell;
+
+static bool table_variable(Table* table) {
+	return table->options.variable_rows;
+}
+
+//Larger rows go to overflow pages, so any four cells share a leaf.
+static uint32_t max_inline_row(Table* table) {
+	return (node_space(table) - SLOTTED_HEADER)/4 - sizeof(LeafSlot);
+}
+
 uint32_t leaf_max_cells(Table* table) {
-	return NODE_SPACE_FOR_CELLS / table->cell_size;
+	if(table_variable(table)) {
+		return (node_space(table) - SLOTTED_HEADER) / (sizeof(LeafSlot) + sizeof(uuid_t));
+	}
+	return node_space(table) / table->cell_size;
+}
+
+void* leaf_node_cell(Node* node, uint32_t cell_num, uint32_t cell_size) {
+	return node->cellspace + cell_num * cell_size;
+}
+
+static uint16_t* leaf_used(Node* node) {
+	return (uint16_t*)node->cellspace;
+}
+
+static LeafSlot* leaf_slots(Node* node) {
+	return (LeafSlot*)(node->cellspace + SLOTTED_HEADER);
+}
+
+//Cell i of a leaf. A slot read optimistically can be torn, so its offset
+//is kept inside the page.
+static uint8_t* leaf_cell(Table* table, Node* node, uint32_t i) {
+	if(!table_variable(table)) {
+		return leaf_node_cell(node, i, table->cell_size);
+	}
+	uint32_t offset = leaf_slots(node)[i].offset;
+	if(offset > node_space(table) - sizeof(uuid_t)) {
+		offset = 0;
+	}
+	return node->cellspace + offset;
+}
+
+static uint32_t leaf_cell_size(Table* table, Node* node, uint32_t i) {
+	if(!table_variable(table)) {
+		return table->cell_size;
+	}
+	return leaf_slots(node)[i].size & ~SLOT_OVERFLOW;
+}
+
+static LeafCell leaf_get_cell(Table* table, Node* node, uint32_t i) {
+	LeafCell cell;
+	cell.data = leaf_cell(table, node, i);
+	cell.size = leaf_cell_size(table, node, i);
+	cell.overflow = table_variable(table) && (leaf_slots(node)[i].size & SLOT_OVERFLOW) != 0;
+	return cell;
+}
+
+//Bytes a cell takes in a leaf, its slot included.
+static uint32_t leaf_entry_size(Table* table, uint32_t cell_size) {
+	return table_variable(table) ? cell_size + sizeof(LeafSlot) : cell_size;
+}
+
+//Bytes a leaf's cells take, with their slots.
+static uint32_t leaf_bytes(Table* table, Node* node) {
+	if(!table_variable(table)) {
+		return node->num_cells * table->cell_size;
+	}
+	return SLOTTED_HEADER + node->num_cells*sizeof(LeafSlot) + *leaf_used(node);
+}
+
+//Whether a leaf takes a cell of cell_size bytes. A fixed size leaf keeps
+//its last cell free, as it always did.
+static bool leaf_has_room(Table* table, Node* node, uint32_t cell_size) {
+	if(!table_variable(table)) {
+		return node->num_cells + 1u < leaf_max_cells(table);
+	}
+	return leaf_bytes(table, node) + leaf_entry_size(table, cell_size) <= node_space(table);
+}
+
+//Inserts a cell as cell i, shifting the cells after it. The leaf must have room.
+static void leaf_insert(Table* table, Node* node, uint32_t i, const LeafCell* cell) {
+	if(!table_variable(table)) {
+		uint8_t* to = leaf_cell(table, node, i);
+		memmove(to + table->cell_size, to, (node->num_cells - i)*table->cell_size);
+		memcpy(to, cell->data, table->cell_size);
+		node->num_cells++;
+		return;
+	}
+	LeafSlot* slots = leaf_slots(node);
+	*leaf_used(node) += cell->size;
+	uint32_t offset = node_space(table) - *leaf_used(node);
+	memcpy(node->cellspace + offset, cell->data, cell->size);
+	memmove(slots + i + 1, slots + i, sizeof(LeafSlot)*(node->num_cells - i));
+	slots[i].offset = offset;
+	slots[i].size = cell->size | (cell->overflow ? SLOT_OVERFLOW : 0);
+	node->num_cells++;
+}
+
+//Removes count cells from start on. A slotted leaf stacks the cells it
+//keeps again, so its free space stays in one piece.
+static void leaf_remove(Table* table, Node* node, uint32_t start, uint32_t count) {
+	if(!table_variable(table)) {
+		uint8_t* from = leaf_cell(table, node, start);
+		memmove(from, from + count*table->cell_size, (node->num_cells - start - count)*table->cell_size);
+		node->num_cells -= count;
+		return;
+	}
+	LeafSlot* slots = leaf_slots(node);
+	memmove(slots + start, slots + start + count, sizeof(LeafSlot)*(node->num_cells - start - count));
+	node->num_cells -= count;
+	//The cells are stacked in the table's scratch page, shared by every leaf
+	pthread_mutex_lock(&table->scratch_lock);
+	uint8_t* cells = table->scratch;
+	uint32_t top = node_space(table);
+	for(uint32_t i=0; i<node->num_cells; ++i) {
+		uint32_t size = slots[i].size & ~SLOT_OVERFLOW;
+		top -= size;
+		memcpy(cells + top, node->cellspace + slots[i].offset, size);
+		slots[i].offset = top;
+	}
+	memcpy(node->cellspace + top, cells + top, node_space(table) - top);
+	pthread_mutex_unlock(&table->scratch_lock);
+	*leaf_used(node) = node_space(table) - top;
+}
+
+//Copies count cells of from, starting at start, into to in front of cell at.
+static void leaf_copy_cells(Table* table, Node* to, uint32_t at, Node* from, uint32_t start, uint32_t count) {
+	if(!table_variable(table)) {
+		uint8_t* cell = leaf_cell(table, to, at);
+		memmove(cell + count*table->cell_size, cell, (to->num_cells - at)*table->cell_size);
+		memcpy(cell, leaf_cell(table, from, start), count*table->cell_size);
+		to->num_cells += count;
+		return;
+	}
+	for(uint32_t i=0; i<count; ++i) {
+		LeafCell cell = leaf_get_cell(table, from, start + i);
+		leaf_insert(table, to, at + i, &cell);
+	}
+}
+
+//Index of the first of num_cells children whose key is >= key, or the last.
+//A child's key is an upper bound for the keys in its subtree.
+static uint32_t internal_node_search(Node* node, uint32_t num_cells, const uuid_t key) {
+	uint32_t low = 0;
+	uint32_t high = num_cells - 1;
+	while(low < high) {
+		uint32_t mid = (low + high) / 2;
+		if(db_key_compare(node->children[mid].key, key) < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/*
+Internal nodes of tables created with compress_keys are packed: the bytes
+all of a node's keys start with are stored once, followed by the child
+pages and then the rest of each key. Keys handed out in time order share
+long prefixes, so their nodes hold many more children. A packed node takes
+children for as long as they fit rather than up to a fixed count.
+
+Packed or not, internal nodes are changed by unpacking their children into
+an array of Child, editing that, and packing it back.
+*/
+#define PACKED_KEYS_OFFSET 20
+#define MAX_PACKED_PREFIX (sizeof(uuid_t) - 1)
+
+static uint32_t packed_max_cells(Table* table) {
+	return (node_space(table) - PACKED_KEYS_OFFSET)/(sizeof(uint32_t) + 1);
+}
+
+static uint32_t* packed_pages(Node* node) {
+	return (uint32_t*)(node->cellspace + PACKED_KEYS_OFFSET);
+}
+
+//Where the rest of key i starts, after the prefix bytes all keys share.
+static uint8_t* packed_suffix(Node* node, uint32_t num_cells, uint32_t prefix, uint32_t i) {
+	return node->cellspace + PACKED_KEYS_OFFSET + num_cells*sizeof(uint32_t) + i*(sizeof(uuid_t) - prefix);
+}
+
+static bool packed_fits(Table* table, uint32_t num_cells, uint32_t prefix) {
+	return num_cells <= packed_max_cells(table) && PACKED_KEYS_OFFSET + num_cells*(sizeof(uint32_t) + sizeof(uuid_t) - prefix) <= node_space(table);
+}
+
+static uint32_t key_prefix(const uint8_t* a, const uint8_t* b, uint32_t max) {
+	uint32_t i = 0;
+	while(i < max && a[i] == b[i]) {
+		++i;
+	}
+	return i;
+}
+
+//Bytes every key starts with, all of them as the last key may be out of order.
+static uint32_t common_prefix(const Child* children, uint32_t num_cells) {
+	uint32_t prefix = MAX_PACKED_PREFIX;
+	for(uint32_t i=1; i<num_cells && prefix > 0; ++i) {
+		prefix = key_prefix(children[0].key, children[i].key, prefix);
+	}
+	return prefix;
+}
+
+static uint32_t packed_node_search(Node* node, uint32_t num_cells, uint32_t prefix, const uuid_t key) {
+	int order = memcmp(key, node->cellspace + 1, prefix);
+	if(order < 0) {
+		return 0;
+	}
+	if(order > 0) {
+		return num_cells - 1;
+	}
+	uint32_t width = sizeof(uuid_t) - prefix;
+	uint32_t low = 0;
+	uint32_t high = num_cells - 1;
+	while(low < high) {
+		uint32_t mid = (low + high) / 2;
+		if(memcmp(packed_suffix(node, num_cells, prefix, mid), key + prefix, width) < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+//Page of the child key belongs under, out of num_cells children. PAGE_NONE
+//when an optimistic read caught the node in the middle of a change.
+static uint32_t internal_node_child_page(Table* table, Node* node, uint32_t num_cells, const uuid_t key) {
+	if(node->packed) {
+		uint32_t prefix = node->cellspace[0];
+		if(num_cells == 0 || prefix > MAX_PACKED_PREFIX || !packed_fits(table, num_cells, prefix)) {
+			return PAGE_NONE;
+		}
+		return packed_pages(node)[packed_node_search(node, num_cells, prefix, key)];
+	}
+	if(num_cells == 0 || num_cells > internal_max_cells(table)) {
+		return PAGE_NONE;
+	}
+	return node->children[internal_node_search(node, num_cells, key)].page;
+}
+
+static uint32_t internal_child(Node* node, uint32_t i) {
+	return node->packed ? packed_pages(node)[i] : node->children[i].page;
+}
+
+static void internal_key(Node* node, uint32_t i, uuid_t key) {
+	if(!node->packed) {
+		uuid_copy(key, node->children[i].key);
+		return;
+	}
+	uint32_t prefix = node->cellspace[0];
+	memcpy(key, node->cellspace + 1, prefix);
+	memcpy(key + prefix, packed_suffix(node, node->num_cells, prefix, i), sizeof(uuid_t) - prefix);
+}
+
+static uint32_t internal_unpack(Node* node, Child* children) {
+	if(!node->packed) {
+		memcpy(children, node->children, sizeof(Child)*node->num_cells);
+		return node->num_cells;
+	}
+	for(uint32_t i=0; i<node->num_cells; ++i) {
+		internal_key(node, i, children[i].key);
+		children[i].page = packed_pages(node)[i];
+	}
+	return node->num_cells;
+}
+
+//Stores children in a node, which must have room for them.
+static void internal_pack(Node* node, const Child* children, uint32_t num_cells) {
+	node->num_cells = num_cells;
+	if(!node->packed) {
+		memcpy(node->children, children, sizeof(Child)*num_cells);
+		return;
+	}
+	uint32_t prefix = common_prefix(children, num_cells);
+	node->cellspace[0] = prefix;
+	memcpy(node->cellspace + 1, children[0].key, prefix);
+	for(uint32_t i=0; i<num_cells; ++i) {
+		packed_pages(node)[i] = children[i].page;
+		memcpy(packed_suffix(node, num_cells, prefix, i), children[i].key + prefix, sizeof(uuid_t) - prefix);
+	}
+}
+
+//Whether num_cells children go in one node. Unpacked nodes split as soon
+//as they fill up, so one always has room for another child.
+static bool internal_fits(Table* table, bool packed, const Child* children, uint32_t num_cells) {
+	if(!packed) {
+		return num_cells < internal_max_cells(table);
+	}
+	return packed_fits(table, num_cells, common_prefix(children, num_cells));
+}
+
+//Whether a node surely takes one more child, whatever its key.
+static bool internal_has_room(Table* table, Node* node) {
+	if(!node->packed) {
+		return node->num_cells + 1u < internal_max_cells(table);
+	}
+	return packed_fits(table, node->num_cells + 1u, 0);
+}
+
+//Whether children split after the first keep go in two nodes.
+static bool internal_fits_split(Table* table, bool packed, const Child* children, uint32_t num_cells, uint32_t keep) {
+	return keep > 0 && keep < num_cells && internal_fits(table, packed, children, keep) && internal_fits(table, packed, children + keep, num_cells - keep);
+}
+
+static uint32_t internal_node_child_index(Node* node, uint32_t page) {
+	for(uint32_t i=0; i<node->num_cells; ++i) {
+		if(internal_child(node, i) == page) {
+			return i;
+		}
+	}
+	return node->num_cells;
+}
+
+//Index of the first of num_cells cells whose key is >= key, or num_cells.
+static uint32_t leaf_node_search(Table* table, Node* node, uint32_t num_cells, const uuid_t key) {
+	uint32_t low = 0;
+	uint32_t high = num_cells;
+	while(low < high) {
+		uint32_t mid = (low + high) / 2;
+		void* cell = leaf_cell(table, node, mid);
+		if(db_key_compare(*(uuid_t*)cell, key) < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+uint32_t leaf_node_find_cell(Table* table, Node* node, const uuid_t key) {
+	return leaf_node_search(table, node, node->num_cells, key);
+}
+
+//Whether cell i exists and holds key.
+static bool leaf_has_key(Table* table, Node* node, uint32_t i, const uuid_t key) {
+	return i < node->num_cells && db_key_compare(leaf_cell(table, node, i), key) == 0;
+}
+
+//Size of a row kept in overflow pages and the first of them, from its cell.
+static uint32_t overflow_row(const uint8_t* cell, uint32_t* page) {
+	uint32_t size;
+	memcpy(&size, cell + OVERFLOW_INLINE, sizeof(uint32_t));
+	memcpy(page, cell + OVERFLOW_INLINE + sizeof(uint32_t), sizeof(uint32_t));
+	return size;
+}
+
+/*
+Writes the part of a row past its first bytes to a chain of new overflow
+pages, and makes the cell pointing to them. The pages belong to no leaf
+until the cell goes into one, so they are written without latches.
+*/
+static DbResult db_write_overflow(Table* table, const uint8_t* row, uint32_t size, uint8_t* cell) {
+	Pager* pager = table->pager;
+	uint32_t count = (size - OVERFLOW_INLINE + node_space(table) - 1) / node_space(table);
+	if(!db_reserve_pages(pager, count)) {
+		return DB_ERROR_NO_MEMORY;
+	}
+	//Written back to front, so each page knows the one after it
+	uint32_t next = 0;
+	for(uint32_t i=count; i-- > 0;) {
+		uint32_t page = db_get_unused_page(pager);
+		Node* node = db_get_page(pager, page);
+		if(node == NULL) {
+			db_unreserve_pages(pager, i);
+			return DB_ERROR_IO;
+		}
+		node_clear(table, node);
+		node->type = NODE_OVERFLOW;
+		node->next_leaf = next;
+		uint32_t start = OVERFLOW_INLINE + i*node_space(table);
+		uint32_t length = size - start < node_space(table) ? size - start : node_space(table);
+		memcpy(node->cellspace, row + start, length);
+		db_mark_dirty(pager, page);
+		db_release_page(pager, page);
+		next = page;
+	}
+	memcpy(cell, row, OVERFLOW_INLINE);
+	memcpy(cell + OVERFLOW_INLINE, &size, sizeof(uint32_t));
+	memcpy(cell + OVERFLOW_INLINE + sizeof(uint32_t), &next, sizeof(uint32_t));
+	return DB_OK;
+}
+
+//Frees the overflow pages of the row whose cell this is.
+static void db_free_overflow(Table* table, const uint8_t* cell) {
+	Pager* pager = table->pager;
+	uint32_t page;
+	uint32_t size = overflow_row(cell, &page);
+	for(uint32_t done = OVERFLOW_INLINE; done < size && page != 0; done += node_space(table)) {
+		Node* node = db_get_page(pager, page);
+		if(node == NULL) {
+			return;
+		}
+		uint32_t next = node->next_leaf;
+		node->type = NODE_FREE;
+		db_mark_dirty(pager, page);
+		db_release_page(pager, page);
+		db_free_page(pager, page);
+		page = next;
+	}
+}
+
+/*
+Copies the row in cell i out, up to max_size bytes of it, and returns its
+size. Rows in overflow pages are copied from them. A leaf read optimistically
+can give garbage here, or UINT32_MAX where it makes no sense at all, and the
+row is only trusted once the leaf's version checks out.
+*/
+static uint32_t leaf_read_row(Table* table, Node* node, uint32_t i, uint8_t* out, uint32_t max_size) {
+	if(!table_variable(table)) {
+		memcpy(out, leaf_cell(table, node, i), table->cell_size < max_size ? table->cell_size : max_size);
+		return table->cell_size;
+	}
+	LeafSlot slot = leaf_slots(node)[i];
+	uint32_t size = slot.size & ~SLOT_OVERFLOW;
+	if(slot.offset + size > node_space(table)) {
+		return UINT32_MAX;
+	}
+	const uint8_t* cell = node->cellspace + slot.offset;
+	if((slot.size & SLOT_OVERFLOW) == 0) {
+		memcpy(out, cell, size < max_size ? size : max_size);
+		return size;
+	}
+	uint32_t page;
+	size = overflow_row(cell, &page);
+	if(size <= OVERFLOW_INLINE || size > table->cell_size) {
+		return UINT32_MAX;
+	}
+	memcpy(out, cell, OVERFLOW_INLINE < max_size ? OVERFLOW_INLINE : max_size);
+	Pager* pager = table->pager;
+	for(uint32_t done = OVERFLOW_INLINE; done < size && done < max_size; done += node_space(table)) {
+		if(page == 0 || page >= __atomic_load_n(&pager->num_pages, __ATOMIC_RELAXED)) {
+			return UINT32_MAX;
+		}
+		Node* overflow = db_get_page(pager, page);
+		if(overflow == NULL) {
+			return UINT32_MAX;
+		}
+		uint32_t length = size - done < node_space(table) ? size - done : node_space(table);
+		if(length > max_size - done) {
+			length = max_size - done;
+		}
+		memcpy(out + done, overflow->cellspace, length);
+		uint32_t next = overflow->next_leaf;
+		db_release_page(pager, page);
+		page = next;
+	}
+	return size;
+}
+
+Database* db_open() {
+//	printf("Internal node size: %li\n", sizeof(Internal));
+	Database* db = malloc(sizeof(Database));
+	db->num_tables = 0;
+	db->tables = NULL;
+	db->index_size = 0;
+	db->index = NULL;
+	db->path = NULL;
+	db->pool_pages = 0;
+	db->wal = NULL;
+	db->snapshot = NULL;
+	db->snapshot_size = 0;
+	db->read_only = false;
+	//Checkpoints wait for changes in progress, and new changes wait for a waiting checkpoint
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&db->checkpoint_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	return db;
+}
+
+typedef struct {
+	char name[65];
+	uint32_t cell_size;
+	TableOptions options;
+	uint32_t indexed_table;
+	DbField field;
+} CatalogEntry;
+
+static char* db_table_path(Database* db, const char* name) {
+	size_t len = strlen(db->path) + strlen(name) + 8;
+	char* path = malloc(len);
+	snprintf(path, len, "%s/%s.pages", db->path, name);
+	return path;
+}
+
+static char* db_catalog_path(Database* db) {
+	size_t len = strlen(db->path) + 9;
+	char* path = malloc(len);
+	snprintf(path, len, "%s/catalog", db->path);
+	return path;
+}
+
+static char* db_wal_path(Database* db) {
+	size_t len = strlen(db->path) + 5;
+	char* path = malloc(len);
+	snprintf(path, len, "%s/wal", db->path);
+	return path;
+}
+
+//FNV-1a over the part of the name that is stored.
+static uint32_t table_name_hash(const char* name) {
+	uint32_t hash = 2166136261u;
+	for(uint32_t i=0; i<64 && name[i] != '\0'; ++i) {
+		hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static void db_index_table(Database* db, uint32_t ti) {
+	uint32_t mask = db->index_size - 1;
+	uint32_t slot = table_name_hash(db->tables[ti]->name) & mask;
+	while(db->index[slot] != UINT32_MAX) {
+		slot = (slot + 1) & mask;
+	}
+	db->index[slot] = ti;
+}
+
+//Keeps the name index at most half full, rebuilding it when it grows.
+static bool db_grow_index(Database* db, uint32_t num_tables) {
+	if(num_tables*2 <= db->index_size) {
+		return true;
+	}
+	uint32_t size = db->index_size == 0 ? 16 : db->index_size*2;
+	uint32_t* index = malloc(sizeof(uint32_t)*size);
+	if(index == NULL) {
+		return false;
+	}
+	for(uint32_t i=0; i<size; ++i) {
+		index[i] = UINT32_MAX;
+	}
+	free(db->index);
+	db->index = index;
+	db->index_size = size;
+	for(uint32_t i=0; i<db->num_tables; ++i) {
+		db_index_table(db, i);
+	}
+	return true;
+}
+
+//Adds a table kept in pager, which the table owns from then on.
+static Table* db_add_table_pager(Database* db, const char* name, uint32_t cell_size, const TableOptions* options, Pager* pager) {
+	//Tables are allocated one by one so handles stay valid as more are added
+	Table* table = malloc(sizeof(Table));
+	Table** tables = realloc(db->tables, sizeof(Table*)*(db->num_tables+1));
+	if(tables != NULL) {
+		db->tables = tables;
+	}
+	//Slotted leaves are compacted through a page of scratch space
+	uint8_t* scratch = options->variable_rows ? malloc(options->page_size) : NULL;
+	if(table == NULL || tables == NULL || (options->variable_rows && scratch == NULL) || !db_grow_index(db, db->num_tables+1)) {
+		free(table);
+		free(scratch);
+		db_close_pager(pager);
+		return NULL;
+	}
+	db->tables[db->num_tables] = table;
+	memset(table->name, 0, sizeof(table->name));
+	strncpy(table->name, name, 64);
+	table->cell_size = cell_size;
+	table->options = *options;
+	table->pager = pager;
+	table->append_page = PAGE_NONE;
+	table->id = db->num_tables;
+	table->db = db;
+	table->indexed_table = UINT32_MAX;
+	memset(&table->field, 0, sizeof(table->field));
+	table->num_indexes = 0;
+	table->indexes = NULL;
+	table->index_span = 0;
+	pthread_mutex_init(&table->index_lock, NULL);
+	table->index_buffer = NULL;
+	table->scratch = scratch;
+	pthread_mutex_init(&table->scratch_lock, NULL);
+	//Pages only reach the file at checkpoints, see db_checkpoint
+	pager->hold_dirty = db->path != NULL;
+	db_index_table(db, db->num_tables);
+	db->num_tables++;
+	return table;
+}
+
+//Makes table the index of the table at position indexed_table on field.
+static bool db_link_index(Database* db, Table* table, uint32_t indexed_table, const DbField* field) {
+	if(indexed_table >= table->id || db->tables[indexed_table]->indexed_table != UINT32_MAX) {
+		return false;
+	}
+	Table* indexed = db->tables[indexed_table];
+	if(table->index_buffer == NULL) {
+		table->index_buffer = malloc(table->cell_size);
+	}
+	uint32_t span = field->offset + field->len > indexed->index_span ? field->offset + field->len : indexed->index_span;
+	uint8_t* row = realloc(indexed->index_buffer, span);
+	if(table->index_buffer == NULL || row == NULL) {
+		return false;
+	}
+	indexed->index_buffer = row;
+	Table** indexes = realloc(indexed->indexes, sizeof(Table*)*(indexed->num_indexes + 1));
+	if(indexes == NULL) {
+		return false;
+	}
+	table->indexed_table = indexed_table;
+	table->field = *field;
+	indexes[indexed->num_indexes] = table;
+	indexed->indexes = indexes;
+	indexed->num_indexes++;
+	indexed->index_span = span;
+	return true;
+}
+
+static Table* db_add_table(Database* db, const char* name, uint32_t cell_size, const TableOptions* options) {
+	Pager* pager;
+	if(db->path == NULL) {
+		pager = db_open_pager(options->page_size);
+	} else {
+		char* path = db_table_path(db, name);
+		pager = db_open_file_pager(path, db->pool_pages, options->page_size);
+		free(path);
+		if(pager != NULL) {
+			pager->on_load = node_reset_latch;
+		}
+	}
+	if(pager == NULL) {
+		return NULL;
+	}
+	return db_add_table_pager(db, name, cell_size, options, pager);
+}
+
+//Gives a new table an empty leaf as its root, and writes it out right away
+//for a table kept in a file, as checkpoints only cover logged changes.
+static DbResult db_init_root(Table* table) {
+	Pager* pager = table->pager;
+	if(db_get_unused_page(pager) == PAGE_NONE) {
+		return DB_ERROR_NO_MEMORY;
+	}
+
+	Node *node = db_get_page(pager, 0);
+	if(node == NULL) {
+		return DB_ERROR_IO;
+	}
+	node_clear(table, node);
+	node->num_cells = 0;
+	node->next_leaf = 0;
+	node->parent = 0;
+	node->type = NODE_LEAF;
+	db_mark_dirty(pager, 0);
+	db_release_page(pager, 0);
+	return db_flush_pager(pager) ? DB_OK : DB_ERROR_IO;
+}
+
+typedef struct {
+	Database* db;
+	uint32_t checkpoints;
+	uint32_t seen;
+} Recovery;
+
+static void db_count_checkpoints(void* context, const WalRecord* record, const void* payload) {
+	(void)payload;
+	if(record->type == WAL_CHECKPOINT) {
+		((Recovery*)context)->checkpoints++;
+	}
+}
+
+/*
+Puts back the page images of the last checkpoint the log holds in full,
+then redoes the changes logged after it. Page images of a checkpoint cut
+short by a crash are passed over, as the page files were not touched yet.
+*/
+static void db_redo(void* context, const WalRecord* record, const void* payload) {
+	Recovery* recovery = context;
+	if(record->type == WAL_CHECKPOINT) {
+		recovery->seen++;
+		return;
+	}
+	if(record->table >= recovery->db->num_tables) {
+		return;
+	}
+	Table* table = recovery->db->tables[record->table];
+	bool images = recovery->seen + 1 == recovery->checkpoints;
+	bool changes = recovery->seen == recovery->checkpoints;
+	if(record->type == WAL_PAGE && images && record->size == table->options.page_size) {
+		db_write_page(table->pager, record->page, payload);
+	} else if(record->type == WAL_HEADER && images && record->size == sizeof(PagerHeader)) {
+		db_set_pager_header(table->pager, payload);
+	} else if(record->type == WAL_UPSERT && changes) {
+		db_table_upsert_record(table, payload, record->size);
+	} else if(record->type == WAL_DELETE && changes && record->size == sizeof(uuid_t)) {
+		db_table_delete(table, (uint8_t*)payload);
+	}
+}
+
+//Replays the log into the tables, which are not logging yet, and writes
+//the result out so the log can start over.
+static bool db_recover(Database* db, const char* wal_path) {
+	Recovery recovery;
+	recovery.db = db;
+	recovery.checkpoints = 0;
+	recovery.seen = 0;
+	if(!db_wal_replay(wal_path, db_count_checkpoints, &recovery) || !db_wal_replay(wal_path, db_redo, &recovery)) {
+		return false;
+	}
+	bool ok = true;
+	for(uint32_t i=0; i<db->num_tables; ++i) {
+		ok = db_flush_pager(db->tables[i]->pager) && ok;
+	}
+	return ok;
+}
+
+Database* db_open_file(const char* path, uint32_t pool_pages) {
+	if(mkdir(path, 0755) != 0 && errno != EEXIST) {
+		return NULL;
+	}
+	Database* db = db_open();
+	db->path = malloc(strlen(path) + 1);
+	strcpy(db->path, path);
+	db->pool_pages = pool_pages;
+
+	char* catalog = db_catalog_path(db);
+	int fd = open(catalog, O_RDONLY);
+	free(catalog);
+	if(fd >= 0) {
+		CatalogEntry entry;
+		while(read(fd, &entry, sizeof(entry)) == sizeof(entry)) {
+			entry.name[64] = '\0';
+			Table* table = db_add_table(db, entry.name, entry.cell_size, &entry.options);
+			//A crash can come between writing the catalog and the new root
+			if(table == NULL || (table->pager->num_pages == 0 && db_init_root(table) != DB_OK)
+					|| (entry.indexed_table != UINT32_MAX && !db_link_index(db, table, entry.indexed_table, &entry.field))) {
+				close(fd);
+				db_close(db);
+				return NULL;
+			}
+		}
+		close(fd);
+	}
+
+	char* wal_path = db_wal_path(db);
+	if(db_recover(db, wal_path)) {
+		db->wal = db_open_wal(wal_path, DB_SYNC_FULL);
+	}
+	free(wal_path);
+	if(db->wal == NULL || !db_wal_truncate(db->wal)) {
+		db_close(db);
+		return NULL;
+	}
+	return db;
+}
+
+static void db_free_table(Table* table) {
+	db_close_pager(table->pager);
+	pthread_mutex_destroy(&table->index_lock);
+	pthread_mutex_destroy(&table->scratch_lock);
+	free(table->indexes);
+	free(table->index_buffer);
+	free(table->scratch);
+	free(table);
+}
+
+//Takes back the table added last, which nothing refers to yet, and removes
+//its file.
+static void db_drop_last_table(Database* db) {
+	Table* table = db->tables[--db->num_tables];
+	char* path = db->path != NULL ? db_table_path(db, table->name) : NULL;
+	db_free_table(table);
+	if(path != NULL) {
+		unlink(path);
+		free(path);
+	}
+	for(uint32_t i=0; i<db->index_size; ++i) {
+		db->index[i] = UINT32_MAX;
+	}
+	for(uint32_t i=0; i<db->num_tables; ++i) {
+		db_index_table(db, i);
+	}
+}
+
+void db_close(Database* db) {
+	if(db->wal != NULL) {
+		db_checkpoint(db);
+		db_close_wal(db->wal);
+	}
+	for(uint32_t i=0; i<db->num_tables; ++i) {
+		db_free_table(db->tables[i]);
+	}
+	free(db->tables);
+	free(db->index);
+	free(db->path);
+	if(db->snapshot != NULL) {
+		munmap(db->snapshot, db->snapshot_size);
+	}
+	pthread_rwlock_destroy(&db->checkpoint_lock);
+	free(db);
+}
+
+void db_set_sync_mode(Database* db, DbSyncMode mode) {
+	if(db->wal != NULL) {
+		pthread_mutex_lock(&db->wal->lock);
+		db->wal->mode = mode;
+		pthread_mutex_unlock(&db->wal->lock);
+	}
+}
+
+//Makes every change so far durable, whatever the sync mode.
+DbResult db_sync(Database* db) {
+	if(db->wal != NULL && !db_wal_sync(db->wal)) {
+		return DB_ERROR_IO;
+	}
+	return DB_OK;
+}
+
+static void db_log_page(void* context, uint32_t n, const void* page) {
+	Table* table = context;
+	db_wal_append(table->db->wal, WAL_PAGE, table->id, n, page, table->options.page_size);
+}
+
+/*
+Writes every dirty page out and empties the log, with changes held off.
+The pages and pager headers are logged and synced first, so a crash while
+they are written to the page files leaves a whole copy in the log.
+db_checkpoint_locked is for callers already holding the checkpoint lock.
+*/
+static DbResult db_checkpoint_locked(Database* db) {
+	for(uint32_t i=0; i<db->num_tables; ++i) {
+		Table* table = db->tables[i];
+		db_for_each_dirty_page(table->pager, db_log_page, table);
+		PagerHeader header;
+		db_get_pager_header(table->pager, &header);
+		db_wal_append(db->wal, WAL_HEADER, table->id, 0, &header, sizeof(header));
+	}
+	db_wal_append(db->wal, WAL_CHECKPOINT, 0, 0, NULL, 0);
+	bool ok = db_wal_sync(db->wal);
+	//The log is only emptied once every page file holds its pages
+	for(uint32_t i=0; ok && i<db->num_tables; ++i) {
+		ok = db_flush_pager(db->tables[i]->pager);
+	}
+	ok = ok && db_wal_truncate(db->wal);
+	return ok ? DB_OK : DB_ERROR_IO;
+}
+
+DbResult db_checkpoint(Database* db) {
+	if(db->wal == NULL) {
+		return DB_OK;
+	}
+	pthread_rwlock_wrlock(&db->checkpoint_lock);
+	DbResult result = db_checkpoint_locked(db);
+	pthread_rwlock_unlock(&db->checkpoint_lock);
+	return result;
+}
+
+#define SNAPSHOT_MAGIC "SMSNAP"
+
+typedef struct {
+	char magic[8];
+	uint32_t num_tables;
+	uint32_t header_pages;
+} SnapshotHeader;
+
+typedef struct {
+	char name[65];
+	uint32_t cell_size;
+	TableOptions options;
+	uint32_t indexed_table;
+	DbField field;
+	//Counted in PAGE_SIZE blocks, which every page size is a multiple of
+	uint64_t first_page;
+	PagerHeader pages;
+} SnapshotTable;
+
+static uint32_t snapshot_header_pages(uint32_t num_tables) {
+	size_t size = sizeof(SnapshotHeader) + sizeof(SnapshotTable)*(size_t)num_tables;
+	return (size + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+static bool db_write_snapshot(Database* db, FILE* file) {
+	uint32_t header_pages = snapshot_header_pages(db->num_tables);
+	uint8_t* header = calloc(header_pages, PAGE_SIZE);
+	if(header == NULL) {
+		return false;
+	}
+	SnapshotHeader* snapshot = (SnapshotHeader*)header;
+	strcpy(snapshot->magic, SNAPSHOT_MAGIC);
+	snapshot->num_tables = db->num_tables;
+	snapshot->header_pages = header_pages;
+	SnapshotTable* entries = (SnapshotTable*)(header + sizeof(SnapshotHeader));
+	uint64_t first_page = header_pages;
+	for(uint32_t i=0; i<db->num_tables; ++i) {
+		memcpy(entries[i].name, db->tables[i]->name, sizeof(entries[i].name));
+		entries[i].cell_size = db->tables[i]->cell_size;
+		entries[i].options = db->tables[i]->options;
+		entries[i].indexed_table = db->tables[i]->indexed_table;
+		entries[i].field = db->tables[i]->field;
+		entries[i].first_page = first_page;
+		db_get_pager_header(db->tables[i]->pager, &entries[i].pages);
+		first_page += (uint64_t)entries[i].pages.num_pages * (entries[i].pages.page_size / PAGE_SIZE);
+	}
+	bool ok = fwrite(header, PAGE_SIZE, header_pages, file) == header_pages;
+
+	uint8_t* page = malloc(MAX_PAGE_SIZE);
+	ok = ok && page != NULL;
+	for(uint32_t i=0; ok && i<db->num_tables; ++i) {
+		Pager* pager = db->tables[i]->pager;
+		uint32_t page_size = pager->page_size;
+		for(uint32_t n=0; ok && n<entries[i].pages.num_pages; ++n) {
+			uint8_t* data = db_get_page(pager, n);
+			if(data == NULL) {
+				ok = false;
+				break;
+			}
+			memcpy(page + NODE_LATCH_SIZE, data + NODE_LATCH_SIZE, page_size - NODE_LATCH_SIZE);
+			db_release_page(pager, n);
+			memset(page, 0, NODE_LATCH_SIZE);
+			ok = fwrite(page, page_size, 1, file) == 1;
+		}
+	}
+	free(page);
+	free(header);
+	return ok;
+}
+
+/*
+Writes every table, catalog and pages alike, to a single snapshot file that
+db_open_snapshot can map straight back in. Changes are held off while it is
+written. The file is written beside path and renamed over it once synced,
+so a crash leaves either the old snapshot or the new one.
+*/
+DbResult db_save_snapshot(Database* db, const char* path) {
+	size_t len = strlen(path) + 5;
+	char* temp = malloc(len);
+	if(temp == NULL) {
+		return DB_ERROR_NO_MEMORY;
+	}
+	snprintf(temp, len, "%s.new", path);
+	FILE* file = fopen(temp, "wb");
+	if(file == NULL) {
+		free(temp);
+		return DB_ERROR_IO;
+	}
+	pthread_rwlock_wrlock(&db->checkpoint_lock);
+	bool ok = db_write_snapshot(db, file);
+	pthread_rwlock_unlock(&db->checkpoint_lock);
+	ok = fflush(file) == 0 && ok;
+	ok = fsync(fileno(file)) == 0 && ok;
+	ok = fclose(file) == 0 && ok;
+	ok = ok && rename(temp, path) == 0;
+	if(!ok) {
+		unlink(temp);
+	}
+	free(temp);
+	return ok ? DB_OK : DB_ERROR_IO;
+}
+
+/*
+Maps a snapshot and opens its tables without reading it, so pages are only
+read in when first touched. A writable mapping is private, with changed
+pages copied rather than written back and new ones coming from the heap.
+A read only one is shared with every other process mapping the file, and
+its pages are used in place.
+*/
+static Database* db_map_snapshot(const char* path, bool read_only) {
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+		close(fd);
+		return NULL;
+	}
+	uint8_t* map;
+	if(read_only) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	} else {
+		map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if(map == MAP_FAILED) {
+		return NULL;
+	}
+	Database* db = db_open();
+	db->snapshot = map;
+	db->snapshot_size = st.st_size;
+	db->read_only = read_only;
+
+	SnapshotHeader* header = (SnapshotHeader*)map;
+	uint64_t file_pages = st.st_size / PAGE_SIZE;
+	if(strcmp(header->magic, SNAPSHOT_MAGIC) != 0 || header->header_pages != snapshot_header_pages(header->num_tables) || header->header_pages > file_pages) {
+		db_close(db);
+		return NULL;
+	}
+	SnapshotTable* entries = (SnapshotTable*)(map + sizeof(SnapshotHeader));
+	for(uint32_t i=0; i<header->num_tables; ++i) {
+		SnapshotTable* entry = &entries[i];
+		char name[65];
+		memcpy(name, entry->name, 64);
+		name[64] = '\0';
+		uint64_t blocks = (uint64_t)entry->pages.num_pages * (entry->pages.page_size / PAGE_SIZE);
+		if(!db_valid_page_size(entry->pages.page_size) || entry->pages.page_size != entry->options.page_size
+				|| entry->first_page > file_pages || blocks > file_pages - entry->first_page) {
+			db_close(db);
+			return NULL;
+		}
+		uint8_t* pages = map + entry->first_page*PAGE_SIZE;
+		Table* table;
+		if(read_only) {
+			Pager* pager = db_open_mapped_pager(pages, &entry->pages);
+			table = pager == NULL ? NULL : db_add_table_pager(db, name, entry->cell_size, &entry->options, pager);
+		} else {
+			table = db_add_table(db, name, entry->cell_size, &entry->options);
+			if(table != NULL && !db_map_pages(table->pager, pages, &entry->pages)) {
+				table = NULL;
+			}
+		}
+		if(table == NULL || (entry->indexed_table != UINT32_MAX && !db_link_index(db, table, entry->indexed_table, &entry->field))) {
+			db_close(db);
+			return NULL;
+		}
+	}
+	return db;
+}
+
+Database* db_open_snapshot(const char* path) {
+	return db_map_snapshot(path, false);
+}
+
+//Opens a snapshot for lookups and scans only. Changes to it are refused.
+Database* db_open_readonly(const char* path) {
+	return db_map_snapshot(path, true);
+}
+
+uint32_t db_find_table(Database* db, const char* name) {
+	if(db->index_size == 0) {
+		return UINT32_MAX;
+	}
+	uint32_t mask = db->index_size - 1;
+	uint32_t slot = table_name_hash(name) & mask;
+	while(db->index[slot] != UINT32_MAX) {
+		uint32_t i = db->index[slot];
+		if(strncmp(name, db->tables[i]->name, 64) == 0) {
+			return i;
+		}
+		slot = (slot + 1) & mask;
+	}
+	return UINT32_MAX;
+}
+
+TableHandle db_get_table(Database* db, const char* name) {
+	uint32_t i = db_find_table(db, name);
+	if(i == UINT32_MAX) {
+		return NULL;
+	}
+	return db->tables[i];
+}
+
+//Adds a table to the end of the catalog of a database kept in files, and
+//returns false if it is not there for certain. A partly written entry is
+//cut off again so the next one starts where it should.
+static bool db_write_catalog(Database* db, Table* table) {
+	CatalogEntry entry;
+	memset(&entry, 0, sizeof(entry));
+	memcpy(entry.name, table->name, sizeof(entry.name));
+	entry.cell_size = table->cell_size;
+	entry.options = table->options;
+	entry.indexed_table = table->indexed_table;
+	entry.field = table->field;
+	char* catalog = db_catalog_path(db);
+	int fd = open(catalog, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	free(catalog);
+	if(fd < 0) {
+		return false;
+	}
+	off_t end = lseek(fd, 0, SEEK_END);
+	bool ok = end >= 0 && write(fd, &entry, sizeof(entry)) == sizeof(entry) && fsync(fd) == 0;
+	if(!ok && end >= 0 && ftruncate(fd, end) == 0) {
+		fsync(fd);
+	}
+	close(fd);
+	return ok;
+}
+
+DbResult db_create_table(Database* db, const char* name, uint32_t cell_size) {
+	TableOptions options;
+	memset(&options, 0, sizeof(options));
+	return db_create_table_with_options(db, name, cell_size, &options);
+}
+
+DbResult db_create_table_with_options(Database* db, const char* name, uint32_t cell_size, const TableOptions* options) {
+	if(db->read_only) {
+		return DB_ERROR_READ_ONLY;
+	}
+	if(db_find_table(db, name) != UINT32_MAX) {
+		return DB_ERROR_TABLE_EXISTS;
+	}
+	TableOptions chosen = *options;
+	if(chosen.page_size == 0) {
+		chosen.page_size = PAGE_SIZE;
+	}
+	if(!db_valid_page_size(chosen.page_size)) {
+		return DB_ERROR_PAGE_SIZE;
+	}
+	options = &chosen;
+	if(options->variable_rows && (cell_size < sizeof(uuid_t) || cell_size > DB_MAX_ROW_SIZE)) {
+		return DB_ERROR_ROW_SIZE;
+	}
+	Table* table = db_add_table(db, name, cell_size, options);
+	if(table == NULL) {
+		return DB_ERROR_NO_MEMORY;
+	}
+//	printf("Leaf max cells: %i\n", leaf_max_cells(table));
+//	printf("Leaf node size: %li\n", sizeof(uint32_t)*2 + cell_size*(leaf_max_cells(table)));
+
+	if(db->path != NULL && !db_write_catalog(db, table)) {
+		db_drop_last_table(db);
+		return DB_ERROR_IO;
+	}
+
+	if(table->pager->num_pages > 0) {
+		//Reopened a table file that already holds its root
+		return DB_OK;
+	}
+	return db_init_root(table);
+}
+
+const char* db_first_table(Database* db) {
+	return db->tables[0]->name;
+}
+
+const char* db_next_table(Database* db, const char* name) {
+	uint32_t i = db_find_table(db, name);
+	while(++i < db->num_tables) {
+		if(db->tables[i]->indexed_table == UINT32_MAX) {
+			return db->tables[i]->name;
+		}
+	}
+	return NULL;
+}
+
+//Entries moved to the new node when a node split by appending.
+static uint32_t split_cells(uint32_t max_cells) {
+	return max_cells/10 > 0 ? max_cells/10 : 1;
+}
+
+//The key a node's parent keeps for it, that of its last cell or child.
+static void node_last_key(Table* table, Node* node, uuid_t key) {
+	if(node->type == NODE_LEAF) {
+		uuid_copy(key, leaf_cell(table, node, node->num_cells-1));
+	} else {
+		internal_key(node, node->num_cells-1, key);
+	}
+}
+
+//Unpacks a parent's children and adds next_page, split off from the child
+//node at page, right after it. Returns the new number of children.
+static uint32_t db_internal_insert(Table* table, Node* parent, Child* children, uint32_t page, Node* node, uint32_t next_page) {
+	uint32_t num_cells = internal_unpack(parent, children);
+	for(uint32_t i=0; i<num_cells; ++i) {
+		if(children[i].page == page) {
+			//The last child of a node can hold keys above its own key, so the
+			//right half keeps the bound the whole node had
+			memmove(children+i+2, children+i+1, sizeof(Child)*(num_cells-i-1));
+			uuid_copy(children[i+1].key, children[i].key);
+			children[i+1].page = next_page;
+			node_last_key(table, node, children[i].key);
+			return num_cells + 1;
+		}
+	}
+	//printf("NOPE\n");
+	return num_cells;
+}
+
+//How many of num_cells children a splitting internal node keeps, the rest
+//going to the new node. A packed node can only split where both halves fit,
+//which is next to the key that broke the shared prefix if one did.
+static uint32_t internal_split_point(Table* table, bool packed, const Child* children, uint32_t num_cells, bool append) {
+	uint32_t keep = num_cells - (append ? split_cells(num_cells) : num_cells/2);
+	if(!packed) {
+		return keep;
+	}
+	for(uint32_t d=0; d<num_cells; ++d) {
+		if(keep > d && internal_fits_split(table, packed, children, num_cells, keep - d)) {
+			return keep - d;
+		}
+		if(internal_fits_split(table, packed, children, num_cells, keep + d)) {
+			return keep + d;
+		}
+	}
+	return keep;
+}
+
+/*
+Points children start to end of an internal node back at it. A child may
+already be latched further down this thread's path, so it is not latched
+here. The link is only read by writers holding the old or new parent, and
+the version bump tells optimistic readers the child has moved.
+*/
+void db_adopt_range(Table* table, Node* node, uint32_t page, uint32_t start, uint32_t end) {
+	for(uint32_t i = start; i < end; ++i) {
+		uint32_t child_page = internal_child(node, i);
+		Node* child_node = db_get_page(table->pager, child_page);
+		child_node->parent = page;
+		__atomic_fetch_add(&child_node->version, 1, __ATOMIC_RELEASE);
+		db_mark_dirty(table->pager, child_page);
+		db_release_page(table->pager, child_page);
+	}
+}
+
+//Points every child of an internal node back at it.
+void db_adopt_children(Table* table, Node* node, uint32_t page) {
+	db_adopt_range(table, node, page, 0, node->num_cells);
+}
+
+//Takes a page reserved for a new node and returns it cleared and latched.
+static Node* db_new_node(Table* table, uint32_t* page, uint32_t* allocated) {
+	*page = db_get_unused_page(table->pager);
+	++*allocated;
+	Node* node = db_latch_page(table, *page, true);
+	node_clear(table, node);
+	return node;
+}
+
+//Descends to the leaf that holds or would hold key, coupling shared latches
+//on the way, and returns it pinned and latched, exclusively if asked to.
+static Node* db_crab_leaf(Table* table, const uuid_t key, bool exclusive, uint32_t* page_out) {
+	if(table->db->read_only) {
+		//Read only pages can not be latched, and optimistic reads of them
+		//only fail on a damaged tree
+		return NULL;
+	}
+	Pager* pager = table->pager;
+	while(true) {
+		uint32_t page = 0;
+		Node* node = db_latch_page(table, page, false);
+		if(node == NULL) {
+			return NULL;
+		}
+		if(node->type == NODE_LEAF && exclusive) {
+			//The root is the only node that can change type while it is reachable
+			db_unlatch_page(table, page, node, false);
+			node = db_latch_page(table, page, true);
+			if(node->type != NODE_LEAF) {
+				db_unlatch_page(table, page, node, true);
+				continue;
+			}
+		}
+		while(node->type == NODE_INTERNAL) {
+			uint32_t child_page = internal_node_child_page(table, node, node->num_cells, key);
+			Node* child = db_get_page(pager, child_page);
+			if(child == NULL) {
+				db_unlatch_page(table, page, node, false);
+				return NULL;
+			}
+			//A child keeps its type for as long as its parent is latched
+			if(child->type == NODE_LEAF && exclusive) {
+				node_latch_exclusive(child);
+			} else {
+				node_latch_shared(child);
+			}
+			db_unlatch_page(table, page, node, false);
+			page = child_page;
+			node = child;
+		}
+		*page_out = page;
+		return node;
+	}
+}
+
+/*
+Descends to the leaf that holds or would hold key without latching, and
+returns it pinned along with the version its reads must be validated
+against. Each child is checked against its parent's version both before it
+is looked up and after its own version is taken, so the leaf was the right
+one at that version. After too many restarts the leaf is found by crabbing.
+*/
+static Node* db_read_leaf(Table* table, const uuid_t key, uint32_t* page_out, uint32_t* version) {
+	Pager* pager = table->pager;
+	for(uint32_t tries = 0; tries < OPTIMISTIC_TRIES; ++tries) {
+		uint32_t page = 0;
+		uint32_t v;
+		Node* node = db_get_page(pager, page);
+		if(node == NULL) {
+			return NULL;
+		}
+		bool valid = node_read_begin(node, &v);
+		while(valid && node->type == NODE_INTERNAL) {
+			uint32_t child_page = internal_node_child_page(table, node, node->num_cells, key);
+			if(child_page == PAGE_NONE || !node_read_valid(node, v)) {
+				valid = false;
+				break;
+			}
+			Node* child = db_get_page(pager, child_page);
+			if(child == NULL) {
+				db_release_page(pager, page);
+				return NULL;
+			}
+			uint32_t child_version;
+			valid = node_read_begin(child, &child_version) && node_read_valid(node, v);
+			db_release_page(pager, page);
+			page = child_page;
+			node = child;
+			v = child_version;
+		}
+		if(valid && node->type == NODE_LEAF) {
+			*page_out = page;
+			*version = v;
+			return node;
+		}
+		db_release_page(pager, page);
+	}
+	Node* node = db_crab_leaf(table, key, false, page_out);
+	if(node != NULL) {
+		*version = __atomic_load_n(&node->version, __ATOMIC_ACQUIRE);
+		node_unlatch_shared(node);
+	}
+	return node;
+}
+
+//Returns the leaf that holds or would hold key pinned and latched. Shared
+//latches are coupled down the tree, an exclusive one is taken on the leaf
+//found by an optimistic descent as long as the leaf did not change since.
+static Node* db_latch_leaf(Table* table, const uuid_t key, bool exclusive, uint32_t* page_out) {
+	if(!exclusive) {
+		return db_crab_leaf(table, key, false, page_out);
+	}
+	for(uint32_t tries = 0; tries < OPTIMISTIC_TRIES; ++tries) {
+		uint32_t version;
+		Node* node = db_read_leaf(table, key, page_out, &version);
+		if(node == NULL) {
+			return NULL;
+		}
+		node_latch_exclusive(node);
+		if(__atomic_load_n(&node->version, __ATOMIC_RELAXED) == version) {
+			return node;
+		}
+		db_unlatch_page(table, *page_out, node, true);
+	}
+	return db_crab_leaf(table, key, true, page_out);
+}
+
+//Logs a change to a table in a file. Called with the changed node still
+//latched, so changes to a key are logged in the order they were made.
+//Changes to indexes are not logged, redoing the row's change redoes them.
+static uint64_t db_log(Table* table, uint32_t type, const void* payload, uint32_t size) {
+	if(table->db->wal == NULL || table->indexed_table != UINT32_MAX) {
+		return 0;
+	}
+	return db_wal_append(table->db->wal, type, table->id, 0, payload, size);
+}
+
+//Keeps checkpoints and snapshots out while a change is made and logged.
+static void db_begin_change(Table* table) {
+	pthread_rwlock_rdlock(&table->db->checkpoint_lock);
+}
+
+//Whether a table or one of its indexes holds enough dirty pages to checkpoint.
+static bool db_table_needs_flush(Table* table) {
+	bool flush = db_pager_needs_flush(table->pager);
+	for(uint32_t i=0; i<table->num_indexes && !flush; ++i) {
+		flush = db_pager_needs_flush(table->indexes[i]->pager);
+	}
+	return flush;
+}
+
+//Waits for the change's log record as the sync mode asks, once the latches
+//are let go so other writers can join the same sync, and checkpoints when
+//the table holds enough dirty pages.
+static DbResult db_end_change(Table* table, DbResult result, uint64_t position) {
+	Database* db = table->db;
+	pthread_rwlock_unlock(&db->checkpoint_lock);
+	if(db->wal == NULL) {
+		return result;
+	}
+	if(position > 0 && !db_wal_commit(db->wal, position) && result == DB_OK) {
+		result = DB_ERROR_IO;
+	}
+	if(db_table_needs_flush(table) && db_checkpoint(db) != DB_OK && result == DB_OK) {
+		result = DB_ERROR_IO;
+	}
+	return result;
+}
+
+typedef enum {
+	PUT_INSERT,
+	PUT_UPSERT,
+	PUT_UPDATE
+} PutMode;
+
+//A row on its way into a table, along with the cell its leaf keeps it in.
+typedef struct {
+	const uint8_t* row;
+	uint32_t size;
+	PutMode mode;
+	DbMergeFunc merge;
+	void* context;
+	LeafCell cell;
+	uint8_t overflow[OVERFLOW_CELL_SIZE];
+} Put;
+
+//Whether a row of size bytes can go in a table.
+static bool table_row_size_fits(Table* table, uint32_t size) {
+	if(!table_variable(table)) {
+		return size == table->cell_size;
+	}
+	return size >= sizeof(uuid_t) && size <= table->cell_size;
+}
+
+//Makes the cell a row is kept in, writing the rows that do not fit in a
+//leaf with others to overflow pages.
+static DbResult db_make_cell(Table* table, Put* put) {
+	put->cell.data = put->row;
+	put->cell.size = put->size;
+	put->cell.overflow = false;
+	if(!table_variable(table) || put->size <= max_inline_row(table)) {
+		return DB_OK;
+	}
+	put->cell.data = put->overflow;
+	put->cell.size = OVERFLOW_CELL_SIZE;
+	put->cell.overflow = true;
+	return db_write_overflow(table, put->row, put->size, put->overflow);
+}
+
+//Removes cell i of a leaf along with any overflow pages of its row.
+static void leaf_delete(Table* table, Node* node, uint32_t i) {
+	LeafCell cell = leaf_get_cell(table, node, i);
+	if(cell.overflow) {
+		db_free_overflow(table, cell.data);
+	}
+	leaf_remove(table, node, i, 1);
+}
+
+/*
+Puts a row in an exclusively latched leaf: when its key exists it either
+rejects it or, for an upsert or update, replaces the stored row or hands
+both to merge. A new row that would fill the leaf, or a replacement that
+does not fit in it, is left for the caller to split in.
+*/
+static bool db_leaf_put(Table* table, Node* node, uint32_t page, Put* put, DbResult* result, uint64_t* position) {
+	uint32_t cell_index = leaf_node_find_cell(table, node, put->row);
+	if(leaf_has_key(table, node, cell_index, put->row)) {
+		*result = DB_ERROR_KEY_EXISTS;
+		if(put->mode == PUT_INSERT) {
+			return true;
+		}
+		void* cell = leaf_cell(table, node, cell_index);
+		if(put->merge != NULL) {
+			put->merge(cell, put->row, put->context);
+			*position = db_log(table, WAL_UPSERT, cell, table->cell_size);
+		} else if(!table_variable(table)) {
+			memcpy(cell, put->row, table->cell_size);
+			*position = db_log(table, WAL_UPSERT, put->row, put->size);
+		} else {
+			uint32_t rest = leaf_bytes(table, node) - leaf_cell_size(table, node, cell_index);
+			if(rest + put->cell.size > node_space(table)) {
+				return false;
+			}
+			leaf_delete(table, node, cell_index);
+			leaf_insert(table, node, cell_index, &put->cell);
+			*position = db_log(table, WAL_UPSERT, put->row, put->size);
+		}
+		db_mark_dirty(table->pager, page);
+		*result = DB_OK;
+		return true;
+	}
+	if(put->mode == PUT_UPDATE) {
+		*result = DB_ERROR_NOT_FOUND;
+		return true;
+	}
+	if(!leaf_has_room(table, node, put->cell.size)) {
+		return false;
+	}
+	leaf_insert(table, node, cell_index, &put->cell);
+	db_mark_dirty(table->pager, page);
+	if(node->next_leaf == 0) {
+		__atomic_store_n(&table->append_page, page, __ATOMIC_RELEASE);
+	}
+	*position = db_log(table, WAL_UPSERT, put->row, put->size);
+	*result = DB_OK;
+	return true;
+}
+
+/*
+Where a full leaf splits once the new cell is counted in at cell_index:
+the cells before the returned index stay, the rest move to the new node.
+Fixed size leaves split by count, slotted ones by bytes, and either keeps
+nine tenths of them when appending.
+*/
+static uint32_t leaf_split_point(Table* table, Node* node, uint32_t cell_index, uint32_t cell_size, bool append) {
+	uint32_t num_cells = node->num_cells + 1;
+	if(!table_variable(table)) {
+		return num_cells - (append ? split_cells(leaf_max_cells(table)) : num_cells/2);
+	}
+	uint32_t sizes[num_cells];
+	uint32_t total = 0;
+	for(uint32_t i=0; i<num_cells; ++i) {
+		uint32_t size = i == cell_index ? cell_size : leaf_cell_size(table, node, i < cell_index ? i : i-1);
+		sizes[i] = leaf_entry_size(table, size);
+		total += sizes[i];
+	}
+	uint32_t target = append ? total - total/10 : total/2;
+	if(target > node_space(table) - SLOTTED_HEADER) {
+		target = node_space(table) - SLOTTED_HEADER;
+	}
+	uint32_t keep = 0;
+	uint32_t bytes = 0;
+	while(keep < num_cells - 1 && bytes + sizes[keep] <= target) {
+		bytes += sizes[keep++];
+	}
+	return keep > 0 ? keep : 1;
+}
+
+/*
+Splits a full leaf around a new cell that goes in as cell_index, and then
+each parent that the new node does not fit in. The caller holds exclusive
+latches on the leaf and on every parent that can split, has reserved a
+page for each new node, and passes room for packed_max_cells + 1 children.
+*/
+static void db_split(Table* table, Node* node, uint32_t page, const LeafCell* cell, uint32_t cell_index, bool append, Child* children, uint32_t* allocated) {
+	Pager* pager = table->pager;
+
+	//printf("Splitting page %i\n", page);
+	uint32_t next_page;
+	Node* next_node = db_new_node(table, &next_page, allocated);
+	next_node->type = NODE_LEAF;
+	next_node->parent = node->parent;
+	uint32_t split = leaf_split_point(table, node, cell_index, cell->size, append);
+	uint32_t move = cell_index < split ? split - 1 : split;
+	leaf_copy_cells(table, next_node, 0, node, move, node->num_cells - move);
+	leaf_remove(table, node, move, node->num_cells - move);
+	if(cell_index < split) {
+		leaf_insert(table, node, cell_index, cell);
+	} else {
+		leaf_insert(table, next_node, cell_index - move, cell);
+	}
+	next_node->next_leaf = node->next_leaf;
+	node->next_leaf = next_page;
+	db_mark_dirty(pager, page);
+	db_mark_dirty(pager, next_page);
+	if(next_node->next_leaf == 0) {
+		__atomic_store_n(&table->append_page, next_page, __ATOMIC_RELEASE);
+	}
+	//Each level releases the pin it takes on its node, the leaf's is the caller's
+	db_get_page(pager, page);
+
+//printf("internal loop\n");
+	while(page != 0) {
+		//printf("parent %i\n", node->parent);
+		uint32_t parent_page = node->parent;
+		Node* parent = db_get_page(pager, parent_page);
+		uint32_t num_cells = db_internal_insert(table, parent, children, page, node, next_page);
+//printf("internal insert\n");
+		db_unlatch_page(table, next_page, next_node, true);
+		db_release_page(pager, page);
+		page = parent_page;
+		node = parent;
+		db_mark_dirty(pager, page);
+		//if parent full, split it
+		if(internal_fits(table, node->packed, children, num_cells)) {
+			internal_pack(node, children, num_cells);
+			db_release_page(pager, page);
+			return;
+		}
+//printf("split\n");
+		next_node = db_new_node(table, &next_page, allocated);
+		//printf("next_page %i\n", next_page);
+		next_node->type = NODE_INTERNAL;
+		next_node->packed = node->packed;
+		next_node->parent = node->parent;
+		uint32_t keep = internal_split_point(table, node->packed, children, num_cells, append);
+		internal_pack(node, children, keep);
+		internal_pack(next_node, children + keep, num_cells - keep);
+		db_mark_dirty(pager, next_page);
+
+		//Update parent on children
+		db_adopt_children(table, next_node, next_page);
+	}
+
+	//Need to create new root, the root stays in page 0 so its entries move to a new child
+	uint32_t child_page;
+	Node* child_node = db_new_node(table, &child_page, allocated);
+	//printf("child_page %i\n", child_page);
+	node_copy(table, child_node, node);
+	node_clear(table, node);
+
+	node->type = NODE_INTERNAL;
+	node->packed = table->options.compress_keys;
+	node->parent = 0;
+
+	if(child_node->type == NODE_INTERNAL) {
+		//Update parent on children
+		db_adopt_children(table, child_node, child_page);
+	}
+	node_last_key(table, child_node, children[0].key);
+	children[0].page = child_page;
+	child_node->parent = 0;
+	node_last_key(table, next_node, children[1].key);
+	children[1].page = next_page;
+	next_node->parent = 0;
+	internal_pack(node, children, 2);
+
+	db_mark_dirty(pager, 0);
+	db_mark_dirty(pager, child_page);
+	db_unlatch_page(table, child_page, child_node, true);
+	db_unlatch_page(table, next_page, next_node, true);
+	db_release_page(pager, 0);
+}
+
+//Releases the latches held on path from start on.
+static void db_unlatch_path(Table* table, uint32_t* path, Node** nodes, uint32_t start, uint32_t end) {
+	for(uint32_t i = start; i < end; ++i) {
+		db_unlatch_page(table, path[i], nodes[i], true);
+	}
+}
+
+static DbResult db_put_row(Table* table, Put* put, uint64_t* position) {
+	//char suuid[37];
+	//uuid_unparse(put->row, suuid);
+	//printf("Inserting UUID: %s\n", suuid);
+
+	Pager* pager = table->pager;
+	const uint8_t* data = put->row;
+
+	//Keys above the largest in the table go straight to the last leaf while it has room.
+	//The cached page is checked rather than invalidated, the last leaf is the only one without a next leaf.
+	uint32_t page = __atomic_load_n(&table->append_page, __ATOMIC_ACQUIRE);
+	if(page != PAGE_NONE && put->mode != PUT_UPDATE) {
+		Node* node = db_latch_page(table, page, true);
+		if(node == NULL) {
+			return DB_ERROR_IO;
+		}
+		if(node->type == NODE_LEAF && node->next_leaf == 0 && node->num_cells > 0 && leaf_has_room(table, node, put->cell.size)) {
+			void* last = leaf_cell(table, node, node->num_cells-1);
+			if(db_key_compare(*(uuid_t*)last, data) < 0) {
+				leaf_insert(table, node, node->num_cells, &put->cell);
+				db_mark_dirty(pager, page);
+				*position = db_log(table, WAL_UPSERT, data, put->size);
+				db_unlatch_page(table, page, node, true);
+				return DB_OK;
+			}
+		}
+		db_unlatch_page(table, page, node, true);
+	}
+
+	//Most rows fit in their leaf, which is then the only node latched exclusively
+	DbResult result;
+	Node* node = db_latch_leaf(table, data, true, &page);
+	if(node == NULL) {
+		return DB_ERROR_IO;
+	}
+	bool done = db_leaf_put(table, node, page, put, &result, position);
+	db_unlatch_page(table, page, node, true);
+	if(done) {
+		return result;
+	}
+
+	//Otherwise descend again latching exclusively, and let go of the nodes
+	//above any node that has room for one more entry
+	uint32_t path[MAX_TREE_DEPTH];
+	Node* nodes[MAX_TREE_DEPTH];
+	uint32_t top = 0;
+	uint32_t depth = 0;
+	page = 0;
+	node = db_latch_page(table, page, true);
+	if(node == NULL) {
+		return DB_ERROR_IO;
+	}
+	path[depth] = page;
+	nodes[depth++] = node;
+	while(node->type == NODE_INTERNAL) {
+		page = internal_node_child_page(table, node, node->num_cells, data);
+		node = db_latch_page(table, page, true);
+		if(node == NULL) {
+			db_unlatch_path(table, path, nodes, top, depth);
+			return DB_ERROR_IO;
+		}
+		bool room = node->type == NODE_LEAF ? leaf_has_room(table, node, put->cell.size) : internal_has_room(table, node);
+		if(room) {
+			db_unlatch_path(table, path, nodes, top, depth);
+			top = depth;
+		}
+		path[depth] = page;
+		nodes[depth++] = node;
+	}
+
+	if(db_leaf_put(table, node, page, put, &result, position)) {
+		db_unlatch_path(table, path, nodes, top, depth);
+		return result;
+	}
+
+	//A split can cascade through every latched level and then add a new root child
+	uint32_t reserved = depth - top + 1;
+	if(!db_reserve_pages(pager, reserved)) {
+		db_unlatch_path(table, path, nodes, top, depth);
+		return DB_ERROR_NO_MEMORY;
+	}
+	//Parents are unpacked into children, too many for the stack with large pages
+	Child* children = malloc(sizeof(Child)*(packed_max_cells(table) + 1));
+	if(children == NULL) {
+		db_unreserve_pages(pager, reserved);
+		db_unlatch_path(table, path, nodes, top, depth);
+		return DB_ERROR_NO_MEMORY;
+	}
+	uint32_t cell_index = leaf_node_find_cell(table, node, data);
+	if(leaf_has_key(table, node, cell_index, data)) {
+		//A row that outgrew its leaf is taken out and put back with a split
+		leaf_delete(table, node, cell_index);
+	}
+	//Appending to the last leaf leaves only a tenth of the cells in the new node,
+	//so tables filled in key order end up with packed nodes
+	bool append = node->next_leaf == 0 && cell_index == node->num_cells;
+	*position = db_log(table, WAL_UPSERT, data, put->size);
+	uint32_t allocated = 0;
+	db_split(table, node, page, &put->cell, cell_index, append, children, &allocated);
+	free(children);
+	db_unreserve_pages(pager, reserved - allocated);
+	db_unlatch_path(table, path, nodes, top, depth);
+	return DB_OK;
+}
+
+//Changes to tables with indexes go through these, see db_create_index.
+static DbResult db_put_indexed(Table* table, Put* put, uint64_t* position);
+static DbResult db_remove_indexed(Table* table, uuid_t id, uint64_t* position);
+static DbResult db_add_index_entries(Table* table, const uint8_t* old, uint32_t old_size, const uint8_t* row, uint32_t size);
+
+//Rows of tables with variable_rows are put with their size, and can not be
+//merged in place as their size may change.
+static DbResult db_insert_row(Table* table, const void* data, uint32_t size, PutMode mode, DbMergeFunc merge, void* context) {
+	if(table == NULL) {
+		return DB_ERROR_NO_TABLE;
+	}
+	if(table->db->read_only) {
+		return DB_ERROR_READ_ONLY;
+	}
+	if(!table_row_size_fits(table, size) || (merge != NULL && table_variable(table))) {
+		return DB_ERROR_ROW_SIZE;
+	}
+	Put put;
+	put.row = data;
+	put.size = size;
+	put.mode = mode;
+	put.merge = merge;
+	put.context = context;
+	uint64_t position = 0;
+	db_begin_change(table);
+	DbResult result = db_make_cell(table, &put);
+	if(result == DB_OK) {
+		if(table->num_indexes > 0) {
+			result = db_put_indexed(table, &put, &position);
+		} else {
+			result = db_put_row(table, &put, &position);
+		}
+		if(result != DB_OK && put.cell.overflow) {
+			//The row was not stored, so neither are its overflow pages
+			db_free_overflow(table, put.cell.data);
+		}
+	}
+	return db_end_change(table, result, position);
+}
+
+//The size a row put without one has, which only fixed size tables know.
+static uint32_t table_fixed_size(Table* table) {
+	return table == NULL || table_variable(table) ? 0 : table->cell_size;
+}
+
+DbResult db_table_insert(TableHandle table, void* data) {
+	return db_insert_row(table, data, table_fixed_size(table), PUT_INSERT, NULL, NULL);
+}
+
+DbResult db_table_upsert(TableHandle table, void* data, DbMergeFunc merge, void* context) {
+	return db_insert_row(table, data, table_fixed_size(table), PUT_UPSERT, merge, context);
+}
+
+DbResult db_table_insert_record(TableHandle table, const void* data, uint32_t size) {
+	return db_insert_row(table, data, size, PUT_INSERT, NULL, NULL);
+}
+
+DbResult db_table_upsert_record(TableHandle table, const void* data, uint32_t size) {
+	return db_insert_row(table, data, size, PUT_UPSERT, NULL, NULL);
+}
+
+DbResult db_table_update_record(TableHandle table, const void* data, uint32_t size) {
+	return db_insert_row(table, data, size, PUT_UPDATE, NULL, NULL);
+}
+
+DbResult db_insert(Database* db, const char* tablename, void* data) {
+	return db_table_insert(db_get_table(db, tablename), data);
+}
+
+DbResult db_upsert(Database* db, const char* tablename, void* data, DbMergeFunc merge, void* context) {
+	return db_table_upsert(db_get_table(db, tablename), data, merge, context);
+}
+
+DbResult db_insert_record(Database* db, const char* tablename, const void* data, uint32_t size) {
+	return db_table_insert_record(db_get_table(db, tablename), data, size);
+}
+
+DbResult db_upsert_record(Database* db, const char* tablename, const void* data, uint32_t size) {
+	return db_table_upsert_record(db_get_table(db, tablename), data, size);
+}
+
+DbResult db_update_record(Database* db, const char* tablename, const void* data, uint32_t size) {
+	return db_table_update_record(db_get_table(db, tablename), data, size);
+}
+
+//Nodes needed for one level of the tree, packing per_node entries into each
+//unless everything fits in a single node.
+static uint32_t bulk_level_nodes(uint32_t count, uint32_t max_cells, uint32_t per_node) {
+	if(count < max_cells) {
+		return 1;
+	}
+	return (count + per_node - 1) / per_node;
+}
+
+//First entry of node i when count entries are spread evenly over nodes.
+static uint32_t bulk_node_start(uint32_t i, uint32_t count, uint32_t nodes) {
+	return (uint64_t)i * count / nodes;
+}
+
+DbResult db_bulk_load(Database* db, const char* tablename, const void* rows, uint32_t n, uint32_t fill_percent) {
+	Table* table = db_get_table(db, tablename);
+	if(table == NULL) {
+		return DB_ERROR_NO_TABLE;
+	}
+	if(db->read_only) {
+		return DB_ERROR_READ_ONLY;
+	}
+	if(table_variable(table)) {
+		//Rows are laid out cell_size apart, which says nothing of their sizes
+		return DB_ERROR_ROW_SIZE;
+	}
+	if(n == 0) {
+		return DB_OK;
+	}
+	Pager* pager = table->pager;
+	const uint8_t* cells = rows;
+	uint32_t cell_size = table->cell_size;
+
+	KeyRef* refs = malloc(sizeof(KeyRef)*n);
+	if(refs == NULL) {
+		return DB_ERROR_NO_MEMORY;
+	}
+	for(uint32_t i=0; i<n; ++i) {
+		memcpy(refs[i].key, cells + (size_t)i*cell_size, sizeof(uuid_t));
+		refs[i].index = i;
+	}
+	if(!db_sort_keys(refs, n)) {
+		free(refs);
+		return DB_ERROR_NO_MEMORY;
+	}
+	//The sort is stable, so the last row of a run of equal keys is the newest
+	uint32_t m = 0;
+	for(uint32_t i=0; i<n; ++i) {
+		if(i+1 < n && db_key_compare(refs[i].key, refs[i+1].key) == 0) {
+			continue;
+		}
+		refs[m++] = refs[i];
+	}
+
+	/*
+	The root stays latched while the tree is built under it. Other changes
+	are held off for the whole load rather than only kept from checkpoints,
+	as the load checkpoints whenever the table holds enough dirty pages, so
+	the pool does not grow to the size of the table. Until the root takes
+	the new tree, a crash leaves the table as it was, less the pages taken.
+	*/
+	pthread_rwlock_wrlock(&db->checkpoint_lock);
+	Node* root = db_latch_page(table, 0, true);
+	if(root == NULL) {
+		free(refs);
+		return db_end_change(table, DB_ERROR_IO, 0);
+	}
+	bool empty = root->type == NODE_LEAF && root->num_cells == 0;
+
+	//Existing rows: upsert in key order, which keeps the descent path hot
+	if(!empty) {
+		db_unlatch_page(table, 0, root, true);
+		db_end_change(table, DB_OK, 0);
+		for(uint32_t i=0; i<m; ++i) {
+			DbResult result = db_insert_row(table, cells + (size_t)refs[i].index*cell_size, cell_size, PUT_UPSERT, NULL, NULL);
+			if(result != DB_OK) {
+				free(refs);
+				return result;
+			}
+		}
+		free(refs);
+		return DB_OK;
+	}
+
+	if(fill_percent == 0 || fill_percent > 100) {
+		fill_percent = 100;
+	}
+	uint32_t leaf_max = leaf_max_cells(table);
+	uint32_t per_leaf = leaf_max * fill_percent / 100;
+	if(per_leaf < 1) {
+		per_leaf = 1;
+	}
+	if(per_leaf > leaf_max - 1) {
+		per_leaf = leaf_max - 1;
+	}
+	uint32_t internal_max = internal_max_cells(table);
+	if(table->options.compress_keys) {
+		//Every node's keys share at least the prefix of the smallest and largest
+		uint32_t prefix = key_prefix(refs[0].key, refs[m-1].key, MAX_PACKED_PREFIX);
+		internal_max = (node_space(table) - PACKED_KEYS_OFFSET) / (sizeof(uint32_t) + sizeof(uuid_t) - prefix);
+	}
+	uint32_t per_internal = internal_max * fill_percent / 100;
+	if(per_internal < 2) {
+		per_internal = 2;
+	}
+	if(per_internal > internal_max - 1) {
+		per_internal = internal_max - 1;
+	}
+
+	uint32_t levels[32];
+	uint32_t level_start[32];
+	uint32_t num_levels = 0;
+	uint32_t count = bulk_level_nodes(m, leaf_max, per_leaf);
+	levels[num_levels++] = count;
+	uint32_t total_pages = 0;
+	while(count > 1) {
+		total_pages += count;
+		count = bulk_level_nodes(count, internal_max, per_internal);
+		levels[num_levels++] = count;
+	}
+
+	Child* keys = malloc(sizeof(Child)*levels[0]);
+	uint32_t* pages = malloc(sizeof(uint32_t)*(total_pages + 1));
+	if(keys == NULL || pages == NULL || !db_reserve_pages(pager, total_pages)) {
+		free(keys);
+		free(pages);
+		free(refs);
+		db_unlatch_page(table, 0, root, true);
+		return db_end_change(table, DB_ERROR_NO_MEMORY, 0);
+	}
+	//Pages may come from the free list in any order, so each level keeps its own.
+	//The top level is the root, which always lives in page 0
+	for(uint32_t i=0; i<total_pages; ++i) {
+		pages[i] = db_get_unused_page(pager);
+	}
+	pages[total_pages] = 0;
+	uint32_t first = 0;
+	for(uint32_t l=0; l<num_levels; ++l) {
+		level_start[l] = first;
+		first += levels[l];
+	}
+
+	for(uint32_t l=0; l<num_levels; ++l) {
+		uint32_t nodes = levels[l];
+		uint32_t entries = l == 0 ? m : levels[l-1];
+		uint32_t parent = 0;
+		for(uint32_t i=0; i<nodes; ++i) {
+			uint32_t start = bulk_node_start(i, entries, nodes);
+			uint32_t end = bulk_node_start(i+1, entries, nodes);
+			uint32_t page = pages[level_start[l] + i];
+			uint32_t parent_page = 0;
+			if(l+1 < num_levels) {
+				while(i >= bulk_node_start(parent+1, nodes, levels[l+1])) {
+					++parent;
+				}
+				parent_page = pages[level_start[l+1] + parent];
+			}
+
+			Node* node = page == 0 ? root : db_latch_page(table, page, true);
+			if(node == NULL) {
+				free(keys);
+				free(pages);
+				free(refs);
+				db_unlatch_page(table, 0, root, true);
+				return db_end_change(table, DB_ERROR_IO, 0);
+			}
+			node_clear(table, node);
+			node->num_cells = end - start;
+			node->parent = parent_page;
+			node->packed = l > 0 && table->options.compress_keys;
+			if(l == 0) {
+				node->type = NODE_LEAF;
+				node->next_leaf = i+1 < nodes ? pages[level_start[l] + i + 1] : 0;
+				for(uint32_t k=start; k<end; ++k) {
+					void* cell = leaf_node_cell(node, k-start, cell_size);
+					memcpy(cell, cells + (size_t)refs[k].index*cell_size, cell_size);
+				}
+				uuid_copy(keys[i].key, refs[end-1].key);
+			} else {
+				//Entries i and below have been consumed, so keys is reused in place
+				node->type = NODE_INTERNAL;
+				internal_pack(node, keys + start, end - start);
+				uuid_copy(keys[i].key, keys[end-1].key);
+			}
+			keys[i].page = page;
+			db_mark_dirty(pager, page);
+			if(page != 0) {
+				db_unlatch_page(table, page, node, true);
+			}
+			if(db->wal != NULL && db_pager_needs_flush(pager) && db_checkpoint_locked(db) != DB_OK) {
+				free(keys);
+				free(pages);
+				free(refs);
+				db_unlatch_page(table, 0, root, true);
+				return db_end_change(table, DB_ERROR_IO, 0);
+			}
+		}
+	}
+
+	db_unlatch_page(table, 0, root, true);
+	DbResult result = DB_OK;
+	if(table->num_indexes > 0) {
+		pthread_mutex_lock(&table->index_lock);
+		for(uint32_t i=0; i<m && result == DB_OK; ++i) {
+			result = db_add_index_entries(table, NULL, 0, cells + (size_t)refs[i].index*cell_size, cell_size);
+			if(result == DB_OK && db->wal != NULL && db_table_needs_flush(table)) {
+				result = db_checkpoint_locked(db);
+			}
+		}
+		pthread_mutex_unlock(&table->index_lock);
+	}
+	free(keys);
+	free(pages);
+	free(refs);
+	//The rows are not logged one by one, the new pages are checkpointed instead
+	db_end_change(table, result, 0);
+	return result == DB_OK ? db_checkpoint(db) : result;
+}
+
+DbResult db_update(Database* db, const char* tablename, void* data) {
+	return db_table_update(db_get_table(db, tablename), data);
+}
+
+DbResult db_table_update(TableHandle table, void* data) {
+	return db_insert_row(table, data, table_fixed_size(table), PUT_UPDATE, NULL, NULL);
+}
+
+//Unpins a sibling taken by db_rebalance, and unlatches it unless it is the
+//node being rebalanced, whose latch belongs to the caller.
+static void db_rebalance_release(Table* table, uint32_t page, uint32_t sibling_page, Node* sibling) {
+	if(sibling_page == page) {
+		db_release_page(table->pager, sibling_page);
+	} else {
+		db_unlatch_page(table, sibling_page, sibling, true);
+	}
+}
+
+static uint32_t node_max_cells(Table* table, Node* node) {
+	return node->type == NODE_LEAF ? leaf_max_cells(table) : internal_max_cells(table);
+}
+
+//Whether a node holds too little to be left alone. Slotted leaves go by
+//bytes and only count as underfull below a quarter, as a move between two
+//of them can not always even them out.
+static bool node_underfull(Table* table, Node* node) {
+	if(node->num_cells == 0) {
+		return true;
+	}
+	if(node->type == NODE_LEAF && table_variable(table)) {
+		return leaf_bytes(table, node) < node_space(table)/4;
+	}
+	return node->num_cells < (node_max_cells(table, node) - 1) / 2;
+}
+
+//Whether a node stays full enough after losing an entry, which for a leaf
+//is a cell of cell_size bytes.
+static bool node_can_shrink(Table* table, Node* node, uint32_t page, uint32_t cell_size) {
+	if(page == 0) {
+		return node->type == NODE_LEAF || node->num_cells > 2;
+	}
+	uint32_t n = node->num_cells - 1u;
+	if(node->type == NODE_LEAF && table_variable(table)) {
+		return n > 0 && leaf_bytes(table, node) - leaf_entry_size(table, cell_size) >= node_space(table)/4;
+	}
+	return n > 0 && n >= (node_max_cells(table, node) - 1) / 2;
+}
+
+//Replaces a root left with a single child by that child. The caller holds
+//exclusive latches on both.
+static void db_collapse_root(Table* table, Node* root, uint32_t child_page, Node* child) {
+	Pager* pager = table->pager;
+	node_copy(table, root, child);
+	root->parent = 0;
+	if(root->type == NODE_INTERNAL) {
+		db_adopt_children(table, root, 0);
+	}
+	child->type = NODE_FREE;
+	db_mark_dirty(pager, 0);
+	db_free_page(pager, child_page);
+}
+
+//Key of cell i of a pair of leaves, counting on from the left one's cells.
+static uint8_t* leaf_pair_key(Table* table, Node* left, Node* right, uint32_t i) {
+	if(i < left->num_cells) {
+		return leaf_cell(table, left, i);
+	}
+	return leaf_cell(table, right, i - left->num_cells);
+}
+
+//Bytes cells start to end of a pair of leaves would take in one leaf.
+static uint32_t leaf_pair_bytes(Table* table, Node* left, Node* right, uint32_t start, uint32_t end) {
+	uint32_t bytes = table_variable(table) ? SLOTTED_HEADER : 0;
+	for(uint32_t i=start; i<end; ++i) {
+		Node* node = i < left->num_cells ? left : right;
+		uint32_t cell = i < left->num_cells ? i : i - left->num_cells;
+		bytes += leaf_entry_size(table, leaf_cell_size(table, node, cell));
+	}
+	return bytes;
+}
+
+//Whether the first keep cells of a pair of leaves and the rest each fit in one.
+static bool leaf_fits_split(Table* table, Node* left, Node* right, uint32_t keep) {
+	if(!table_variable(table)) {
+		return true;
+	}
+	uint32_t num_cells = left->num_cells + right->num_cells;
+	return keep > 0 && keep < num_cells && leaf_pair_bytes(table, left, right, 0, keep) <= node_space(table) && leaf_pair_bytes(table, left, right, keep, num_cells) <= node_space(table);
+}
+
+//Where a pair of leaves splits evenly, by count or for slotted ones by bytes.
+static uint32_t leaf_pair_middle(Table* table, Node* left, Node* right) {
+	uint32_t num_cells = left->num_cells + right->num_cells;
+	if(!table_variable(table)) {
+		return num_cells / 2;
+	}
+	uint32_t half = leaf_pair_bytes(table, left, right, 0, num_cells) / 2;
+	uint32_t keep = 1;
+	while(keep < num_cells - 1 && leaf_pair_bytes(table, left, right, 0, keep + 1) <= half) {
+		++keep;
+	}
+	return keep;
+}
+
+/*
+Walks up from an underfull node, merging it with a sibling when both fit in
+one node and otherwise moving entries over so both are at least half full.
+A merge removes an entry from the parent, which may leave it underfull.
+The caller holds exclusive latches from the node up to the first ancestor
+that can lose an entry, siblings are latched here.
+
+Packed nodes only take entries that fit, and the parent's new key for the
+left node has to fit in the parent too, so entries are moved as close to
+evenly as both allow, or not at all.
+
+The caller passes room for three times packed_max_cells children, the first
+third for the parent and the rest for the pair of siblings.
+*/
+static void db_rebalance(Table* table, uint32_t page, Child* children) {
+	Pager* pager = table->pager;
+	Child* parents = children;
+	Child* siblings = children + packed_max_cells(table);
+	while(page != 0) {
+		Node* node = db_get_page(pager, page);
+		bool underfull = node_underfull(table, node);
+		//Only an underfull node has its parent latched, which keeps its link still
+		uint32_t parent_page = underfull ? node->parent : 0;
+		db_release_page(pager, page);
+		if(!underfull) {
+			return;
+		}
+
+		Node* parent = db_get_page(pager, parent_page);
+		if(parent->num_cells < 2) {
+			//No sibling to take from, the parent is rebalanced instead
+			db_release_page(pager, parent_page);
+			page = parent_page;
+			continue;
+		}
+		uint32_t parent_cells = internal_unpack(parent, parents);
+		uint32_t li = internal_node_child_index(parent, page);
+		if(li == parent_cells - 1u) {
+			--li;
+		}
+		uint32_t left_page = parents[li].page;
+		uint32_t right_page = parents[li+1].page;
+		//The node itself is already latched, its sibling is not
+		Node* left = left_page == page ? db_get_page(pager, left_page) : db_latch_page(table, left_page, true);
+		Node* right = right_page == page ? db_get_page(pager, right_page) : db_latch_page(table, right_page, true);
+		bool internal = left->type == NODE_INTERNAL;
+		uint32_t left_cells = left->num_cells;
+		uint32_t num_cells = left_cells + right->num_cells;
+		bool merge;
+		if(internal) {
+			internal_unpack(left, siblings);
+			//The left node's last child may hold keys up to the left node's
+			//bound, which has to be its key once it stops being last
+			uuid_copy(siblings[left_cells-1].key, parents[li].key);
+			internal_unpack(right, siblings + left_cells);
+			merge = internal_fits(table, left->packed, siblings, num_cells);
+		} else if(table_variable(table)) {
+			merge = leaf_pair_bytes(table, left, right, 0, num_cells) <= node_space(table);
+		} else {
+			merge = num_cells < leaf_max_cells(table);
+		}
+
+		if(merge) {
+			if(internal) {
+				internal_pack(left, siblings, num_cells);
+				db_adopt_range(table, left, left_page, left_cells, num_cells);
+			} else {
+				leaf_copy_cells(table, left, left_cells, right, 0, right->num_cells);
+				left->next_leaf = right->next_leaf;
+			}
+			//The right sibling's key bounds everything that is now in the left one
+			uuid_copy(parents[li].key, parents[li+1].key);
+			memmove(parents + li + 1, parents + li + 2, sizeof(Child)*(parent_cells - li - 2));
+			internal_pack(parent, parents, parent_cells - 1);
+			right->type = NODE_FREE;
+			right->num_cells = 0;
+			db_mark_dirty(pager, left_page);
+			db_mark_dirty(pager, parent_page);
+			db_free_page(pager, right_page);
+			if(parent_page == 0 && parent->num_cells == 1) {
+				db_collapse_root(table, parent, left_page, left);
+			}
+			db_rebalance_release(table, page, right_page, right);
+			db_rebalance_release(table, page, left_page, left);
+			db_release_page(pager, parent_page);
+			page = parent_page;
+			continue;
+		}
+
+		//Moves towards an even split until the halves and the parent fit
+		uint32_t keep = internal ? num_cells / 2 : leaf_pair_middle(table, left, right);
+		uuid_t bound;
+		uuid_copy(bound, parents[li].key);
+		while(keep != left_cells) {
+			uuid_copy(parents[li].key, internal ? siblings[keep-1].key : leaf_pair_key(table, left, right, keep-1));
+			bool fits = internal ? internal_fits_split(table, left->packed, siblings, num_cells, keep) : leaf_fits_split(table, left, right, keep);
+			if(fits && internal_fits(table, parent->packed, parents, parent_cells)) {
+				break;
+			}
+			keep += keep < left_cells ? 1 : -1;
+		}
+		if(keep == left_cells) {
+			uuid_copy(parents[li].key, bound);
+		} else if(internal) {
+			internal_pack(left, siblings, keep);
+			internal_pack(right, siblings + keep, num_cells - keep);
+			if(keep > left_cells) {
+				db_adopt_range(table, left, left_page, left_cells, keep);
+			} else {
+				db_adopt_range(table, right, right_page, 0, left_cells - keep);
+			}
+		} else if(keep > left_cells) {
+			uint32_t count = keep - left_cells;
+			leaf_copy_cells(table, left, left_cells, right, 0, count);
+			leaf_remove(table, right, 0, count);
+		} else {
+			uint32_t count = left_cells - keep;
+			leaf_copy_cells(table, right, 0, left, keep, count);
+			leaf_remove(table, left, keep, count);
+		}
+		if(keep != left_cells) {
+			internal_pack(parent, parents, parent_cells);
+			db_mark_dirty(pager, left_page);
+			db_mark_dirty(pager, right_page);
+			db_mark_dirty(pager, parent_page);
+		}
+		db_rebalance_release(table, page, right_page, right);
+		db_rebalance_release(table, page, left_page, left);
+		db_release_page(pager, parent_page);
+		return;
+	}
+}
+
+DbResult db_delete(Database* db, const char* tablename, uuid_t id) {
+	return db_table_delete(db_get_table(db, tablename), id);
+}
+
+static DbResult db_remove_row(Table* table, uuid_t id, uint64_t* position) {
+	Pager* pager = table->pager;
+	uint32_t page;
+	Node* node = db_latch_leaf(table, id, true, &page);
+	if(node == NULL) {
+		return DB_ERROR_IO;
+	}
+	uint32_t i = leaf_node_find_cell(table, node, id);
+	if(!leaf_has_key(table, node, i, id)) {
+		db_unlatch_page(table, page, node, true);
+		return DB_ERROR_NOT_FOUND;
+	}
+	//Most deletes leave the leaf full enough, and only latch it exclusively
+	bool shrink = node_can_shrink(table, node, page, leaf_cell_size(table, node, i));
+	if(shrink) {
+		leaf_delete(table, node, i);
+		db_mark_dirty(pager, page);
+		*position = db_log(table, WAL_DELETE, id, sizeof(uuid_t));
+	}
+	db_unlatch_page(table, page, node, true);
+	if(shrink) {
+		return DB_OK;
+	}
+
+	//Otherwise descend again latching exclusively, and let go of the nodes
+	//above any node that can lose an entry
+	uint32_t path[MAX_TREE_DEPTH];
+	Node* nodes[MAX_TREE_DEPTH];
+	uint32_t top = 0;
+	uint32_t depth = 0;
+	page = 0;
+	node = db_latch_page(table, page, true);
+	if(node == NULL) {
+		return DB_ERROR_IO;
+	}
+	path[depth] = page;
+	nodes[depth++] = node;
+	while(node->type == NODE_INTERNAL) {
+		page = internal_node_child_page(table, node, node->num_cells, id);
+		node = db_latch_page(table, page, true);
+		if(node == NULL) {
+			db_unlatch_path(table, path, nodes, top, depth);
+			return DB_ERROR_IO;
+		}
+		uint32_t cell_size = 0;
+		if(node->type == NODE_LEAF) {
+			i = leaf_node_find_cell(table, node, id);
+			cell_size = leaf_has_key(table, node, i, id) ? leaf_cell_size(table, node, i) : 0;
+		}
+		if(node_can_shrink(table, node, page, cell_size)) {
+			db_unlatch_path(table, path, nodes, top, depth);
+			top = depth;
+		}
+		path[depth] = page;
+		nodes[depth++] = node;
+	}
+
+	i = leaf_node_find_cell(table, node, id);
+	if(!leaf_has_key(table, node, i, id)) {
+		db_unlatch_path(table, path, nodes, top, depth);
+		return DB_ERROR_NOT_FOUND;
+	}
+	Child* children = malloc(sizeof(Child)*packed_max_cells(table)*3);
+	if(children == NULL) {
+		db_unlatch_path(table, path, nodes, top, depth);
+		return DB_ERROR_NO_MEMORY;
+	}
+	leaf_delete(table, node, i);
+	db_mark_dirty(pager, page);
+	*position = db_log(table, WAL_DELETE, id, sizeof(uuid_t));
+
+	db_rebalance(table, page, children);
+	free(children);
+	db_unlatch_path(table, path, nodes, top, depth);
+	return DB_OK;
+}
+
+DbResult db_table_delete(TableHandle table, uuid_t id) {
+	if(table == NULL) {
+		return DB_ERROR_NO_TABLE;
+	}
+	if(table->db->read_only) {
+		return DB_ERROR_READ_ONLY;
+	}
+	uint64_t position = 0;
+	db_begin_change(table);
+	DbResult result;
+	if(table->num_indexes > 0) {
+		result = db_remove_indexed(table, id, &position);
+	} else {
+		result = db_remove_row(table, id, &position);
+	}
+	return db_end_change(table, result, position);
+}
+
+bool db_select(Database* db, const char* tablename, uuid_t id, void* data) {
+	return db_table_select(db_get_table(db, tablename), id, data);
+}
+
+//Copies up to max_size bytes of the row with key id to data, and returns
+//the row's size, or 0 if there is no such row. A read that turns out torn
+//is read again over data, which holds no row when 0 is returned.
+static uint32_t db_select_row(Table* table, uuid_t id, void* data, uint32_t max_size) {
+	if(table == NULL) {
+		return 0;
+	}
+	uint32_t page;
+	uint32_t max_cells = leaf_max_cells(table);
+	for(uint32_t tries = 0; tries < OPTIMISTIC_TRIES; ++tries) {
+		uint32_t version;
+		Node* node = db_read_leaf(table, id, &page, &version);
+		if(node == NULL) {
+			return 0;
+		}
+		uint32_t size = 0;
+		uint32_t num_cells = node->num_cells;
+		if(num_cells <= max_cells) {
+			uint32_t i = leaf_node_search(table, node, num_cells, id);
+			if(i < num_cells && db_key_compare(leaf_cell(table, node, i), id) == 0) {
+				size = leaf_read_row(table, node, i, data, max_size);
+			}
+			if(size != UINT32_MAX && node_read_valid(node, version)) {
+				db_release_page(table->pager, page);
+				return size;
+			}
+		}
+		db_release_page(table->pager, page);
+	}
+
+	//A leaf that keeps changing under the reader is read latched instead
+	Node* node = db_latch_leaf(table, id, false, &page);
+	if(node == NULL) {
+		return 0;
+	}
+	uint32_t size = 0;
+	uint32_t i = leaf_node_find_cell(table, node, id);
+	if(leaf_has_key(table, node, i, id)) {
+		size = leaf_read_row(table, node, i, data, max_size);
+	}
+	db_unlatch_page(table, page, node, false);
+	return size;
+}
+
+//Rows of tables with variable_rows are copied as they are, and data has to
+//hold cell_size bytes as for any other table.
+bool db_table_select(TableHandle table, uuid_t id, void* data) {
+	return table != NULL && db_select_row(table, id, data, table->cell_size) > 0;
+}
+
+uint32_t db_table_select_record(TableHandle table, uuid_t id, void* data, uint32_t max_size) {
+	return db_select_row(table, id, data, max_size);
+}
+
+uint32_t db_select_record(Database* db, const char* tablename, uuid_t id, void* data, uint32_t max_size) {
+	return db_table_select_record(db_get_table(db, tablename), id, data, max_size);
+}
+
+/*
+A batch of lookups goes down the tree together in key order. Each node on the
+way is read once for all the keys below it, and the children it sends keys to
+are prefetched before the first of them is visited. Leaves are then searched
+a window at a time in lockstep, each taking one step of its binary search in
+turn and prefetching the cell its next step compares, so the misses of the
+searches overlap instead of following one another.
+
+Nodes are read optimistically and children checked against their parent as
+db_read_leaf does. Keys whose part of the walk saw a node change are looked
+up again one by one.
+*/
+#define BATCH_WINDOW 16
+
+typedef struct {
+	Table* table;
+	KeyRef* refs;
+	uint32_t* pages;
+	bool* retry;
+	uint8_t* out;
+	//Either may be NULL
+	bool* found;
+	uint32_t* sizes;
+	uint32_t count;
+	uint32_t window;
+} SelectBatch;
+
+//A leaf being searched for the keys from next to end.
+typedef struct {
+	Node* node;
+	uint32_t page;
+	uint32_t version;
+	uint32_t num_cells;
+	uint32_t next;
+	uint32_t end;
+	uint32_t low;
+	uint32_t high;
+} LeafProbe;
+
+static void batch_found(SelectBatch* batch, uint32_t i, uint32_t size) {
+	if(batch->found != NULL) {
+		batch->found[i] = true;
+	}
+	if(batch->sizes != NULL) {
+		batch->sizes[i] = size;
+	}
+	batch->count++;
+}
+
+static void batch_retry(SelectBatch* batch, uint32_t start, uint32_t end) {
+	for(uint32_t r=start; r<end; ++r) {
+		batch->retry[r] = true;
+	}
+}
+
+static void prefetch_cell(Table* table, Node* node, uint32_t i) {
+	if(table_variable(table)) {
+		__builtin_prefetch(&leaf_slots(node)[i]);
+	} else {
+		__builtin_prefetch(leaf_node_cell(node, i, table->cell_size));
+	}
+}
+
+//Hands out the row of the key a leaf's search ended on, if it is there, and
+//moves the leaf on to its next key. False if the leaf changed meanwhile.
+static bool db_select_probe_done(SelectBatch* batch, LeafProbe* leaf) {
+	Table* table = batch->table;
+	const KeyRef* ref = &batch->refs[leaf->next];
+	//A torn row is read again over its slot, or the key is looked up alone
+	uint8_t* row = batch->out + (size_t)ref->index*table->cell_size;
+	uint32_t size = 0;
+	if(leaf->low < leaf->num_cells && db_key_compare(leaf_cell(table, leaf->node, leaf->low), ref->key) == 0) {
+		size = leaf_read_row(table, leaf->node, leaf->low, row, table->cell_size);
+	}
+	if(size == UINT32_MAX || !node_read_valid(leaf->node, leaf->version)) {
+		return false;
+	}
+	if(size > 0) {
+		batch_found(batch, ref->index, size);
+	}
+	//Keys come in order, so the next one is not before this one
+	leaf->next++;
+	leaf->high = leaf->num_cells;
+	return true;
+}
+
+//Searches a window of pinned leaves in lockstep and releases them.
+static void db_select_leaves(SelectBatch* batch, LeafProbe* leaves, uint32_t count) {
+	Table* table = batch->table;
+	uint32_t max_cells = leaf_max_cells(table);
+	uint32_t active = 0;
+	for(uint32_t l=0; l<count; ++l) {
+		LeafProbe* leaf = &leaves[l];
+		leaf->num_cells = leaf->node->num_cells;
+		leaf->low = 0;
+		leaf->high = leaf->num_cells;
+		if(leaf->num_cells > max_cells) {
+			batch_retry(batch, leaf->next, leaf->end);
+			leaf->next = leaf->end;
+			db_release_page(table->pager, leaf->page);
+		} else {
+			active++;
+		}
+	}
+	while(active > 0) {
+		for(uint32_t l=0; l<count; ++l) {
+			LeafProbe* leaf = &leaves[l];
+			if(leaf->next == leaf->end) {
+				continue;
+			}
+			if(leaf->low < leaf->high) {
+				uint32_t mid = (leaf->low + leaf->high) / 2;
+				if(db_key_compare(leaf_cell(table, leaf->node, mid), batch->refs[leaf->next].key) < 0) {
+					leaf->low = mid + 1;
+				} else {
+					leaf->high = mid;
+				}
+				if(leaf->low < leaf->high) {
+					prefetch_cell(table, leaf->node, (leaf->low + leaf->high) / 2);
+				}
+				continue;
+			}
+			if(!db_select_probe_done(batch, leaf)) {
+				batch_retry(batch, leaf->next, leaf->end);
+				leaf->next = leaf->end;
+			}
+			if(leaf->next == leaf->end) {
+				db_release_page(table->pager, leaf->page);
+				active--;
+			}
+		}
+	}
+}
+
+/*
+Finds the child each of the keys from start to end goes to. Keys many enough
+for the node's children are matched to them in one walk along both, as they
+come in order, rather than searched for one by one. False if the optimistic
+read caught the node in the middle of a change.
+*/
+static bool db_batch_children(SelectBatch* batch, Node* node, uint32_t num_cells, uint32_t start, uint32_t end) {
+	Table* table = batch->table;
+	if((end - start)*8 < num_cells) {
+		for(uint32_t r=start; r<end; ++r) {
+			batch->pages[r] = internal_node_child_page(table, node, num_cells, batch->refs[r].key);
+			if(batch->pages[r] == PAGE_NONE) {
+				return false;
+			}
+		}
+		return true;
+	}
+	bool packed = node->packed;
+	uint32_t prefix = 0;
+	if(packed) {
+		prefix = node->cellspace[0];
+		if(num_cells == 0 || prefix > MAX_PACKED_PREFIX || !packed_fits(table, num_cells, prefix)) {
+			return false;
+		}
+	} else if(num_cells == 0 || num_cells > internal_max_cells(table)) {
+		return false;
+	}
+	uint32_t c = 0;
+	for(uint32_t r=start; r<end; ++r) {
+		const uint8_t* key = batch->refs[r].key;
+		while(c + 1 < num_cells) {
+			int order;
+			if(!packed) {
+				order = db_key_compare(node->children[c].key, key);
+			} else {
+				order = memcmp(node->cellspace + 1, key, prefix);
+				if(order == 0) {
+					order = memcmp(packed_suffix(node, num_cells, prefix, c), key + prefix, sizeof(uuid_t) - prefix);
+				}
+			}
+			if(order >= 0) {
+				break;
+			}
+			++c;
+		}
+		batch->pages[r] = packed ? packed_pages(node)[c] : node->children[c].page;
+	}
+	return true;
+}
+
+//Looks up the keys from start to end, which all belong under an internal node.
+static void db_select_batch(SelectBatch* batch, Node* node, uint32_t version, uint32_t start, uint32_t end) {
+	Table* table = batch->table;
+	Pager* pager = table->pager;
+	if(node->type != NODE_INTERNAL) {
+		batch_retry(batch, start, end);
+		return;
+	}
+	if(!db_batch_children(batch, node, node->num_cells, start, end)) {
+		batch_retry(batch, start, end);
+		return;
+	}
+	for(uint32_t r=start; r<end; ++r) {
+		if(r == start || batch->pages[r] != batch->pages[r-1]) {
+			db_prefetch_page(pager, batch->pages[r]);
+		}
+	}
+	LeafProbe leaves[BATCH_WINDOW];
+	uint32_t num_leaves = 0;
+	uint32_t next;
+	for(uint32_t r=start; r<end; r=next) {
+		uint32_t page = batch->pages[r];
+		next = r + 1;
+		while(next < end && batch->pages[next] == page) {
+			++next;
+		}
+		Node* child = db_get_page(pager, page);
+		if(child == NULL) {
+			batch_retry(batch, r, end);
+			break;
+		}
+		uint32_t child_version;
+		if(!node_read_begin(child, &child_version) || !node_read_valid(node, version)) {
+			db_release_page(pager, page);
+			batch_retry(batch, r, end);
+			break;
+		}
+		if(child->type != NODE_LEAF) {
+			db_select_batch(batch, child, child_version, r, next);
+			db_release_page(pager, page);
+			continue;
+		}
+		leaves[num_leaves++] = (LeafProbe){ child, page, child_version, 0, r, next, 0, 0 };
+		if(num_leaves == batch->window) {
+			db_select_leaves(batch, leaves, num_leaves);
+			num_leaves = 0;
+		}
+	}
+	db_select_leaves(batch, leaves, num_leaves);
+}
+
+/*
+Looks up n keys at once, copying the row of keys[i] to the i-th of n rows of
+cell_size bytes in out and setting found[i] or sizes[i], and returns how
+many were found. Rows not found leave their part of out as it was.
+*/
+static uint32_t db_select_keys(Table* table, const uuid_t* keys, uint32_t n, void* out, bool* found, uint32_t* sizes) {
+	if(n == 0) {
+		return 0;
+	}
+	if(found != NULL) {
+		memset(found, 0, n*sizeof(bool));
+	}
+	if(sizes != NULL) {
+		memset(sizes, 0, n*sizeof(uint32_t));
+	}
+	if(table == NULL) {
+		return 0;
+	}
+	SelectBatch batch;
+	batch.table = table;
+	batch.refs = malloc(sizeof(KeyRef)*n);
+	batch.pages = malloc(sizeof(uint32_t)*n);
+	batch.retry = calloc(n, sizeof(bool));
+	batch.out = out;
+	batch.found = found;
+	batch.sizes = sizes;
+	batch.count = 0;
+	//Leaves of a file are pinned while searched, so a few are left in the pool
+	batch.window = BATCH_WINDOW;
+	if(table->pager->fd >= 0 && table->pager->pool_pages/4 < BATCH_WINDOW) {
+		batch.window = table->pager->pool_pages/4 > 0 ? table->pager->pool_pages/4 : 1;
+	}
+	bool sorted = batch.refs != NULL && batch.pages != NULL && batch.retry != NULL;
+	for(uint32_t i=0; i<n && sorted; ++i) {
+		uuid_copy(batch.refs[i].key, keys[i]);
+		batch.refs[i].index = i;
+	}
+	sorted = sorted && db_sort_keys(batch.refs, n);
+	if(sorted) {
+		uint32_t version;
+		Node* root = db_get_page(table->pager, 0);
+		if(root == NULL) {
+			batch_retry(&batch, 0, n);
+		} else if(!node_read_begin(root, &version)) {
+			db_release_page(table->pager, 0);
+			batch_retry(&batch, 0, n);
+		} else if(root->type == NODE_LEAF) {
+			LeafProbe leaf = { root, 0, version, 0, 0, n, 0, 0 };
+			db_select_leaves(&batch, &leaf, 1);
+		} else {
+			db_select_batch(&batch, root, version, 0, n);
+			db_release_page(table->pager, 0);
+		}
+	}
+	for(uint32_t r=0; r<n; ++r) {
+		uint32_t i = sorted ? batch.refs[r].index : r;
+		if(!sorted || batch.retry[r]) {
+			uuid_t key;
+			uuid_copy(key, keys[i]);
+			uint32_t size = db_select_row(table, key, batch.out + (size_t)i*table->cell_size, table->cell_size);
+			if(size > 0) {
+				batch_found(&batch, i, size);
+			}
+		}
+	}
+	free(batch.refs);
+	free(batch.pages);
+	free(batch.retry);
+	return batch.count;
+}
+
+uint32_t db_table_select_many(TableHandle table, const uuid_t* keys, uint32_t n, void* out, bool* found) {
+	return db_select_keys(table, keys, n, out, found, NULL);
+}
+
+//For tables with variable_rows, sets sizes[i] to the size of the row of
+//keys[i], or 0 if there is none.
+uint32_t db_table_select_many_records(TableHandle table, const uuid_t* keys, uint32_t n, void* out, uint32_t* sizes) {
+	return db_select_keys(table, keys, n, out, NULL, sizes);
+}
+
+uint32_t db_select_many(Database* db, const char* tablename, const uuid_t* keys, uint32_t n, void* out, bool* found) {
+	return db_table_select_many(db_get_table(db, tablename), keys, n, out, found);
+}
+
+uint32_t db_select_many_records(Database* db, const char* tablename, const uuid_t* keys, uint32_t n, void* out, uint32_t* sizes) {
+	return db_table_select_many_records(db_get_table(db, tablename), keys, n, out, sizes);
+}
+
+/*
+A cursor keeps its leaf, the cell in it, the key of that cell, and the
+version the leaf had then. While the version holds, the cell is read in
+place. Once a writer changed the leaf the cursor finds its key again from
+the root, so rows that stay in the table are neither skipped nor repeated.
+*/
+
+/*
+Keeps the leaves following the cursor's on their way in, so a scan does not
+wait on each one as it gets there. Only the header of the furthest leaf is
+read to find the next one, without latching it or taking a frame, as a
+stale link only wastes a prefetch. Once the chain is seen to end there is
+nothing more to look for.
+*/
+static void db_cursor_prefetch(Cursor* cursor) {
+	Pager* pager = cursor->table->pager;
+	if(cursor->ahead == 0) {
+		cursor->ahead_page = cursor->page;
+	}
+	while(cursor->ahead < cursor->prefetch && !cursor->ahead_end) {
+		NODE_HEADER header;
+		if(!db_peek_page(pager, cursor->ahead_page, 0, &header, sizeof(header))) {
+			return;
+		}
+		uint32_t next = header.type == NODE_LEAF ? header.next_leaf : 0;
+		cursor->ahead_end = next == 0;
+		if(next == 0 || !db_prefetch_page(pager, next)) {
+			return;
+		}
+		cursor->ahead_page = next;
+		cursor->ahead++;
+	}
+}
+
+//Moves the cursor to the first row whose key is at least the cursor's key,
+//or above it if after is set, and ends it past the last row or the upper
+//bound. The cursor's own leaf is tried before a descent unless reseek is set.
+static void db_cursor_move(Cursor* cursor, bool after, bool reseek) {
+	Table* table = cursor->table;
+	Pager* pager = table->pager;
+	uint32_t max_cells = leaf_max_cells(table);
+	while(true) {
+		uint32_t page = cursor->page;
+		uint32_t cell = cursor->cell;
+		uint32_t version;
+		Node* node = NULL;
+		if(!reseek) {
+			node = db_get_page(pager, page);
+			if(node == NULL) {
+				cursor->end = true;
+				return;
+			}
+			if(!node_read_begin(node, &version) || version != cursor->version) {
+				db_release_page(pager, page);
+				node = NULL;
+			}
+		}
+		reseek = true;
+		if(node == NULL) {
+			node = db_read_leaf(table, cursor->key, &page, &version);
+			if(node == NULL) {
+				cursor->end = true;
+				return;
+			}
+			cell = UINT32_MAX;
+			if(page != cursor->page) {
+				cursor->ahead = 0;
+				cursor->ahead_end = false;
+			}
+		}
+
+		bool valid = true;
+		while(true) {
+			uint32_t num_cells = node->num_cells;
+			if(node->type != NODE_LEAF || num_cells > max_cells) {
+				valid = false;
+				break;
+			}
+			if(cell == UINT32_MAX) {
+				cell = leaf_node_search(table, node, num_cells, cursor->key);
+			}
+			while(after && cell < num_cells && db_key_compare(leaf_cell(table, node, cell), cursor->key) <= 0) {
+				++cell;
+			}
+			if(cell < num_cells) {
+				break;
+			}
+			uint32_t next_leaf = node->next_leaf;
+			if(!node_read_valid(node, version)) {
+				valid = false;
+				break;
+			}
+			db_release_page(pager, page);
+			if(next_leaf == 0) {
+				cursor->end = true;
+				return;
+			}
+//			printf("Next leaf: %i\n", next_leaf);
+			page = next_leaf;
+			if(cursor->ahead > 0) {
+				cursor->ahead--;
+			}
+			cell = 0;
+			node = db_get_page(pager, page);
+			if(node == NULL) {
+				cursor->end = true;
+				return;
+			}
+			if(!node_read_begin(node, &version)) {
+				valid = false;
+				break;
+			}
+		}
+		if(valid) {
+			uuid_t key;
+			uuid_copy(key, leaf_cell(table, node, cell));
+			if(node_read_valid(node, version)) {
+				db_release_page(pager, page);
+				cursor->page = page;
+				cursor->cell = cell;
+				cursor->version = version;
+				uuid_copy(cursor->key, key);
+				cursor->end = cursor->bounded && db_key_compare(key, cursor->upper) >= 0;
+				if(!cursor->end) {
+					db_cursor_prefetch(cursor);
+				}
+				return;
+			}
+		}
+		db_release_page(pager, page);
+	}
+}
+
+//Pins the cursor's leaf if it is unchanged since the cursor was placed, and
+//otherwise places the cursor again. Returns NULL once the cursor ends.
+static Node* db_cursor_leaf(Cursor* cursor, uint32_t* version) {
+	Pager* pager = cursor->table->pager;
+	while(!cursor->end) {
+		Node* node = db_get_page(pager, cursor->page);
+		if(node == NULL) {
+			cursor->end = true;
+			return NULL;
+		}
+		if(node_read_begin(node, version) && *version == cursor->version) {
+			return node;
+		}
+		db_release_page(pager, cursor->page);
+		db_cursor_move(cursor, false, true);
+	}
+	return NULL;
+}
+
+void db_table_start(Database* db, const char* tablename, Cursor* cursor) {
+	db_cursor_start(db_get_table(db, tablename), cursor);
+}
+
+//Starts a cursor at the first row whose key is at least key.
+static void db_cursor_start_at(TableHandle table, Cursor* cursor, const uuid_t key) {
+	cursor->table = table;
+	cursor->page = 0;
+	cursor->cell = 0;
+	cursor->version = 0;
+	uuid_copy(cursor->key, key);
+	cursor->end = table == NULL;
+	cursor->bounded = false;
+	cursor->pinned = PAGE_NONE;
+	cursor->prefetch = DB_CURSOR_PREFETCH;
+	cursor->ahead_page = PAGE_NONE;
+	cursor->ahead = 0;
+	cursor->ahead_end = false;
+	if(cursor->end) {
+		return;
+	}
+	db_cursor_move(cursor, false, true);
+}
+
+void db_cursor_start(TableHandle table, Cursor* cursor) {
+	uuid_t first;
+	memset(first, 0, sizeof(uuid_t));
+	db_cursor_start_at(table, cursor, first);
+}
+
+//Drops the leaf kept pinned by db_cursor_next_run.
+static void db_cursor_unpin(Cursor* cursor) {
+	if(cursor->pinned != PAGE_NONE) {
+		db_release_page(cursor->table->pager, cursor->pinned);
+		cursor->pinned = PAGE_NONE;
+	}
 }
 
-void* leaf_node_cell(Node* node, uint8_t cell_num, uint32_t cell_size) {
-	return node->cellspace + cell_num * cell_size;
+void db_cursor_close(Cursor* cursor) {
+	db_cursor_unpin(cursor);
+	cursor->end = true;
 }
 
-Database* db_open() {
-//	printf("Internal node size: %li\n", sizeof(Internal));
-//	printf("Internal max_cells: %li\n", INTERNAL_NODE_MAX_CELLS);
-	Database* db = malloc(sizeof(Database));
-	db->num_tables = 0;
-	db->tables = NULL;
-	return db;
+void db_cursor_seek(Cursor* cursor, const uuid_t key) {
+	db_cursor_unpin(cursor);
+	uuid_copy(cursor->key, key);
+	cursor->end = false;
+	db_cursor_move(cursor, false, true);
 }
 
-void db_close(Database* db) {
-	for(uint32_t i=0; i<db->num_tables; ++i) {
-		db_close_pager(db->tables[i].pager);
+void db_cursor_set_upper_bound(Cursor* cursor, const uuid_t bound) {
+	uuid_copy(cursor->upper, bound);
+	cursor->bounded = true;
+	if(!cursor->end && db_key_compare(cursor->key, cursor->upper) >= 0) {
+		cursor->end = true;
 	}
-	free(db->tables);
-	free(db);
 }
 
-uint32_t db_find_table(Database* db, const char* name) {
-	for(uint32_t i = 0; i<db->num_tables; ++i) {
-		if(strncmp(name, db->tables[i].name, 64) == 0) {
-			return i;
-		}
+//Sets how many leaves the cursor prefetches ahead of its own, 0 for none.
+//Deeper prefetching suits pages read from files, or a cold cache.
+void db_cursor_set_prefetch(Cursor* cursor, uint32_t depth) {
+	cursor->prefetch = depth;
+	if(cursor->ahead > depth) {
+		cursor->ahead = 0;
+		cursor->ahead_end = false;
 	}
-	return UINT32_MAX;
 }
 
-void db_create_table(Database* db, const char* name, uint32_t cell_size) {
-	if(db_find_table(db, name) != UINT32_MAX) {
-		return;
+//Copies up to max_size bytes of the row at the cursor to out, and returns
+//the row's size, or 0 once the cursor has ended. A torn read is read again
+//over out.
+uint32_t db_cursor_record(Cursor* cursor, void* out, uint32_t max_size) {
+	Table* table = cursor->table;
+	uint32_t version;
+	Node* node;
+	while((node = db_cursor_leaf(cursor, &version)) != NULL) {
+		uint32_t size = leaf_read_row(table, node, cursor->cell, out, max_size);
+		//hexDumps("Page", node, PAGE_SIZE);
+		bool valid = size != UINT32_MAX && node_read_valid(node, version);
+		db_release_page(table->pager, cursor->page);
+		if(valid) {
+			return size;
+		}
+		db_cursor_move(cursor, false, true);
 	}
-	db->tables = realloc(db->tables, sizeof(Table)*(db->num_tables+1));
-	strncpy(db->tables[db->num_tables].name, name, 64);
-	db->tables[db->num_tables].cell_size = cell_size;
-//	printf("Leaf max cells: %i\n", leaf_max_cells(&db->tables[db->num_tables]));
-//	printf("Leaf node size: %li\n", sizeof(uint32_t)*2 + cell_size*(leaf_max_cells(&db->tables[db->num_tables])));
+	return 0;
+}
 
- 	Pager* pager = db_open_pager();
-	db->tables[db->num_tables].pager = pager;
-	db_get_unused_page(pager);
+//Copies the row at the cursor to out, which holds cell_size bytes.
+void db_cursor_value(Cursor* cursor, void* out) {
+	db_cursor_record(cursor, out, cursor->table->cell_size);
+}
 
-	Node *node = db_get_page(pager, 0);
-	memset(node, 0, PAGE_SIZE);
-	node->num_cells = 0;
-	node->next_leaf = 0;
-	node->parent = 0;
-	node->type = NODE_LEAF;
+void db_cursor_next(Cursor* cursor) {
+//	printf("Cursor: page %i, cell %i\n", cursor->page, cursor->cell);
+	db_cursor_unpin(cursor);
+	if(!cursor->end) {
+		db_cursor_move(cursor, true, false);
+	}
+}
 
-	db->num_tables++;
+//Cells from the cursor to the end of its leaf or to the upper bound.
+//The leaf is read optimistically, so num_cells is checked before use.
+static uint32_t db_cursor_run(Cursor* cursor, Node* node, uint32_t num_cells) {
+	Table* table = cursor->table;
+	if(node->type != NODE_LEAF || num_cells > leaf_max_cells(table) || cursor->cell >= num_cells) {
+		return 0;
+	}
+	uint32_t end = num_cells;
+	if(cursor->bounded) {
+		void* last = leaf_cell(table, node, end-1);
+		if(db_key_compare(*(uuid_t*)last, cursor->upper) >= 0) {
+			end = leaf_node_search(table, node, num_cells, cursor->upper);
+		}
+	}
+	return end > cursor->cell ? end - cursor->cell : 0;
 }
 
-const char* db_first_table(Database* db) {
-	return db->tables[0].name;
+//Copies rows of a fixed size table in batches. Rows of tables with
+//variable_rows are read one by one with db_cursor_record.
+uint32_t db_cursor_fetch(Cursor* cursor, void* out, uint32_t max_rows) {
+	db_cursor_unpin(cursor);
+	Table* table = cursor->table;
+	if(table == NULL || table_variable(table)) {
+		return 0;
+	}
+	uint8_t* to = out;
+	uint32_t count = 0;
+	uint32_t version;
+	Node* node;
+	while(count < max_rows && (node = db_cursor_leaf(cursor, &version)) != NULL) {
+		uint32_t run = db_cursor_run(cursor, node, node->num_cells);
+		if(run > max_rows - count) {
+			run = max_rows - count;
+		}
+		memcpy(to, leaf_node_cell(node, cursor->cell, table->cell_size), run*table->cell_size);
+		bool valid = run > 0 && node_read_valid(node, version);
+		db_release_page(table->pager, cursor->page);
+		if(!valid) {
+			db_cursor_move(cursor, false, true);
+			continue;
+		}
+		//Carry on after the last row copied
+		cursor->cell += run - 1;
+		uuid_copy(cursor->key, to + (run - 1)*table->cell_size);
+		to += run*table->cell_size;
+		count += run;
+		db_cursor_move(cursor, true, false);
+	}
+	return count;
 }
 
-const char* db_next_table(Database* db, const char* name) {
-	uint32_t i = db_find_table(db, name);
-	if(i+1 < db->num_tables) {
-		return db->tables[i+1].name;
+//Points cells at the rest of the current leaf run without copying and moves
+//past it. The run stays valid until the next call on the cursor, but unlike
+//the copies made by db_cursor_fetch it can change under concurrent writers.
+//Only fixed size tables keep their rows in runs.
+uint32_t db_cursor_next_run(Cursor* cursor, const void** cells) {
+	db_cursor_unpin(cursor);
+	Table* table = cursor->table;
+	*cells = NULL;
+	if(table == NULL || table_variable(table)) {
+		return 0;
 	}
-	return NULL;
+	uint32_t version;
+	Node* node;
+	while((node = db_cursor_leaf(cursor, &version)) != NULL) {
+		uint32_t run = db_cursor_run(cursor, node, node->num_cells);
+		uuid_t last;
+		if(run > 0) {
+			uuid_copy(last, leaf_node_cell(node, cursor->cell + run - 1, table->cell_size));
+		}
+		if(run == 0 || !node_read_valid(node, version)) {
+			db_release_page(table->pager, cursor->page);
+			db_cursor_move(cursor, false, true);
+			continue;
+		}
+		//The pin taken on the leaf keeps it in place until the next call
+		*cells = leaf_node_cell(node, cursor->cell, table->cell_size);
+		cursor->pinned = cursor->page;
+		cursor->cell += run - 1;
+		uuid_copy(cursor->key, last);
+		db_cursor_move(cursor, true, false);
+		return run;
+	}
+	*cells = NULL;
+	return 0;
+}
+
+/*
+A parallel scan splits the key space into ranges at the keys of the highest
+level of internal nodes with enough of them, several ranges per thread.
+Each thread starts with a share of the ranges, and one that runs out takes
+the back half of what another has left, so a thread held up by a dense range
+does not hold up the scan. Every range is read with a cursor of its own.
+
+The ranges are only picked from the tree, which may change before they are
+scanned. They cover every key either way, so each row is seen once as with
+a cursor.
+*/
+#define SCAN_RANGES_PER_THREAD 8
+
+typedef struct {
+	pthread_mutex_t lock;
+	uint32_t next;
+	uint32_t end;
+} ScanQueue;
+
+typedef struct {
+	Table* table;
+	uuid_t* bounds;
+	uint32_t num_ranges;
+	uint32_t num_workers;
+	ScanQueue* queues;
+	DbScanFunc f;
+	void* context;
+} Scan;
+
+typedef struct {
+	Scan* scan;
+	uint32_t worker;
+} ScanWorker;
+
+//The smallest key above key, false if there is none.
+static bool key_successor(uuid_t key) {
+	for(uint32_t i=sizeof(uuid_t); i-- > 0;) {
+		if(++key[i] != 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static int scan_compare_keys(const void* a, const void* b) {
+	return db_key_compare(a, b);
 }
 
-void db_update_parent(Table* table, Node* node, uint32_t page) {
-	Node* parent_node = db_get_page(table->pager, node->parent);
-	for(int i=0;i<parent_node->num_cells; ++i) {
-		if(parent_node->children[i].page == page) {
-			void* from;
-			if(node->type == NODE_LEAF) {
-				from = leaf_node_cell(node, node->num_cells-1, table->cell_size);
+/*
+Collects the keys starting each range after the first, from the first level
+of internal nodes whose children number at least target, or from the level
+above the leaves. Returns how many there are.
+
+Nodes are not latched, as the pages of a read only snapshot can not be.
+Each is copied out and only read once its version shows the copy is whole,
+and one that keeps changing ends the descent at its level.
+*/
+static uint32_t db_scan_bounds(Table* table, uint32_t target, uuid_t** bounds_out) {
+	uint32_t num_pages = 1;
+	uint32_t* pages = malloc(sizeof(uint32_t));
+	Node* node = malloc(table->pager->page_size);
+	uuid_t* bounds = NULL;
+	uint32_t num_bounds = 0;
+	if(pages == NULL || node == NULL) {
+		free(pages);
+		free(node);
+		*bounds_out = NULL;
+		return 0;
+	}
+	pages[0] = 0;
+	while(num_bounds < target) {
+		uint32_t* children = NULL;
+		uuid_t* keys = NULL;
+		uint32_t count = 0;
+		bool leaves = false;
+		for(uint32_t i=0; i<num_pages && !leaves; ++i) {
+			Node* page = db_get_page(table->pager, pages[i]);
+			if(page == NULL) {
+				break;
+			}
+			bool valid = false;
+			for(uint32_t tries = 0; tries < OPTIMISTIC_TRIES && !valid; ++tries) {
+				uint32_t version;
+				valid = node_read_begin(page, &version);
+				memcpy(node, page, table->pager->page_size);
+				valid = valid && node_read_valid(page, version);
+			}
+			db_release_page(table->pager, pages[i]);
+			if(!valid || node->type != NODE_INTERNAL) {
+				leaves = true;
 			} else {
-				from = node->children + (node->num_cells-1); 
+				uint32_t* more_children = realloc(children, sizeof(uint32_t)*(count + node->num_cells));
+				uuid_t* more_keys = realloc(keys, sizeof(uuid_t)*(count + node->num_cells));
+				if(more_children != NULL) {
+					children = more_children;
+				}
+				if(more_keys != NULL) {
+					keys = more_keys;
+				}
+				if(more_children == NULL || more_keys == NULL) {
+					leaves = true;
+				} else {
+					for(uint32_t c=0; c<node->num_cells; ++c) {
+						children[count] = internal_child(node, c);
+						internal_key(node, c, keys[count++]);
+					}
+				}
 			}
-			uuid_copy(parent_node->children[i].key, *(uuid_t*)from);
+		}
+		if(leaves || count == 0) {
+			free(children);
+			free(keys);
 			break;
 		}
+		free(pages);
+		free(bounds);
+		pages = children;
+		num_pages = count;
+		bounds = keys;
+		num_bounds = count;
+	}
+	free(pages);
+	free(node);
+
+	//Keys read from nodes changing in between can be out of order
+	if(num_bounds > 0) {
+		qsort(bounds, num_bounds, sizeof(uuid_t), scan_compare_keys);
 	}
-	if(node->parent != 0) {
-		db_update_parent(table, parent_node, node->parent);
+	uint32_t m = 0;
+	for(uint32_t i=0; i<num_bounds; ++i) {
+		uuid_t key;
+		uuid_copy(key, bounds[i]);
+		if(key_successor(key) && (m == 0 || db_key_compare(bounds[m-1], key) < 0)) {
+			uuid_copy(bounds[m++], key);
+		}
 	}
+	*bounds_out = bounds;
+	return m;
 }
 
-void db_leaf_insert(Node* node, Table* table, void* data, uint32_t page) {
-	//Insert in right place
-	for(int i=0; i<node->num_cells; ++i) {
-		void* cell = leaf_node_cell(node, i, table->cell_size);
-		if(uuid_compare(*(uuid_t*)cell, *(uuid_t*)data) > 0) {
-			memmove((char*)cell+table->cell_size, cell, (node->num_cells-i)*table->cell_size);
-			memcpy(cell, data, table->cell_size);
-			node->num_cells += 1;
-			return;
-		}
+//Takes the next range of a worker, or else steals the back half of what
+//another worker has left.
+static bool scan_take(Scan* scan, uint32_t worker, uint32_t* range) {
+	ScanQueue* own = &scan->queues[worker];
+	pthread_mutex_lock(&own->lock);
+	bool taken = own->next < own->end;
+	if(taken) {
+		*range = own->next++;
 	}
-	//Or add at end
-	void* cell = leaf_node_cell(node, node->num_cells, table->cell_size);
-	memcpy(cell, data, table->cell_size);
-	node->num_cells += 1;
-	
-	if(page != 0) {
-		db_update_parent(table, node, page);
+	pthread_mutex_unlock(&own->lock);
+	for(uint32_t i=1; i<scan->num_workers && !taken; ++i) {
+		ScanQueue* victim = &scan->queues[(worker + i) % scan->num_workers];
+		pthread_mutex_lock(&victim->lock);
+		uint32_t left = victim->end - victim->next;
+		uint32_t start = victim->end - (left + 1)/2;
+		uint32_t end = victim->end;
+		victim->end = start;
+		pthread_mutex_unlock(&victim->lock);
+		if(left > 0) {
+			//Only its worker adds to a queue, and this one is empty
+			pthread_mutex_lock(&own->lock);
+			own->next = start + 1;
+			own->end = end;
+			pthread_mutex_unlock(&own->lock);
+			*range = start;
+			taken = true;
+		}
 	}
+	return taken;
 }
 
-void db_internal_insert(Table* table, Node* node, uint32_t page, Node* next_node, uint32_t next_page) {
-	Node* check1 = db_get_page(table->pager, page);
-	if(check1 != node) {
-		printf("node/page mismatch\n");
+static void db_scan_range(Scan* scan, uint32_t worker, uint32_t range, uint8_t* rows, uint32_t max_rows) {
+	Table* table = scan->table;
+	uuid_t start;
+	memset(start, 0, sizeof(uuid_t));
+	if(range > 0) {
+		uuid_copy(start, scan->bounds[range-1]);
 	}
-	Node* check2 = db_get_page(table->pager, next_page);
-	if(check2 != next_node) {
-		printf("next node/page mismatch\n");
+	Cursor cursor;
+	db_cursor_start_at(table, &cursor, start);
+	if(range + 1 < scan->num_ranges) {
+		db_cursor_set_upper_bound(&cursor, scan->bounds[range]);
 	}
-	Node* parent = db_get_page(table->pager, node->parent);
-	void* from;
-	if(node->type == NODE_LEAF) {
-		from = leaf_node_cell(node, node->num_cells-1, table->cell_size);
+	if(table_variable(table)) {
+		uint32_t size;
+		while((size = db_cursor_record(&cursor, rows, table->cell_size)) > 0) {
+			scan->f(scan->context, worker, rows, size);
+			db_cursor_next(&cursor);
+		}
 	} else {
-		from = node->children + (node->num_cells-1); 
-	}
-	for(int i=0;i<parent->num_cells; ++i) {
-		if(parent->children[i].page == page) {
-			//printf("parent %i, child %i, cells %i\n", node->parent, i, parent->num_cells);
-			uuid_copy(parent->children[i].key, *(uuid_t*)from);
-			++i;
-			if(i<parent->num_cells) {
-				memmove(parent->children+i+1, parent->children+i, sizeof(Child)*(parent->num_cells-i));
-			}
-			if(next_node->type == NODE_LEAF) {
-				from = leaf_node_cell(next_node, next_node->num_cells-1, table->cell_size);
-			} else {
-				from = next_node->children + (next_node->num_cells-1); 
+		uint32_t count;
+		while((count = db_cursor_fetch(&cursor, rows, max_rows)) > 0) {
+			for(uint32_t i=0; i<count; ++i) {
+				scan->f(scan->context, worker, rows + (size_t)i*table->cell_size, table->cell_size);
 			}
-			uuid_copy(parent->children[i].key, *(uuid_t*)from);
-			parent->children[i].page = next_page;
-			parent->num_cells++;
+		}
+	}
+	db_cursor_close(&cursor);
+}
+
+static void* db_scan_worker(void* arg) {
+	ScanWorker* worker = arg;
+	Scan* scan = worker->scan;
+	Table* table = scan->table;
+	//Rows are handed over a leaf at a time
+	uint32_t max_rows = table_variable(table) ? 1 : leaf_max_cells(table);
+	uint8_t* rows = malloc((size_t)max_rows*table->cell_size);
+	uint32_t range;
+	while(rows != NULL && scan_take(scan, worker->worker, &range)) {
+		db_scan_range(scan, worker->worker, range, rows, max_rows);
+	}
+	free(rows);
+	return rows == NULL ? worker : NULL;
+}
+
+/*
+Hands every row of a table to f, spread over num_threads threads, or one
+per processor if it is 0. The calling thread is one of them. Rows come in
+key order within each range, and the ranges in no order at all.
+*/
+DbResult db_table_parallel_scan(TableHandle table, uint32_t num_threads, DbScanFunc f, void* context) {
+	if(table == NULL) {
+		return DB_ERROR_NO_TABLE;
+	}
+	if(num_threads == 0) {
+		long processors = sysconf(_SC_NPROCESSORS_ONLN);
+		num_threads = processors > 0 ? processors : 1;
+	}
+	Scan scan;
+	scan.table = table;
+	scan.f = f;
+	scan.context = context;
+	scan.num_workers = num_threads;
+	scan.num_ranges = db_scan_bounds(table, num_threads*SCAN_RANGES_PER_THREAD, &scan.bounds) + 1;
+	scan.queues = malloc(sizeof(ScanQueue)*num_threads);
+	ScanWorker* workers = malloc(sizeof(ScanWorker)*num_threads);
+	pthread_t* threads = malloc(sizeof(pthread_t)*num_threads);
+	if(scan.queues == NULL || workers == NULL || threads == NULL) {
+		free(scan.bounds);
+		free(scan.queues);
+		free(workers);
+		free(threads);
+		return DB_ERROR_NO_MEMORY;
+	}
+	for(uint32_t w=0; w<num_threads; ++w) {
+		pthread_mutex_init(&scan.queues[w].lock, NULL);
+		scan.queues[w].next = bulk_node_start(w, scan.num_ranges, num_threads);
+		scan.queues[w].end = bulk_node_start(w+1, scan.num_ranges, num_threads);
+		workers[w].scan = &scan;
+		workers[w].worker = w;
+	}
+	//The ranges of a thread that could not be started are stolen by the others
+	bool* started = calloc(num_threads, sizeof(bool));
+	for(uint32_t w=1; w<num_threads && started != NULL; ++w) {
+		started[w] = pthread_create(&threads[w], NULL, db_scan_worker, &workers[w]) == 0;
+	}
+	bool failed = started == NULL || db_scan_worker(&workers[0]) != NULL;
+	for(uint32_t w=1; w<num_threads && started != NULL; ++w) {
+		void* ret = NULL;
+		if(started[w]) {
+			pthread_join(threads[w], &ret);
+		}
+		failed = failed || ret != NULL;
+	}
+	for(uint32_t w=0; w<num_threads; ++w) {
+		pthread_mutex_destroy(&scan.queues[w].lock);
+	}
+	free(started);
+	free(scan.bounds);
+	free(scan.queues);
+	free(workers);
+	free(threads);
+	return failed ? DB_ERROR_NO_MEMORY : DB_OK;
+}
+
+DbResult db_parallel_scan(Database* db, const char* tablename, uint32_t num_threads, DbScanFunc f, void* context) {
+	return db_table_parallel_scan(db_get_table(db, tablename), num_threads, f, context);
+}
+
+/*
+A secondary index is a table of its own whose rows, its entries, each point
+to a row of the indexed table. An entry's key is the first INDEX_PREFIX
+bytes of the row's field, encoded to sort the way the field does, followed
+by a hash of the row's key that keeps rows with equal fields apart. When
+that key is taken, the entry goes under the next hash along. The entry then
+holds the row's key and the whole field.
+
+Entries change along with their rows, with writers to the indexed table
+taking turns under its index lock so each sees the rows the one before left.
+Readers take no lock, so what they find is checked against the row itself.
+*/
+#define INDEX_PREFIX 8
+#define INDEX_ENTRY_FIELD (2*sizeof(uuid_t))
+
+static bool field_valid(const DbField* field, uint32_t cell_size) {
+	if(field->type == DB_FIELD_INT32 && field->len != sizeof(int32_t)) {
+		return false;
+	}
+	if(field->type == DB_FIELD_INT64 && field->len != sizeof(int64_t)) {
+		return false;
+	}
+	if(field->type > DB_FIELD_STRING || field->len == 0) {
+		return false;
+	}
+	return field->offset <= cell_size && field->len <= cell_size - field->offset;
+}
+
+//Whether a row of size bytes is long enough to hold the field.
+static bool row_has_field(const DbField* field, uint32_t size) {
+	return field->offset + field->len <= size;
+}
+
+static int field_compare(const DbField* field, const uint8_t* a, const uint8_t* b) {
+	if(field->type == DB_FIELD_INT32) {
+		int32_t x, y;
+		memcpy(&x, a, sizeof(x));
+		memcpy(&y, b, sizeof(y));
+		return (x > y) - (x < y);
+	}
+	if(field->type == DB_FIELD_INT64) {
+		int64_t x, y;
+		memcpy(&x, a, sizeof(x));
+		memcpy(&y, b, sizeof(y));
+		return (x > y) - (x < y);
+	}
+	return memcmp(a, b, field->len);
+}
+
+//The start of an entry's key, which sorts as the field does. Integers are
+//stored big endian with the sign bit flipped.
+static void field_prefix(const DbField* field, const uint8_t* value, uint8_t* prefix) {
+	memset(prefix, 0, INDEX_PREFIX);
+	if(field->type == DB_FIELD_STRING) {
+		memcpy(prefix, value, field->len < INDEX_PREFIX ? field->len : INDEX_PREFIX);
+		return;
+	}
+	uint64_t bits;
+	if(field->type == DB_FIELD_INT32) {
+		int32_t v;
+		memcpy(&v, value, sizeof(v));
+		bits = (uint64_t)((uint32_t)v ^ 0x80000000u) << 32;
+	} else {
+		int64_t v;
+		memcpy(&v, value, sizeof(v));
+		bits = (uint64_t)v ^ 0x8000000000000000ull;
+	}
+	for(uint32_t i=0; i<INDEX_PREFIX; ++i) {
+		prefix[i] = bits >> (56 - 8*i);
+	}
+}
+
+//Where the entry for the row with key id and field value goes first.
+static void index_key(const DbField* field, const uint8_t* value, const uint8_t* id, uuid_t key) {
+	field_prefix(field, value, key);
+	uint64_t hash = 14695981039346656037ull;
+	for(uint32_t i=0; i<sizeof(uuid_t); ++i) {
+		hash = (hash ^ id[i]) * 1099511628211ull;
+	}
+	for(uint32_t i=0; i<sizeof(uuid_t) - INDEX_PREFIX; ++i) {
+		key[INDEX_PREFIX + i] = hash >> (56 - 8*i);
+	}
+}
+
+//Moves a key on to the next hash under the same prefix, wrapping around.
+static void index_key_next(uint8_t* key) {
+	for(uint32_t i=sizeof(uuid_t); i-- > INDEX_PREFIX;) {
+		if(++key[i] != 0) {
 			return;
 		}
 	}
-	//printf("NOPE\n");
 }
 
-void db_insert(Database* db, const char* tablename, void* data) {
-	char suuid[37];
-	uuid_unparse(data, suuid);
-	//printf("Inserting UUID: %s\n", suuid);
+static Table* db_find_index(Table* table, uint32_t offset) {
+	for(uint32_t i=0; i<table->num_indexes; ++i) {
+		if(table->indexes[i]->field.offset == offset) {
+			return table->indexes[i];
+		}
+	}
+	return NULL;
+}
 
-	uint32_t ti = db_find_table(db, tablename);
-	Table* table = &db->tables[ti];
-	uint32_t page = 0;
-	Node* node = db_get_page(table->pager, page);
-	bool is_root = true;
+//Adds the entry for a row of size bytes, if it has the field.
+static DbResult db_index_add(Table* index, const uint8_t* row, uint32_t size) {
+	const DbField* field = &index->field;
+	if(!row_has_field(field, size)) {
+		return DB_OK;
+	}
+	uint8_t* entry = index->index_buffer;
+	index_key(field, row + field->offset, row, entry);
+	uuid_copy(entry + sizeof(uuid_t), row);
+	memcpy(entry + INDEX_ENTRY_FIELD, row + field->offset, field->len);
+	Put put;
+	put.row = entry;
+	put.size = index->cell_size;
+	put.mode = PUT_INSERT;
+	put.merge = NULL;
+	put.context = NULL;
+	db_make_cell(index, &put);
+	uint64_t position;
+	DbResult result;
+	while((result = db_put_row(index, &put, &position)) == DB_ERROR_KEY_EXISTS) {
+		index_key_next(entry);
+	}
+	return result;
+}
 
-	while(node->type == NODE_INTERNAL) {
-		page = node->children[node->num_cells-1].page;
-		for(int i=0; i<node->num_cells; ++i) {
-			if(uuid_compare(node->children[i].key, *(uuid_t*)data) > 0) {
-				page = node->children[i].page;
+//Removes the entry for a row of size bytes, if it has the field. The entry
+//is after the key it would go under first, or past the wrap around.
+static DbResult db_index_remove(Table* index, const uint8_t* row, uint32_t size) {
+	const DbField* field = &index->field;
+	if(!row_has_field(field, size)) {
+		return DB_OK;
+	}
+	uuid_t key;
+	index_key(field, row + field->offset, row, key);
+	uint8_t* entry = index->index_buffer;
+	bool found = false;
+	Cursor cursor;
+	db_cursor_start_at(index, &cursor, key);
+	for(uint32_t pass=0; pass<2 && !found; ++pass) {
+		if(pass == 1) {
+			uuid_t first;
+			memcpy(first, key, INDEX_PREFIX);
+			memset(first + INDEX_PREFIX, 0, sizeof(uuid_t) - INDEX_PREFIX);
+			db_cursor_seek(&cursor, first);
+		}
+		while(!found && db_cursor_record(&cursor, entry, index->cell_size) > 0 && memcmp(entry, key, INDEX_PREFIX) == 0) {
+			if(pass == 1 && db_key_compare(entry, key) >= 0) {
 				break;
 			}
+			//The row may have an entry for a new value under the same prefix
+			found = uuid_compare(entry + sizeof(uuid_t), row) == 0 && memcmp(entry + INDEX_ENTRY_FIELD, row + field->offset, field->len) == 0;
+			db_cursor_next(&cursor);
 		}
-		//printf("child %i\n", page);
-		node = db_get_page(table->pager, page);
-		is_root = false;
 	}
-	
-	db_leaf_insert(node, table, data, is_root);
+	db_cursor_close(&cursor);
+	if(!found) {
+		return DB_ERROR_NOT_FOUND;
+	}
+	uint64_t position;
+	return db_remove_row(index, entry, &position);
+}
 
-	//Split if full
-	uint32_t max_cells = leaf_max_cells(table);
-	if(node->num_cells < max_cells) {
-		return;
+/*
+A row changing from old to row, either of them 0 bytes long when there was
+no row or is none left, has its new entries added before it changes and its
+old ones removed after. Lookups check entries against the rows they point
+to, so an entry left over by a failure only takes space, and an index never
+misses a row that is there.
+*/
+static bool index_entry_changes(const DbField* field, const uint8_t* old, uint32_t old_size, const uint8_t* row, uint32_t size) {
+	bool had = row_has_field(field, old_size);
+	bool has = row_has_field(field, size);
+	return !had || !has || memcmp(old + field->offset, row + field->offset, field->len) != 0;
+}
+
+//Adds the entries of row to each index they change in, taking back the
+//ones added so far if one can not be.
+static DbResult db_add_index_entries(Table* table, const uint8_t* old, uint32_t old_size, const uint8_t* row, uint32_t size) {
+	for(uint32_t i=0; i<table->num_indexes; ++i) {
+		if(!index_entry_changes(&table->indexes[i]->field, old, old_size, row, size)) {
+			continue;
+		}
+		DbResult result = db_index_add(table->indexes[i], row, size);
+		if(result != DB_OK) {
+			while(i-- > 0) {
+				if(index_entry_changes(&table->indexes[i]->field, old, old_size, row, size)) {
+					db_index_remove(table->indexes[i], row, size);
+				}
+			}
+			return result;
+		}
 	}
+	return DB_OK;
+}
 
-	//printf("Splitting page %i\n", page);
-	uint32_t next_page = db_get_unused_page(table->pager);
-	Node* next_node = db_get_page(table->pager, next_page);
-	memset(next_node, 0, PAGE_SIZE);
-	next_node->type = NODE_LEAF;
-	next_node->parent = node->parent;
-	next_node->num_cells = max_cells/2;
-	node->num_cells -= next_node->num_cells;
-	void* from = leaf_node_cell(node, node->num_cells, table->cell_size);
-	memcpy(next_node->cellspace, from, next_node->num_cells*table->cell_size);
-	next_node->next_leaf = node->next_leaf;
-	node->next_leaf = next_page;
+//Removes the entries of old from each index they change in for row.
+static void db_remove_index_entries(Table* table, const uint8_t* old, uint32_t old_size, const uint8_t* row, uint32_t size) {
+	for(uint32_t i=0; i<table->num_indexes; ++i) {
+		if(index_entry_changes(&table->indexes[i]->field, old, old_size, row, size)) {
+			db_index_remove(table->indexes[i], old, old_size);
+		}
+	}
+}
 
-	//Need to create new root
-	if(is_root) {
-		uint32_t child_page = db_get_unused_page(table->pager);
-		Node* child_node = db_get_page(table->pager, child_page);
-		memcpy(child_node, node, PAGE_SIZE);
-		memset(node, 0, PAGE_SIZE);
-
-		node->num_cells = 2;
-		node->type = NODE_INTERNAL;
-		node->parent = 0;
-
-		from = leaf_node_cell(child_node, child_node->num_cells-1, table->cell_size);
-		uuid_copy(node->children[0].key, *(uuid_t*)from);
-		node->children[0].page = child_page;
-		child_node->parent = 0;
-
-		from = leaf_node_cell(next_node, next_node->num_cells-1, table->cell_size);
-		uuid_copy(node->children[1].key, *(uuid_t*)from);
-		node->children[1].page = next_page;
-		next_node->parent = 0;
-		return;
+//Puts a row in a table with indexes. A merge is made here, on a copy of
+//the stored row, so its entries can go in first.
+static DbResult db_put_indexed(Table* table, Put* put, uint64_t* position) {
+	uint8_t* merged = NULL;
+	pthread_mutex_lock(&table->index_lock);
+	uint8_t* old = table->index_buffer;
+	uint32_t old_size = db_select_row(table, (uint8_t*)put->row, old, table->index_span);
+	Put change = *put;
+	DbResult result = DB_OK;
+	if(put->merge != NULL && put->mode != PUT_INSERT && old_size > 0) {
+		merged = malloc(table->cell_size);
+		if(merged == NULL) {
+			result = DB_ERROR_NO_MEMORY;
+		} else {
+			db_select_row(table, (uint8_t*)put->row, merged, table->cell_size);
+			put->merge(merged, put->row, put->context);
+			change.row = merged;
+			change.merge = NULL;
+			change.cell.data = merged;
+		}
 	}
+	if(result == DB_OK) {
+		result = db_add_index_entries(table, old, old_size, change.row, change.size);
+	}
+	if(result == DB_OK) {
+		result = db_put_row(table, &change, position);
+		if(result == DB_OK) {
+			db_remove_index_entries(table, old, old_size, change.row, change.size);
+		} else {
+			db_remove_index_entries(table, change.row, change.size, old, old_size);
+		}
+	}
+	pthread_mutex_unlock(&table->index_lock);
+	free(merged);
+	return result;
+}
 
-//printf("internal loop\n");
-	while(true) {
-		db_internal_insert(table, node, page, next_node, next_page);
-//printf("internal insert\n");
-		
-		//if parent full, split it
-		if(node->parent == 0) {
-			is_root = true;
+static DbResult db_remove_indexed(Table* table, uuid_t id, uint64_t* position) {
+	pthread_mutex_lock(&table->index_lock);
+	uint8_t* old = table->index_buffer;
+	uint32_t old_size = db_select_row(table, id, old, table->index_span);
+	DbResult result = db_remove_row(table, id, position);
+	if(result == DB_OK) {
+		db_remove_index_entries(table, old, old_size, NULL, 0);
+	}
+	pthread_mutex_unlock(&table->index_lock);
+	return result;
+}
+
+//Takes back an index that could not be made, which is the last table added,
+//and removes its file.
+static void db_drop_index(Database* db, Table* table, Table* index) {
+	if(table->num_indexes > 0 && table->indexes[table->num_indexes-1] == index) {
+		table->num_indexes--;
+		table->index_span = 0;
+		for(uint32_t i=0; i<table->num_indexes; ++i) {
+			const DbField* field = &table->indexes[i]->field;
+			if(field->offset + field->len > table->index_span) {
+				table->index_span = field->offset + field->len;
+			}
 		}
-		//printf("parent %i\n", node->parent);
-		page = node->parent;
-		node = db_get_page(table->pager, page);
-		if(node->num_cells < INTERNAL_NODE_MAX_CELLS) {
-			return;
+	}
+	db_drop_last_table(db);
+}
+
+/*
+Indexes the field of type and len bytes at offset in the rows of a table,
+adding entries for the rows it holds. Lookups by the field then go through
+db_index_find and db_index_find_range. Rows of tables with variable_rows
+too short to hold the field are left out. Nothing else may use the table
+while its index is made.
+
+An index of a database kept in files is checkpointed before it goes in
+the catalog, so a crash leaves either a whole index or none.
+*/
+DbResult db_create_index(Database* db, const char* tablename, uint32_t offset, DbFieldType type, uint32_t len) {
+	Table* table = db_get_table(db, tablename);
+	if(table == NULL || table->indexed_table != UINT32_MAX) {
+		return DB_ERROR_NO_TABLE;
+	}
+	if(db->read_only) {
+		return DB_ERROR_READ_ONLY;
+	}
+	DbField field;
+	field.offset = offset;
+	field.type = type;
+	field.len = len;
+	if(!field_valid(&field, table->cell_size)) {
+		return DB_ERROR_BAD_FIELD;
+	}
+	char name[65];
+	snprintf(name, sizeof(name), "index.%u.%u", table->id, offset);
+	if(db_find_index(table, offset) != NULL || db_find_table(db, name) != UINT32_MAX) {
+		return DB_ERROR_TABLE_EXISTS;
+	}
+	if(db->path != NULL) {
+		//Left behind by a crash before the index reached the catalog
+		char* path = db_table_path(db, name);
+		unlink(path);
+		free(path);
+	}
+	TableOptions options;
+	memset(&options, 0, sizeof(options));
+	options.compress_keys = true;
+	options.page_size = PAGE_SIZE;
+	Table* index = db_add_table(db, name, INDEX_ENTRY_FIELD + len, &options);
+	if(index == NULL) {
+		return DB_ERROR_NO_MEMORY;
+	}
+	DbResult result = db_init_root(index);
+	index->indexed_table = table->id;
+	index->field = field;
+
+	//The index takes entries before it is linked, see db_link_index
+	index->index_buffer = malloc(index->cell_size);
+	uint8_t* row = malloc(table->cell_size);
+	if(index->index_buffer == NULL || row == NULL) {
+		result = DB_ERROR_NO_MEMORY;
+	}
+	Cursor cursor;
+	db_begin_change(index);
+	db_cursor_start(table, &cursor);
+	uint32_t size;
+	while(result == DB_OK && (size = db_cursor_record(&cursor, row, table->cell_size)) > 0) {
+		result = db_index_add(index, row, size);
+		db_cursor_next(&cursor);
+		if(db_pager_needs_flush(index->pager)) {
+			//Lets the checkpoint in, the index is not in the catalog yet
+			result = db_end_change(index, result, 0);
+			db_begin_change(index);
 		}
-//printf("split\n");
-		//char suuid[36];
-		//uuid_unparse(data, suuid);
-		//printf("split %s\n", suuid);
-		next_page = db_get_unused_page(table->pager);
-		//printf("next_page %i\n", next_page);
-		next_node = db_get_page(table->pager, next_page);
-		memset(next_node, 0, PAGE_SIZE);
-		next_node->type = NODE_INTERNAL;
-		next_node->parent = node->parent;
-		next_node->num_cells = INTERNAL_NODE_MAX_CELLS/2;
-		node->num_cells -= next_node->num_cells;
-		from = node->children + node->num_cells;
-		memcpy(next_node->children, from, next_node->num_cells*sizeof(Child));
+	}
+	db_cursor_close(&cursor);
+	free(row);
+	result = db_end_change(index, result, 0);
+	if(result == DB_OK && !db_link_index(db, index, table->id, &field)) {
+		result = DB_ERROR_NO_MEMORY;
+	}
+	if(result == DB_OK && db->path != NULL) {
+		result = db_checkpoint(db);
+		if(result == DB_OK && !db_write_catalog(db, index)) {
+			result = DB_ERROR_IO;
+		}
+	}
+	if(result != DB_OK) {
+		db_drop_index(db, table, index);
+	}
+	return result;
+}
 
-		//Update parent on children
-		for(uint32_t i = 0; i < next_node->num_cells; ++i) {
-			Node* child_node = db_get_page(table->pager, next_node->children[i].page);
-			child_node->parent = next_page;
-		}
-
-		//Need to create new root
-		if(is_root) {
-			uint32_t child_page = db_get_unused_page(table->pager);
-			//printf("child_page %i\n", child_page);
-			Node* child_node = db_get_page(table->pager, child_page);
-			memcpy(child_node, node, PAGE_SIZE);
-			memset(node, 0, PAGE_SIZE);
-
-			//Update parent on children
-			for(uint32_t i = 0; i < child_node->num_cells; ++i) {
-				Node* grandchild = db_get_page(table->pager, child_node->children[i].page);
-				grandchild->parent = child_page;
-			}
-
-			node->num_cells = 2;
-			node->type = NODE_INTERNAL;
-			node->parent = 0;
-			
-			from = child_node->children + (child_node->num_cells - 1);
-			uuid_copy(node->children[0].key, *(uuid_t*)from);
-			node->children[0].page = child_page;
-			child_node->parent = 0;
-			
-			from = next_node->children + (next_node->num_cells - 1);
-			uuid_copy(node->children[1].key, *(uuid_t*)from);
-			node->children[1].page = next_page;
-			next_node->parent = 0;
-			return;
+/*
+Copies the keys of up to max_ids rows whose field at offset lies between
+low and high, both included, to ids, and returns how many such rows there
+are. Rows with integer fields come out in field order.
+*/
+uint32_t db_table_index_find_range(TableHandle table, uint32_t offset, const void* low, const void* high, uuid_t* ids, uint32_t max_ids) {
+	Table* index = table == NULL ? NULL : db_find_index(table, offset);
+	if(index == NULL) {
+		return 0;
+	}
+	const DbField* field = &index->field;
+	uuid_t start;
+	field_prefix(field, low, start);
+	memset(start + INDEX_PREFIX, 0, sizeof(uuid_t) - INDEX_PREFIX);
+	uint8_t last[INDEX_PREFIX];
+	field_prefix(field, high, last);
+	uint8_t* entry = malloc(index->cell_size);
+	uint8_t* row = malloc(table->index_span);
+	if(entry == NULL || row == NULL) {
+		free(entry);
+		free(row);
+		return 0;
+	}
+	const uint8_t* value = entry + INDEX_ENTRY_FIELD;
+	uint32_t count = 0;
+	Cursor cursor;
+	db_cursor_start_at(index, &cursor, start);
+	while(db_cursor_record(&cursor, entry, index->cell_size) > 0 && memcmp(entry, last, INDEX_PREFIX) <= 0) {
+		if(field_compare(field, value, low) >= 0 && field_compare(field, value, high) <= 0) {
+			//An entry whose row is changing may not match it yet
+			uint32_t size = db_select_row(table, entry + sizeof(uuid_t), row, table->index_span);
+			if(row_has_field(field, size) && memcmp(row + offset, value, field->len) == 0) {
+				if(count < max_ids) {
+					uuid_copy(ids[count], entry + sizeof(uuid_t));
+				}
+				count++;
+			}
 		}
+		db_cursor_next(&cursor);
 	}
+	db_cursor_close(&cursor);
+	free(entry);
+	free(row);
+	return count;
 }
 
-void db_select(Database* db, const char* tablename, uuid_t id, void* data) {
-	uint32_t t = db_find_table(db, tablename);
-	Table* table = &db->tables[t];
-	Node* node = db_get_page(table->pager, 0);
+uint32_t db_table_index_find(TableHandle table, uint32_t offset, const void* value, uuid_t* ids, uint32_t max_ids) {
+	return db_table_index_find_range(table, offset, value, value, ids, max_ids);
+}
 
-	for(uint8_t i=0; i<node->num_cells; ++i) {
-		void* cell = leaf_node_cell(node, i, table->cell_size);
-		if(uuid_compare(*(uuid_t*)cell, id) == 0) {
-			memcpy(data, cell, table->cell_size);
-			return;
+uint32_t db_index_find(Database* db, const char* tablename, uint32_t offset, const void* value, uuid_t* ids, uint32_t max_ids) {
+	return db_table_index_find(db_get_table(db, tablename), offset, value, ids, max_ids);
+}
+
+uint32_t db_index_find_range(Database* db, const char* tablename, uint32_t offset, const void* low, const void* high, uuid_t* ids, uint32_t max_ids) {
+	return db_table_index_find_range(db_get_table(db, tablename), offset, low, high, ids, max_ids);
+}
+
+/*
+Aggregates read the leaves in place, with the kernels of column.h running
+over each run of rows. A leaf read optimistically is only counted once its
+version shows it did not change meanwhile. Tables with variable_rows keep no
+columns, so their rows are copied out one by one, and rows too short for a
+field are not picked.
+*/
+static bool filter_range(const DbFilter* filter, int64_t* low, int64_t* high) {
+	*low = INT64_MIN;
+	*high = INT64_MAX;
+	if(filter->op == DB_FILTER_EQUAL) {
+		*low = *high = filter->value;
+	} else if(filter->op == DB_FILTER_LESS) {
+		if(filter->value == INT64_MIN) {
+			return false;
 		}
+		*high = filter->value - 1;
+	} else if(filter->op == DB_FILTER_RANGE) {
+		*low = filter->value;
+		*high = filter->high;
 	}
+	return *low <= *high;
 }
 
-void db_table_start(Database* db, const char* tablename, Cursor* cursor) {
-	uint32_t i = db_find_table(db, tablename);
-	cursor->table = &db->tables[i];
-	cursor->page = 0;
-	cursor->cell = 0;
-	cursor->end = false;
-	Node* node = db_get_page(cursor->table->pager, 0);
-/*	if(node->type == NODE_INTERNAL) {
-		printf("First child page: %i\n", node->children[0].page);
-		hexDumps("Internal node", node, 128);
-	}*/
-	while(node->type == NODE_INTERNAL) {
-		//printf("First child page: %i\n", node->children[0].page);
-		cursor->page = node->children[0].page;
-		node = db_get_page(cursor->table->pager, node->children[0].page);
+static bool aggregate_field_valid(const DbField* field, uint32_t cell_size) {
+	return field->type != DB_FIELD_STRING && field_valid(field, cell_size);
+}
+
+//Marks the rows of a run the filter picks and adds them to out.
+static void aggregate_run(const DbFilter* filter, const DbField* field, const uint8_t* cells, uint32_t stride, uint32_t n, uint8_t* match, DbAggregate* out) {
+	int64_t low, high;
+	if(!filter_range(filter, &low, &high)) {
+		return;
+	}
+	if(filter->op == DB_FILTER_ALL) {
+		memset(match, 1, n);
+	} else {
+		db_column_match(&filter->field, cells, stride, n, low, high, match);
+	}
+	if(field != NULL) {
+		db_column_aggregate(field, cells, stride, n, match, out);
+		return;
+	}
+	for(uint32_t i=0; i<n; ++i) {
+		out->count += match[i];
 	}
 }
 
-void db_cursor_value(Cursor* cursor, void* out) {
+static DbResult aggregate_records(Cursor* cursor, const DbFilter* filter, const DbField* field, DbAggregate* out) {
 	Table* table = cursor->table;
-	Node* node = db_get_page(table->pager, cursor->page);
-	void* cell = leaf_node_cell(node, cursor->cell, table->cell_size);
-	memcpy(out, cell, table->cell_size);
-	//hexDumps("Page", node, PAGE_SIZE);
+	uint8_t* row = malloc(table->cell_size);
+	if(row == NULL) {
+		return DB_ERROR_NO_MEMORY;
+	}
+	uint32_t size;
+	uint8_t match;
+	while((size = db_cursor_record(cursor, row, table->cell_size)) > 0) {
+		bool fits = filter->op == DB_FILTER_ALL || row_has_field(&filter->field, size);
+		if(fits && (field == NULL || row_has_field(field, size))) {
+			aggregate_run(filter, field, row, size, 1, &match, out);
+		}
+		db_cursor_next(cursor);
+	}
+	free(row);
+	return DB_OK;
 }
 
-void db_cursor_next(Cursor* cursor) {
-//	printf("Cursor: page %i, cell %i\n", cursor->page, cursor->cell);
-	++cursor->cell;
+/*
+Adds the rows from the cursor to its end or upper bound that filter picks
+to out, summing field over them, or only counting them if field is NULL. A
+NULL filter picks every row. Fields must be integers.
+*/
+DbResult db_cursor_aggregate(Cursor* cursor, const DbFilter* filter, const DbField* field, DbAggregate* out) {
+	db_cursor_unpin(cursor);
 	Table* table = cursor->table;
-	Node* node = db_get_page(table->pager, cursor->page);
-	if(cursor->cell >= node->num_cells) {
-		if(node->next_leaf == 0) {
-			cursor->end = true;
-			return;
+	if(table == NULL) {
+		return DB_ERROR_NO_TABLE;
+	}
+	DbFilter all = { .op = DB_FILTER_ALL };
+	if(filter == NULL) {
+		filter = &all;
+	}
+	if(filter->op > DB_FILTER_RANGE || (filter->op != DB_FILTER_ALL && !aggregate_field_valid(&filter->field, table->cell_size))) {
+		return DB_ERROR_BAD_FIELD;
+	}
+	if(field != NULL && !aggregate_field_valid(field, table->cell_size)) {
+		return DB_ERROR_BAD_FIELD;
+	}
+	if(table_variable(table)) {
+		return aggregate_records(cursor, filter, field, out);
+	}
+	uint8_t match[leaf_max_cells(table)];
+	uint32_t version;
+	Node* node;
+	while((node = db_cursor_leaf(cursor, &version)) != NULL) {
+		uint32_t run = db_cursor_run(cursor, node, node->num_cells);
+		DbAggregate part = { 0, 0, INT64_MAX, INT64_MIN };
+		uuid_t last;
+		if(run > 0) {
+			const uint8_t* cells = leaf_node_cell(node, cursor->cell, table->cell_size);
+			aggregate_run(filter, field, cells, table->cell_size, run, match, &part);
+			uuid_copy(last, cells + (run - 1)*table->cell_size);
+		}
+		bool valid = run > 0 && node_read_valid(node, version);
+		db_release_page(table->pager, cursor->page);
+		if(!valid) {
+			db_cursor_move(cursor, false, true);
+			continue;
 		}
-		cursor->cell = 0;
-		cursor->page = node->next_leaf;
-//		printf("Next leaf: %i\n", node->next_leaf);
-		node = db_get_page(table->pager, cursor->page);
-//		hexDumps("Page", node, PAGE_SIZE);
+		out->count += part.count;
+		out->sum = (int64_t)((uint64_t)out->sum + (uint64_t)part.sum);
+		out->min = part.min < out->min ? part.min : out->min;
+		out->max = part.max > out->max ? part.max : out->max;
+		cursor->cell += run - 1;
+		uuid_copy(cursor->key, last);
+		db_cursor_move(cursor, true, false);
+	}
+	return DB_OK;
+}
+
+DbResult db_table_aggregate(TableHandle table, const DbFilter* filter, const DbField* field, DbAggregate* out) {
+	out->count = 0;
+	out->sum = 0;
+	out->min = INT64_MAX;
+	out->max = INT64_MIN;
+	if(table == NULL) {
+		return DB_ERROR_NO_TABLE;
 	}
-}
\ No newline at end of file
+	Cursor cursor;
+	db_cursor_start(table, &cursor);
+	DbResult result = db_cursor_aggregate(&cursor, filter, field, out);
+	db_cursor_close(&cursor);
+	return result;
+}
+
+DbResult db_aggregate(Database* db, const char* tablename, const DbFilter* filter, const DbField* field, DbAggregate* out) {
+	return db_table_aggregate(db_get_table(db, tablename), filter, field, out);
+}
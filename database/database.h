@@ -5,35 +5,228 @@
 #include <stdbool.h>
 #include <uuid/uuid.h>
 #include "pager.h"
+#include "wal.h"
 
+typedef enum {
+	DB_OK,
+	DB_ERROR_NO_TABLE,
+	DB_ERROR_TABLE_EXISTS,
+	DB_ERROR_NOT_FOUND,
+	DB_ERROR_NO_MEMORY,
+	DB_ERROR_IO,
+	DB_ERROR_KEY_EXISTS,
+	DB_ERROR_READ_ONLY,
+	DB_ERROR_ROW_SIZE,
+	DB_ERROR_PAGE_SIZE,
+	DB_ERROR_BAD_FIELD
+} DbResult;
+
+//Largest row a table with variable_rows can be created for.
+#define DB_MAX_ROW_SIZE (64*1024)
+
+//Called by db_upsert with the stored row and the new one when the key
+//exists. It updates existing in place and must not change the key.
+typedef void (*DbMergeFunc)(void* existing, const void* incoming, void* context);
+
+//Called by db_parallel_scan with each row, from several threads at once.
+//worker tells the threads apart, counting from 0, so each can keep partial
+//results of its own.
+typedef void (*DbScanFunc)(void* context, uint32_t worker, const void* row, uint32_t size);
+
+//Chosen when a table is created and kept with it.
+typedef struct {
+	//Internal nodes store the key prefix their children share only once
+	bool compress_keys;
+	//Rows take only the space they need, up to cell_size bytes, and are
+	//put with the _record calls. Rows too large to share a leaf go to
+	//overflow pages.
+	bool variable_rows;
+	//Bytes per page, a power of two from PAGE_SIZE to MAX_PAGE_SIZE, or 0
+	//for PAGE_SIZE. Large pages suit tables that are mostly scanned.
+	uint32_t page_size;
+} TableOptions;
+
+typedef enum {
+	DB_FIELD_INT32,
+	DB_FIELD_INT64,
+	DB_FIELD_STRING
+} DbFieldType;
+
+//A field len bytes long at offset in every row. Integers are in the
+//machine's byte order and take 4 or 8 bytes, strings have a fixed length
+//and compare bytewise.
+typedef struct {
+	uint32_t offset;
+	DbFieldType type;
+	uint32_t len;
+} DbField;
+
+typedef enum {
+	DB_FILTER_ALL,
+	DB_FILTER_EQUAL,
+	DB_FILTER_LESS,
+	DB_FILTER_RANGE
+} DbFilterOp;
+
+//Picks the rows whose integer field is equal to value, less than it, or
+//from value to high, both included.
+typedef struct {
+	DbFilterOp op;
+	DbField field;
+	int64_t value;
+	int64_t high;
+} DbFilter;
+
+//The number of rows picked and the sum, least and greatest of a field over
+//them. With no rows, min is INT64_MAX and max INT64_MIN.
 typedef struct {
+	uint64_t count;
+	int64_t sum;
+	int64_t min;
+	int64_t max;
+} DbAggregate;
+
+typedef struct Table {
 	char name[65];
 	uint32_t cell_size;
+	TableOptions options;
 	Pager* pager;
+	uint32_t append_page;
+	uint32_t id;
+	struct Database* db;
+	//A secondary index is a table of its own, kept with the table it indexes
+	uint32_t indexed_table;
+	DbField field;
+	uint32_t num_indexes;
+	struct Table** indexes;
+	uint32_t index_span;
+	pthread_mutex_t index_lock;
+	//Under index_lock, the row a change replaces up to index_span, or for an
+	//index the entry being added or removed
+	uint8_t* index_buffer;
+	//A page to compact slotted leaves in, NULL for fixed size rows
+	uint8_t* scratch;
+	pthread_mutex_t scratch_lock;
 } Table;
 
-typedef struct {
+//Resolved once with db_get_table, stays valid until the database is closed.
+typedef Table* TableHandle;
+
+/*
+Tables are kept in creation order, and an open addressing hash index on
+their names maps a name to its position.
+
+A database kept in files logs every change to a write-ahead log before the
+call making it returns. Its pagers hold dirty pages until a checkpoint
+writes them all out, so the page files always hold the tables as of the
+last checkpoint, and opening the database replays the log on top of them.
+
+Any database can be saved to a snapshot file, and a database opened from
+one keeps it mapped until it is closed, its pages living in the mapping.
+Opened read only, the mapping is shared between processes and never
+written, and every change is refused.
+
+Secondary indexes made by db_create_index are tables too, left out by
+db_next_table. Their entries change along with the rows they point to and
+are not logged, as redoing the change to a row redoes them.
+*/
+typedef struct Database {
 	uint32_t num_tables;
-	Table* tables;
+	Table** tables;
+	uint32_t index_size;
+	uint32_t* index;
+	char* path;
+	uint32_t pool_pages;
+	Wal* wal;
+	pthread_rwlock_t checkpoint_lock;
+	void* snapshot;
+	size_t snapshot_size;
+	bool read_only;
 } Database;
 
 typedef struct {
 	Table* table;
 	uint32_t page;
-	uint8_t cell;
+	uint32_t cell;
 	bool end;
+	bool bounded;
+	uuid_t upper;
+	uint32_t pinned;
+	uuid_t key;
+	uint32_t version;
+	//Leaves along the chain are prefetched up to prefetch ahead of the
+	//cursor, the furthest being ahead_page, ahead leaves on, and the last
+	//one if ahead_end is set
+	uint32_t prefetch;
+	uint32_t ahead_page;
+	uint32_t ahead;
+	bool ahead_end;
 } Cursor;
 
+//Leaves a cursor prefetches ahead unless told otherwise.
+#define DB_CURSOR_PREFETCH 4
+
 Database* db_open();
+Database* db_open_file(const char* path, uint32_t pool_pages);
 void db_close(Database* db);
-void db_create_table(Database* db, const char* name, uint32_t cell_size);
+void db_set_sync_mode(Database* db, DbSyncMode mode);
+DbResult db_sync(Database* db);
+DbResult db_checkpoint(Database* db);
+DbResult db_save_snapshot(Database* db, const char* path);
+Database* db_open_snapshot(const char* path);
+Database* db_open_readonly(const char* path);
+DbResult db_create_table(Database* db, const char* name, uint32_t cell_size);
+DbResult db_create_table_with_options(Database* db, const char* name, uint32_t cell_size, const TableOptions* options);
 const char* db_first_table(Database* db);
 const char* db_next_table(Database* db, const char* name);
-void db_insert(Database* db, const char* table, void* data);
-void db_select(Database* db, const char* table, uuid_t id, void* data);
+TableHandle db_get_table(Database* db, const char* name);
+DbResult db_insert(Database* db, const char* table, void* data);
+DbResult db_upsert(Database* db, const char* table, void* data, DbMergeFunc merge, void* context);
+DbResult db_bulk_load(Database* db, const char* table, const void* rows, uint32_t n, uint32_t fill_percent);
+DbResult db_update(Database* db, const char* table, void* data);
+DbResult db_delete(Database* db, const char* table, uuid_t id);
+bool db_select(Database* db, const char* table, uuid_t id, void* data);
+DbResult db_insert_record(Database* db, const char* table, const void* data, uint32_t size);
+DbResult db_upsert_record(Database* db, const char* table, const void* data, uint32_t size);
+DbResult db_update_record(Database* db, const char* table, const void* data, uint32_t size);
+uint32_t db_select_record(Database* db, const char* table, uuid_t id, void* data, uint32_t max_size);
+uint32_t db_select_many(Database* db, const char* table, const uuid_t* keys, uint32_t n, void* out, bool* found);
+uint32_t db_select_many_records(Database* db, const char* table, const uuid_t* keys, uint32_t n, void* out, uint32_t* sizes);
+DbResult db_create_index(Database* db, const char* table, uint32_t offset, DbFieldType type, uint32_t len);
+uint32_t db_index_find(Database* db, const char* table, uint32_t offset, const void* value, uuid_t* ids, uint32_t max_ids);
+uint32_t db_index_find_range(Database* db, const char* table, uint32_t offset, const void* low, const void* high, uuid_t* ids, uint32_t max_ids);
+
+DbResult db_table_insert(TableHandle table, void* data);
+DbResult db_table_upsert(TableHandle table, void* data, DbMergeFunc merge, void* context);
+DbResult db_table_update(TableHandle table, void* data);
+DbResult db_table_delete(TableHandle table, uuid_t id);
+bool db_table_select(TableHandle table, uuid_t id, void* data);
+DbResult db_table_insert_record(TableHandle table, const void* data, uint32_t size);
+DbResult db_table_upsert_record(TableHandle table, const void* data, uint32_t size);
+DbResult db_table_update_record(TableHandle table, const void* data, uint32_t size);
+uint32_t db_table_select_record(TableHandle table, uuid_t id, void* data, uint32_t max_size);
+uint32_t db_table_select_many(TableHandle table, const uuid_t* keys, uint32_t n, void* out, bool* found);
+uint32_t db_table_select_many_records(TableHandle table, const uuid_t* keys, uint32_t n, void* out, uint32_t* sizes);
+uint32_t db_table_index_find(TableHandle table, uint32_t offset, const void* value, uuid_t* ids, uint32_t max_ids);
+uint32_t db_table_index_find_range(TableHandle table, uint32_t offset, const void* low, const void* high, uuid_t* ids, uint32_t max_ids);
+
+DbResult db_parallel_scan(Database* db, const char* table, uint32_t num_threads, DbScanFunc f, void* context);
+DbResult db_table_parallel_scan(TableHandle table, uint32_t num_threads, DbScanFunc f, void* context);
+
+DbResult db_aggregate(Database* db, const char* table, const DbFilter* filter, const DbField* field, DbAggregate* out);
+DbResult db_table_aggregate(TableHandle table, const DbFilter* filter, const DbField* field, DbAggregate* out);
 
 void db_table_start(Database* db, const char* table, Cursor* cursor);
+void db_cursor_start(TableHandle table, Cursor* cursor);
+void db_cursor_seek(Cursor* cursor, const uuid_t key);
+void db_cursor_set_upper_bound(Cursor* cursor, const uuid_t bound);
+void db_cursor_set_prefetch(Cursor* cursor, uint32_t depth);
 void db_cursor_value(Cursor* cursor, void* out);
+uint32_t db_cursor_record(Cursor* cursor, void* out, uint32_t max_size);
 void db_cursor_next(Cursor* cursor);
+uint32_t db_cursor_fetch(Cursor* cursor, void* out, uint32_t max_rows);
+uint32_t db_cursor_next_run(Cursor* cursor, const void** cells);
+DbResult db_cursor_aggregate(Cursor* cursor, const DbFilter* filter, const DbField* field, DbAggregate* out);
+void db_cursor_close(Cursor* cursor);
 
 #endif
@@ -0,0 +1,64 @@
+#ifndef KEY_H
+#define KEY_H
+
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+Keys are 16 byte uuids ordered as big endian 128 bit integers, the same
+order uuid_compare gives. The node searches compare a lot of keys, so the
+comparison is inlined instead of going through libuuid.
+
+The scalar version loads each key as two byteswapped 64 bit words. The SSE2
+version finds the first differing byte with one vector compare. Building
+with DB_SIMD_KEYS makes db_key_compare use the SSE2 version.
+*/
+
+static inline uint64_t db_key_word(const uint8_t* key) {
+	uint64_t word;
+	memcpy(&word, key, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	word = __builtin_bswap64(word);
+#endif
+	return word;
+}
+
+static inline int db_key_compare_scalar(const void* a, const void* b) {
+	uint64_t ah = db_key_word(a);
+	uint64_t bh = db_key_word(b);
+	if(ah != bh) {
+		return ah < bh ? -1 : 1;
+	}
+	uint64_t al = db_key_word((const uint8_t*)a + 8);
+	uint64_t bl = db_key_word((const uint8_t*)b + 8);
+	if(al != bl) {
+		return al < bl ? -1 : 1;
+	}
+	return 0;
+}
+
+#ifdef __SSE2__
+static inline int db_key_compare_sse2(const void* a, const void* b) {
+	__m128i va = _mm_loadu_si128((const __m128i*)a);
+	__m128i vb = _mm_loadu_si128((const __m128i*)b);
+	uint32_t differ = ~(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xFFFF;
+	if(differ == 0) {
+		return 0;
+	}
+	uint32_t i = __builtin_ctz(differ);
+	return ((const uint8_t*)a)[i] < ((const uint8_t*)b)[i] ? -1 : 1;
+}
+#endif
+
+static inline int db_key_compare(const void* a, const void* b) {
+#if defined(DB_SIMD_KEYS) && defined(__SSE2__)
+	return db_key_compare_sse2(a, b);
+#else
+	return db_key_compare_scalar(a, b);
+#endif
+}
+
+#endif
@@ -1,33 +1,738 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "pager.h"
 
-Pager* db_open_pager() {
+#define PAGER_MAGIC "SMPAGES"
+#define FREE_LINK_OFFSET(pager) ((pager)->page_size - sizeof(uint32_t))
+//Bytes pulled into the cache when prefetching a page in memory
+#define PREFETCH_BYTES 256
+
+bool db_valid_page_size(uint32_t page_size) {
+	return page_size >= PAGE_SIZE && page_size <= MAX_PAGE_SIZE && (page_size & (page_size - 1)) == 0;
+}
+
+Pager* db_open_pager(uint32_t page_size) {
+	if(!db_valid_page_size(page_size)) {
+		return NULL;
+	}
 	Pager* pager = malloc(sizeof(Pager));
-	for(uint32_t i=0; i<MAX_PAGES; ++i) {
-		pager->pages[i] = NULL;
+	if(pager == NULL) {
+		return NULL;
 	}
+	pager->page_size = page_size;
 	pager->num_pages = 0;
+	pager->free_head = PAGE_NONE;
+	pager->num_free = 0;
+	pager->num_reserved = 0;
+	pager->num_allocated = 0;
+	pager->num_arenas = 0;
+	pager->arenas = NULL;
+	pager->arena_used = 0;
+	pager->map = NULL;
+	pager->num_chunks = 0;
+	pager->chunks = NULL;
+	pager->num_retired = 0;
+	pthread_mutex_init(&pager->lock, NULL);
+	pager->fd = -1;
+	pager->file_pages = 0;
+	pager->pool_pages = 0;
+	pager->num_frames = 0;
+	pager->clock_hand = 0;
+	pager->frames = NULL;
+	pager->num_blocks = 0;
+	pager->blocks = NULL;
+	pager->hold_dirty = false;
+	pager->num_dirty = 0;
+	pager->num_buckets = 0;
+	pager->buckets = NULL;
+	pager->on_load = NULL;
 	return pager;
 }
 
+static void init_frames(Pager* pager, uint32_t start, uint32_t end) {
+	for(uint32_t i=start; i<end; ++i) {
+		pager->frames[i].page = FRAME_NONE;
+		pager->frames[i].pins = 0;
+		pager->frames[i].next = FRAME_NONE;
+		pager->frames[i].dirty = false;
+		pager->frames[i].referenced = false;
+	}
+}
+
+//A file kept from before page sizes were chosen has none in its header
+//and PAGE_SIZE pages. Opening a file with another page size fails.
+Pager* db_open_file_pager(const char* path, uint32_t pool_pages, uint32_t page_size) {
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if(fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	Pager* pager = db_open_pager(page_size);
+	if(pager == NULL) {
+		close(fd);
+		return NULL;
+	}
+	pager->fd = fd;
+	if(st.st_size > 0) {
+		PagerHeader header;
+		if(pread(fd, &header, sizeof(header), 0) != sizeof(header) || strcmp(header.magic, PAGER_MAGIC) != 0
+				|| (header.page_size == 0 ? PAGE_SIZE : header.page_size) != page_size) {
+			pthread_mutex_destroy(&pager->lock);
+			free(pager);
+			close(fd);
+			return NULL;
+		}
+		pager->file_pages = (st.st_size + page_size - 1) / page_size - 1;
+		pager->num_pages = header.num_pages;
+		pager->free_head = header.free_head;
+		pager->num_free = header.num_free;
+	}
+
+	if(pool_pages < MIN_POOL_PAGES) {
+		pool_pages = MIN_POOL_PAGES;
+	}
+	pager->pool_pages = pool_pages;
+	pager->num_frames = pool_pages;
+	pager->frames = malloc(sizeof(Frame)*pool_pages);
+	pager->num_blocks = 1;
+	pager->blocks = malloc(sizeof(uint8_t*));
+	uint8_t* block = malloc((size_t)page_size*pool_pages);
+	pager->num_buckets = 1;
+	while(pager->num_buckets < pool_pages) {
+		pager->num_buckets *= 2;
+	}
+	pager->buckets = malloc(sizeof(uint32_t)*pager->num_buckets);
+	if(pager->frames == NULL || pager->blocks == NULL || block == NULL || pager->buckets == NULL) {
+		free(pager->frames);
+		free(pager->blocks);
+		free(block);
+		free(pager->buckets);
+		pthread_mutex_destroy(&pager->lock);
+		free(pager);
+		close(fd);
+		return NULL;
+	}
+	pager->blocks[0] = block;
+	init_frames(pager, 0, pool_pages);
+
+	for(uint32_t i=0; i<pager->num_buckets; ++i) {
+		pager->buckets[i] = FRAME_NONE;
+	}
+	return pager;
+}
+
+//Frames come in blocks of pool_pages, which never move once allocated.
+static void* frame_data(Pager* pager, uint32_t f) {
+	return pager->blocks[f / pager->pool_pages] + (size_t)(f % pager->pool_pages)*pager->page_size;
+}
+
+//The first block of the file holds the header.
+static off_t page_offset(Pager* pager, uint32_t n) {
+	return ((off_t)n + 1)*pager->page_size;
+}
+
+static uint32_t page_bucket(Pager* pager, uint32_t n) {
+	return (n * 2654435761u) & (pager->num_buckets - 1);
+}
+
+static uint32_t find_frame(Pager* pager, uint32_t n) {
+	uint32_t f = pager->buckets[page_bucket(pager, n)];
+	while(f != FRAME_NONE && pager->frames[f].page != n) {
+		f = pager->frames[f].next;
+	}
+	return f;
+}
+
+static void unlink_frame(Pager* pager, uint32_t f) {
+	uint32_t* link = &pager->buckets[page_bucket(pager, pager->frames[f].page)];
+	while(*link != f) {
+		link = &pager->frames[*link].next;
+	}
+	*link = pager->frames[f].next;
+	pager->frames[f].next = FRAME_NONE;
+}
+
+static void set_dirty(Pager* pager, uint32_t f) {
+	if(!pager->frames[f].dirty) {
+		pager->frames[f].dirty = true;
+		pager->num_dirty++;
+	}
+}
+
+static bool write_frame(Pager* pager, uint32_t f) {
+	Frame* frame = &pager->frames[f];
+	if(pwrite(pager->fd, frame_data(pager, f), pager->page_size, page_offset(pager, frame->page)) != (ssize_t)pager->page_size) {
+		return false;
+	}
+	if(frame->dirty) {
+		frame->dirty = false;
+		pager->num_dirty--;
+	}
+	if(frame->page >= pager->file_pages) {
+		pager->file_pages = frame->page + 1;
+	}
+	return true;
+}
+
+//Adds a block of frames, rehashing once the chains get long, and returns
+//the first new frame.
+static uint32_t grow_pool(Pager* pager) {
+	uint32_t start = pager->num_frames;
+	uint32_t num_frames = start + pager->pool_pages;
+	uint8_t** blocks = realloc(pager->blocks, sizeof(uint8_t*)*(pager->num_blocks + 1));
+	if(blocks == NULL) {
+		return FRAME_NONE;
+	}
+	pager->blocks = blocks;
+	Frame* frames = realloc(pager->frames, sizeof(Frame)*num_frames);
+	if(frames == NULL) {
+		return FRAME_NONE;
+	}
+	pager->frames = frames;
+	uint8_t* block = malloc((size_t)pager->page_size*pager->pool_pages);
+	if(block == NULL) {
+		return FRAME_NONE;
+	}
+	pager->blocks[pager->num_blocks++] = block;
+	init_frames(pager, start, num_frames);
+	pager->num_frames = num_frames;
+
+	if(num_frames > pager->num_buckets*2) {
+		uint32_t* buckets = realloc(pager->buckets, sizeof(uint32_t)*pager->num_buckets*2);
+		if(buckets != NULL) {
+			pager->buckets = buckets;
+			pager->num_buckets *= 2;
+			for(uint32_t i=0; i<pager->num_buckets; ++i) {
+				pager->buckets[i] = FRAME_NONE;
+			}
+			for(uint32_t f=0; f<start; ++f) {
+				if(pager->frames[f].page != FRAME_NONE) {
+					uint32_t b = page_bucket(pager, pager->frames[f].page);
+					pager->frames[f].next = pager->buckets[b];
+					pager->buckets[b] = f;
+				}
+			}
+		}
+	}
+	return start;
+}
+
+//Clock sweep over unpinned frames, writing the victim back if dirty.
+//A pager holding dirty pages passes over them and grows instead.
+static uint32_t evict_frame(Pager* pager) {
+	for(uint32_t step=0; step < pager->num_frames*2; ++step) {
+		uint32_t f = pager->clock_hand;
+		pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+		Frame* frame = &pager->frames[f];
+		if(frame->pins > 0) {
+			continue;
+		}
+		if(frame->referenced) {
+			frame->referenced = false;
+			continue;
+		}
+		if(frame->dirty && pager->hold_dirty) {
+			continue;
+		}
+		if(frame->page != FRAME_NONE) {
+			if(frame->dirty && !write_frame(pager, f)) {
+				return FRAME_NONE;
+			}
+			unlink_frame(pager, f);
+			frame->page = FRAME_NONE;
+		}
+		return f;
+	}
+	if(pager->hold_dirty) {
+		return grow_pool(pager);
+	}
+	//printf("Buffer pool exhausted\n");
+	return FRAME_NONE;
+}
+
+static void* get_file_page(Pager* pager, uint32_t n) {
+	uint32_t f = find_frame(pager, n);
+	if(f == FRAME_NONE) {
+		f = evict_frame(pager);
+		if(f == FRAME_NONE) {
+			return NULL;
+		}
+		void* data = frame_data(pager, f);
+		if(n < pager->file_pages) {
+			ssize_t r = pread(pager->fd, data, pager->page_size, page_offset(pager, n));
+			if(r < 0) {
+				return NULL;
+			}
+			memset((uint8_t*)data + r, 0, pager->page_size - r);
+			if(pager->on_load != NULL) {
+				pager->on_load(data);
+			}
+		} else {
+			memset(data, 0, pager->page_size);
+		}
+		Frame* frame = &pager->frames[f];
+		frame->page = n;
+		frame->dirty = false;
+		uint32_t b = page_bucket(pager, n);
+		frame->next = pager->buckets[b];
+		pager->buckets[b] = f;
+	}
+	pager->frames[f].pins++;
+	pager->frames[f].referenced = true;
+	return frame_data(pager, f);
+}
+
+static void fill_header(Pager* pager, PagerHeader* header) {
+	memset(header, 0, sizeof(*header));
+	strcpy(header->magic, PAGER_MAGIC);
+	header->num_pages = pager->num_pages;
+	header->free_head = pager->free_head;
+	header->num_free = pager->num_free;
+	header->page_size = pager->page_size;
+}
+
+void db_get_pager_header(Pager* pager, PagerHeader* header) {
+	pthread_mutex_lock(&pager->lock);
+	fill_header(pager, header);
+	pthread_mutex_unlock(&pager->lock);
+}
+
+void db_set_pager_header(Pager* pager, const PagerHeader* header) {
+	pthread_mutex_lock(&pager->lock);
+	pager->num_pages = header->num_pages;
+	pager->free_head = header->free_head;
+	pager->num_free = header->num_free;
+	pthread_mutex_unlock(&pager->lock);
+}
+
+//Writes out every dirty page and the header, false if any of it failed.
+bool db_flush_pager(Pager* pager) {
+	if(pager->fd < 0) {
+		return true;
+	}
+	pthread_mutex_lock(&pager->lock);
+	bool ok = true;
+	for(uint32_t f=0; f<pager->num_frames; ++f) {
+		if(pager->frames[f].page != FRAME_NONE && pager->frames[f].dirty) {
+			ok = write_frame(pager, f) && ok;
+		}
+	}
+	PagerHeader header;
+	fill_header(pager, &header);
+	ok = pwrite(pager->fd, &header, sizeof(header), 0) == sizeof(header) && ok;
+	ok = fsync(pager->fd) == 0 && ok;
+	pthread_mutex_unlock(&pager->lock);
+	return ok;
+}
+
 void db_close_pager(Pager* pager) {
-	for(uint32_t i=0; i<MAX_PAGES; ++i) {
-		free(pager->pages[i]);
+	if(pager->fd >= 0) {
+		db_flush_pager(pager);
+		close(pager->fd);
 	}
+	for(uint32_t i=0; i<pager->num_arenas; ++i) {
+		munmap(pager->arenas[i], ARENA_SIZE);
+	}
+	free(pager->arenas);
+	for(uint32_t i=0; i<pager->num_chunks; ++i) {
+		free(pager->chunks[i]);
+	}
+	free(pager->chunks);
+	for(uint32_t i=0; i<pager->num_retired; ++i) {
+		free(pager->retired[i]);
+	}
+	free(pager->frames);
+	for(uint32_t i=0; i<pager->num_blocks; ++i) {
+		free(pager->blocks[i]);
+	}
+	free(pager->blocks);
+	free(pager->buckets);
+	pthread_mutex_destroy(&pager->lock);
 	free(pager);
 }
 
+//Puts page in the next slot of the directory, growing it as needed.
+static bool add_page(Pager* pager, void* page) {
+	uint32_t n = pager->num_allocated;
+	if(n == PAGE_NONE) {
+		return false;
+	}
+	uint32_t c = n >> DIRECTORY_CHUNK_BITS;
+	if(c >= pager->num_chunks) {
+		//Readers may still be using the old array, so it is retired rather than freed
+		if(pager->num_retired == MAX_DIRECTORY_GROWTHS) {
+			return false;
+		}
+		uint32_t num_chunks = pager->num_chunks == 0 ? 1 : pager->num_chunks*2;
+		void*** chunks = malloc(sizeof(void**)*num_chunks);
+		if(chunks == NULL) {
+			return false;
+		}
+		for(uint32_t i=0; i<num_chunks; ++i) {
+			chunks[i] = i < pager->num_chunks ? pager->chunks[i] : NULL;
+		}
+		if(pager->chunks != NULL) {
+			pager->retired[pager->num_retired++] = pager->chunks;
+		}
+		__atomic_store_n(&pager->chunks, chunks, __ATOMIC_RELEASE);
+		pager->num_chunks = num_chunks;
+	}
+	if(pager->chunks[c] == NULL) {
+		void** chunk = malloc(sizeof(void*)*DIRECTORY_CHUNK_PAGES);
+		if(chunk == NULL) {
+			return false;
+		}
+		__atomic_store_n(&pager->chunks[c], chunk, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&pager->chunks[c][n & (DIRECTORY_CHUNK_PAGES-1)], page, __ATOMIC_RELEASE);
+	//Lets db_prefetch_page check pages without the lock
+	__atomic_store_n(&pager->num_allocated, n + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+//Maps a zeroed arena aligned to its size, trimming a mapping twice as big.
+static uint8_t* map_arena() {
+	uint8_t* map = mmap(NULL, ARENA_SIZE*2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(map == MAP_FAILED) {
+		return NULL;
+	}
+	uint8_t* arena = (uint8_t*)(((uintptr_t)map + ARENA_SIZE - 1) & ~(uintptr_t)(ARENA_SIZE - 1));
+	if(arena > map) {
+		munmap(map, arena - map);
+	}
+	munmap(arena + ARENA_SIZE, map + ARENA_SIZE - arena);
+#ifdef MADV_HUGEPAGE
+	madvise(arena, ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+	return arena;
+}
+
+//Backs the next page in the directory with the next page of the current
+//arena, starting a new arena when it is used up.
+static bool allocate_page(Pager* pager) {
+	if(pager->num_arenas == 0 || pager->arena_used == ARENA_SIZE / pager->page_size) {
+		uint8_t** arenas = realloc(pager->arenas, sizeof(uint8_t*)*(pager->num_arenas + 1));
+		if(arenas == NULL) {
+			return false;
+		}
+		pager->arenas = arenas;
+		uint8_t* arena = map_arena();
+		if(arena == NULL) {
+			return false;
+		}
+		pager->arenas[pager->num_arenas++] = arena;
+		pager->arena_used = 0;
+	}
+	uint8_t* page = pager->arenas[pager->num_arenas-1] + (size_t)pager->arena_used*pager->page_size;
+	if(!add_page(pager, page)) {
+		return false;
+	}
+	pager->arena_used++;
+	return true;
+}
+
+/*
+Opens a pager over pages mapped read only by the caller, laid out one after
+another as described by header. db_get_page hands out pointers into the
+mapping, which must outlive the pager, and no page can be added or freed.
+*/
+Pager* db_open_mapped_pager(uint8_t* pages, const PagerHeader* header) {
+	Pager* pager = db_open_pager(header->page_size);
+	if(pager == NULL) {
+		return NULL;
+	}
+	pager->map = pages;
+	pager->num_pages = header->num_pages;
+	pager->free_head = header->free_head;
+	pager->num_free = header->num_free;
+	return pager;
+}
+
+/*
+Backs the pages of a new memory pager with ones mapped by the caller, laid
+out one after another as described by header. The pager changes them in
+place and leaves them alone at close, so the mapping has to be writable and
+outlive the pager. Their latch words must be clear.
+*/
+bool db_map_pages(Pager* pager, uint8_t* pages, const PagerHeader* header) {
+	if(pager->fd >= 0 || pager->num_allocated > 0 || header->page_size != pager->page_size) {
+		return false;
+	}
+	pthread_mutex_lock(&pager->lock);
+	bool ok = true;
+	for(uint32_t n=0; ok && n<header->num_pages; ++n) {
+		ok = add_page(pager, pages + (size_t)n*pager->page_size);
+	}
+	if(ok) {
+		pager->num_pages = header->num_pages;
+		pager->free_head = header->free_head;
+		pager->num_free = header->num_free;
+	}
+	pthread_mutex_unlock(&pager->lock);
+	return ok;
+}
+
+static void* memory_page(Pager* pager, uint32_t n) {
+	if(pager->map != NULL) {
+		return n < pager->num_pages ? pager->map + (size_t)n*pager->page_size : NULL;
+	}
+	void*** chunks = __atomic_load_n(&pager->chunks, __ATOMIC_ACQUIRE);
+	void** chunk = __atomic_load_n(&chunks[n >> DIRECTORY_CHUNK_BITS], __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&chunk[n & (DIRECTORY_CHUNK_PAGES-1)], __ATOMIC_ACQUIRE);
+}
+
+static void* get_page_locked(Pager* pager, uint32_t n) {
+	if(pager->fd >= 0) {
+		return get_file_page(pager, n);
+	}
+	return memory_page(pager, n);
+}
+
+static void release_page_locked(Pager* pager, uint32_t n) {
+	if(pager->fd < 0) {
+		return;
+	}
+	uint32_t f = find_frame(pager, n);
+	if(f != FRAME_NONE && pager->frames[f].pins > 0) {
+		pager->frames[f].pins--;
+	}
+}
+
+//Makes sure count pages can be handed out, from the free list or new.
+static bool ensure_pages(Pager* pager, uint32_t count) {
+	if(count <= pager->num_free) {
+		return true;
+	}
+	count -= pager->num_free;
+	if(pager->map != NULL || pager->num_pages > PAGE_NONE - count) {
+		return false;
+	}
+	if(pager->fd >= 0) {
+		return true;
+	}
+	while(pager->num_allocated < pager->num_pages + count) {
+		if(!allocate_page(pager)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+//Makes sure the next count calls to db_get_unused_page succeed.
+bool db_reserve_pages(Pager* pager, uint32_t count) {
+	pthread_mutex_lock(&pager->lock);
+	bool reserved = pager->num_reserved <= UINT32_MAX - count && ensure_pages(pager, pager->num_reserved + count);
+	if(reserved) {
+		pager->num_reserved += count;
+	}
+	pthread_mutex_unlock(&pager->lock);
+	return reserved;
+}
+
+void db_unreserve_pages(Pager* pager, uint32_t count) {
+	pthread_mutex_lock(&pager->lock);
+	pager->num_reserved -= count;
+	pthread_mutex_unlock(&pager->lock);
+}
+
 uint32_t db_get_unused_page(Pager* pager) {
 	//printf("Page: %i\n", pager->num_pages);
-	if(pager->num_pages >= MAX_PAGES) {
-		//printf("Page overflow\n");
-		exit(0);
+	pthread_mutex_lock(&pager->lock);
+	if(pager->num_reserved > 0) {
+		pager->num_reserved--;
+	} else if(!ensure_pages(pager, pager->num_reserved + 1)) {
+		//printf("Out of pages\n");
+		pthread_mutex_unlock(&pager->lock);
+		return PAGE_NONE;
+	}
+	uint32_t n = pager->num_pages;
+	if(pager->free_head != PAGE_NONE) {
+		n = pager->free_head;
+		uint8_t* page = get_page_locked(pager, n);
+		if(page == NULL) {
+			pthread_mutex_unlock(&pager->lock);
+			return PAGE_NONE;
+		}
+		memcpy(&pager->free_head, page + FREE_LINK_OFFSET(pager), sizeof(uint32_t));
+		pager->num_free--;
+		release_page_locked(pager, n);
+	} else {
+		pager->num_pages++;
 	}
-	pager->pages[pager->num_pages] = malloc(PAGE_SIZE);
-	return pager->num_pages++;
+	pthread_mutex_unlock(&pager->lock);
+	return n;
+}
+
+void db_free_page(Pager* pager, uint32_t n) {
+	if(pager->map != NULL) {
+		return;
+	}
+	pthread_mutex_lock(&pager->lock);
+	uint8_t* page = get_page_locked(pager, n);
+	if(page != NULL) {
+		memcpy(page + FREE_LINK_OFFSET(pager), &pager->free_head, sizeof(uint32_t));
+		if(pager->fd >= 0) {
+			set_dirty(pager, find_frame(pager, n));
+		}
+		release_page_locked(pager, n);
+		pager->free_head = n;
+		pager->num_free++;
+	}
+	pthread_mutex_unlock(&pager->lock);
 }
 
 void* db_get_page(Pager* pager, uint32_t n) {
-	return pager->pages[n];
+	if(pager->fd < 0) {
+		return memory_page(pager, n);
+	}
+	pthread_mutex_lock(&pager->lock);
+	void* page = get_file_page(pager, n);
+	pthread_mutex_unlock(&pager->lock);
+	return page;
+}
+
+/*
+Hints that page n will be wanted soon, without waiting for it or pinning it.
+Pages in memory have their start pulled into the cache, pages of a read only
+mapping are faulted in ahead by the kernel, and pages of a file not in the
+pool are read ahead into the page cache. Returns false if there is no page n.
+*/
+bool db_prefetch_page(Pager* pager, uint32_t n) {
+	if(pager->map != NULL) {
+		if(n >= pager->num_pages) {
+			return false;
+		}
+		uintptr_t start = (uintptr_t)(pager->map + (size_t)n*pager->page_size);
+		uintptr_t aligned = start & ~(uintptr_t)(PAGE_SIZE - 1);
+		madvise((void*)aligned, start - aligned + pager->page_size, MADV_WILLNEED);
+		return true;
+	}
+	if(pager->fd < 0) {
+		if(n >= __atomic_load_n(&pager->num_allocated, __ATOMIC_ACQUIRE)) {
+			return false;
+		}
+		//The hardware carries on along the page once its start is read
+		const uint8_t* page = memory_page(pager, n);
+		uint32_t size = pager->page_size < PREFETCH_BYTES ? pager->page_size : PREFETCH_BYTES;
+		for(uint32_t i=0; i<size; i+=64) {
+			__builtin_prefetch(page + i);
+		}
+		return true;
+	}
+	pthread_mutex_lock(&pager->lock);
+	bool exists = n < pager->num_pages;
+	bool read = exists && n < pager->file_pages && find_frame(pager, n) == FRAME_NONE;
+	pthread_mutex_unlock(&pager->lock);
+	if(read) {
+		posix_fadvise(pager->fd, page_offset(pager, n), pager->page_size, POSIX_FADV_WILLNEED);
+	}
+	return exists;
+}
+
+/*
+Copies size bytes from offset on of page n to data, without pinning it or
+taking a frame for it: from memory or the mapping, from the frame holding
+it, or else with a small read of the file. Nothing keeps the page from
+changing meanwhile. Returns false if there is no page n to read.
+*/
+bool db_peek_page(Pager* pager, uint32_t n, uint32_t offset, void* data, uint32_t size) {
+	if(pager->map != NULL) {
+		if(n >= pager->num_pages) {
+			return false;
+		}
+		memcpy(data, pager->map + (size_t)n*pager->page_size + offset, size);
+		return true;
+	}
+	if(pager->fd < 0) {
+		if(n >= __atomic_load_n(&pager->num_allocated, __ATOMIC_ACQUIRE)) {
+			return false;
+		}
+		memcpy(data, (uint8_t*)memory_page(pager, n) + offset, size);
+		return true;
+	}
+	pthread_mutex_lock(&pager->lock);
+	uint32_t f = n < pager->num_pages ? find_frame(pager, n) : FRAME_NONE;
+	bool read = f == FRAME_NONE && n < pager->file_pages;
+	if(f != FRAME_NONE) {
+		memcpy(data, (uint8_t*)frame_data(pager, f) + offset, size);
+	}
+	pthread_mutex_unlock(&pager->lock);
+	if(read) {
+		return pread(pager->fd, data, size, page_offset(pager, n) + offset) == (ssize_t)size;
+	}
+	return f != FRAME_NONE;
+}
+
+void db_release_page(Pager* pager, uint32_t n) {
+	if(pager->fd < 0) {
+		return;
+	}
+	pthread_mutex_lock(&pager->lock);
+	release_page_locked(pager, n);
+	pthread_mutex_unlock(&pager->lock);
+}
+
+void db_mark_dirty(Pager* pager, uint32_t n) {
+	if(pager->fd < 0) {
+		return;
+	}
+	pthread_mutex_lock(&pager->lock);
+	uint32_t f = find_frame(pager, n);
+	if(f != FRAME_NONE) {
+		set_dirty(pager, f);
+	}
+	pthread_mutex_unlock(&pager->lock);
+}
+
+//Hands f each dirty page of a file pager, with the pager locked.
+void db_for_each_dirty_page(Pager* pager, DbPageFunc f, void* context) {
+	if(pager->fd < 0) {
+		return;
+	}
+	pthread_mutex_lock(&pager->lock);
+	for(uint32_t i=0; i<pager->num_frames; ++i) {
+		if(pager->frames[i].page != FRAME_NONE && pager->frames[i].dirty) {
+			f(context, pager->frames[i].page, frame_data(pager, i));
+		}
+	}
+	pthread_mutex_unlock(&pager->lock);
+}
+
+//True once a pager holding dirty pages has filled half its initial pool.
+bool db_pager_needs_flush(Pager* pager) {
+	if(!pager->hold_dirty) {
+		return false;
+	}
+	pthread_mutex_lock(&pager->lock);
+	bool full = pager->num_dirty*2 >= pager->pool_pages;
+	pthread_mutex_unlock(&pager->lock);
+	return full;
+}
+
+//Overwrites page n of a file pager with data.
+bool db_write_page(Pager* pager, uint32_t n, const void* data) {
+	if(pager->fd < 0) {
+		return false;
+	}
+	pthread_mutex_lock(&pager->lock);
+	uint8_t* page = get_file_page(pager, n);
+	if(page != NULL) {
+		memcpy(page, data, pager->page_size);
+		if(pager->on_load != NULL) {
+			pager->on_load(page);
+		}
+		set_dirty(pager, find_frame(pager, n));
+		release_page_locked(pager, n);
+	}
+	pthread_mutex_unlock(&pager->lock);
+	return page != NULL;
 }
@@ -2,21 +2,130 @@
 #define PAGER_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <unistd.h>
+#include <pthread.h>
 
-#define MAX_PAGES 2000
+//Pages are a power of two from PAGE_SIZE up to MAX_PAGE_SIZE bytes, chosen
+//per pager. PAGE_SIZE is also the default.
 #define PAGE_SIZE 4096
+#define MAX_PAGE_SIZE (64*1024)
+#define MIN_POOL_PAGES 8
 
+#define DIRECTORY_CHUNK_BITS 10
+#define DIRECTORY_CHUNK_PAGES (1u << DIRECTORY_CHUNK_BITS)
 
+#define MAX_DIRECTORY_GROWTHS 32
+
+//Pages in memory come from 2 MB arenas, which can be backed by huge pages.
+#define ARENA_SIZE ((size_t)2*1024*1024)
+
+#define PAGE_NONE UINT32_MAX
+#define FRAME_NONE UINT32_MAX
+
+typedef struct {
+	uint32_t page;
+	uint32_t pins;
+	uint32_t next;
+	bool dirty;
+	bool referenced;
+} Frame;
+
+typedef struct {
+	char magic[8];
+	uint32_t num_pages;
+	uint32_t free_head;
+	uint32_t num_free;
+	uint32_t page_size;
+} PagerHeader;
+
+//Called by a file pager with each page it reads in or is handed by
+//db_write_page, before anyone else can see the page.
+typedef void (*DbPageLoadFunc)(void* page);
+
+/*
+A pager either keeps every page in memory, or reads pages on demand from a
+file into a fixed pool of frames and writes dirty frames back on eviction.
+Pages returned by db_get_page are pinned until db_release_page is called.
+A page file starts with a PagerHeader block, followed by the pages, the
+block being a page long.
+
+In memory, pages are found through a two level directory: a growable array
+of chunks, each holding DIRECTORY_CHUNK_PAGES page pointers. Pages never
+move and the replaced chunk arrays are kept until close, so in memory
+db_get_page does not lock. The pages themselves are carved in order from
+aligned arenas of ARENA_SIZE bytes, unmapped whole at close. The first
+pages may instead belong to a mapping handed over by db_map_pages. A pager
+opened over a read only mapping has no directory and no pages of its own.
+
+A pager told to hold dirty pages never writes one back on eviction, and
+grows its pool by another block of frames when every frame is dirty or
+pinned. The pages on disk then only change when db_flush_pager runs.
+
+Freed pages form a list linked through their last four bytes and are
+handed out again by db_get_unused_page.
+
+The pager is safe to share between threads. Pages reserved by
+db_reserve_pages are held for the caller until db_get_unused_page takes
+them or db_unreserve_pages gives them back.
+*/
 typedef struct {
+	uint32_t page_size;
 	uint32_t num_pages;
-	void* pages[MAX_PAGES];
+	uint32_t free_head;
+	uint32_t num_free;
+	uint32_t num_reserved;
+	uint32_t num_allocated;
+	uint32_t num_arenas;
+	uint8_t** arenas;
+	uint32_t arena_used;
+	uint8_t* map;
+	uint32_t num_chunks;
+	void*** chunks;
+	uint32_t num_retired;
+	void*** retired[MAX_DIRECTORY_GROWTHS];
+	pthread_mutex_t lock;
+
+	int fd;
+	uint32_t file_pages;
+	uint32_t pool_pages;
+	uint32_t num_frames;
+	uint32_t clock_hand;
+	Frame* frames;
+	uint32_t num_blocks;
+	uint8_t** blocks;
+	bool hold_dirty;
+	uint32_t num_dirty;
+	uint32_t num_buckets;
+	uint32_t* buckets;
+	DbPageLoadFunc on_load;
 } Pager;
 
-Pager* db_open_pager();
+//Called with each dirty page by db_for_each_dirty_page.
+typedef void (*DbPageFunc)(void* context, uint32_t n, const void* page);
+
+bool db_valid_page_size(uint32_t page_size);
+Pager* db_open_pager(uint32_t page_size);
+Pager* db_open_file_pager(const char* path, uint32_t pool_pages, uint32_t page_size);
+Pager* db_open_mapped_pager(uint8_t* pages, const PagerHeader* header);
 void db_close_pager(Pager* pager);
+bool db_flush_pager(Pager* pager);
 
+bool db_reserve_pages(Pager* pager, uint32_t count);
+void db_unreserve_pages(Pager* pager, uint32_t count);
 uint32_t db_get_unused_page(Pager* pager);
+void db_free_page(Pager* pager, uint32_t n);
 void* db_get_page(Pager* pager, uint32_t n);
+void db_release_page(Pager* pager, uint32_t n);
+bool db_prefetch_page(Pager* pager, uint32_t n);
+bool db_peek_page(Pager* pager, uint32_t n, uint32_t offset, void* data, uint32_t size);
+void db_mark_dirty(Pager* pager, uint32_t n);
+bool db_map_pages(Pager* pager, uint8_t* pages, const PagerHeader* header);
+
+void db_for_each_dirty_page(Pager* pager, DbPageFunc f, void* context);
+bool db_pager_needs_flush(Pager* pager);
+void db_get_pager_header(Pager* pager, PagerHeader* header);
+void db_set_pager_header(Pager* pager, const PagerHeader* header);
+bool db_write_page(Pager* pager, uint32_t n, const void* data);
 
 #endif
@@ -0,0 +1,56 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sort.h"
+
+/*
+Stable LSD radix sort on the 16 key bytes, one byte per pass.
+All histograms are gathered in a single read, and passes where every key
+shares the same byte (common in time ordered UUIDs) are skipped.
+*/
+bool db_sort_keys(KeyRef* refs, uint32_t n) {
+	if(n < 2) {
+		return true;
+	}
+	uint32_t (*counts)[256] = malloc(sizeof(uuid_t)*sizeof(*counts));
+	KeyRef* buffer = malloc(sizeof(KeyRef)*n);
+	if(counts == NULL || buffer == NULL) {
+		free(counts);
+		free(buffer);
+		return false;
+	}
+	memset(counts, 0, sizeof(uuid_t)*sizeof(*counts));
+
+	for(uint32_t i=0; i<n; ++i) {
+		for(int b=0; b<(int)sizeof(uuid_t); ++b) {
+			counts[b][refs[i].key[b]]++;
+		}
+	}
+
+	KeyRef* from = refs;
+	KeyRef* to = buffer;
+	for(int b=sizeof(uuid_t)-1; b>=0; --b) {
+		uint32_t* count = counts[b];
+		if(count[from[0].key[b]] == n) {
+			continue;
+		}
+		uint32_t offset = 0;
+		for(int d=0; d<256; ++d) {
+			uint32_t c = count[d];
+			count[d] = offset;
+			offset += c;
+		}
+		for(uint32_t i=0; i<n; ++i) {
+			to[count[from[i].key[b]]++] = from[i];
+		}
+		KeyRef* swap = from;
+		from = to;
+		to = swap;
+	}
+
+	if(from != refs) {
+		memcpy(refs, from, sizeof(KeyRef)*n);
+	}
+	free(counts);
+	free(buffer);
+	return true;
+}
@@ -0,0 +1,15 @@
+#ifndef SORT_H
+#define SORT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <uuid/uuid.h>
+
+typedef struct {
+	uuid_t key;
+	uint32_t index;
+} KeyRef;
+
+bool db_sort_keys(KeyRef* refs, uint32_t n);
+
+#endif
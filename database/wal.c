@@ -0,0 +1,224 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "wal.h"
+
+//Records never carry more than a page or a row, and both stay within 64 KB.
+#define WAL_MAX_PAYLOAD (64*1024)
+
+Wal* db_open_wal(const char* path, DbSyncMode mode) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if(fd < 0) {
+		return NULL;
+	}
+	Wal* wal = malloc(sizeof(Wal));
+	uint8_t* buffer = malloc(WAL_BUFFER_SIZE);
+	uint8_t* spare = malloc(WAL_BUFFER_SIZE);
+	if(wal == NULL || buffer == NULL || spare == NULL) {
+		free(wal);
+		free(buffer);
+		free(spare);
+		close(fd);
+		return NULL;
+	}
+	wal->fd = fd;
+	wal->mode = mode;
+	pthread_mutex_init(&wal->lock, NULL);
+	pthread_cond_init(&wal->written_cond, NULL);
+	wal->buffer = buffer;
+	wal->spare = spare;
+	wal->used = 0;
+	wal->appended = 0;
+	wal->written = 0;
+	wal->synced = 0;
+	wal->flushing = false;
+	wal->failed = false;
+	wal->syncs = 0;
+	return wal;
+}
+
+//FNV-1a over the record with its checksum zeroed, then the payload.
+static uint32_t wal_checksum(const WalRecord* record, const void* payload) {
+	WalRecord header = *record;
+	header.checksum = 0;
+	uint32_t hash = 2166136261u;
+	const uint8_t* bytes = (const uint8_t*)&header;
+	for(uint32_t i=0; i<sizeof(header); ++i) {
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	bytes = payload;
+	for(uint32_t i=0; i<record->size; ++i) {
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	return hash;
+}
+
+/*
+Writes out the buffer, syncing the file if asked to. Called with the lock
+held and no write in progress. The lock is let go during the write, with
+the spare buffer taking appends meanwhile.
+*/
+static void wal_flush_locked(Wal* wal, bool sync) {
+	wal->flushing = true;
+	uint8_t* out = wal->buffer;
+	uint32_t size = wal->used;
+	uint64_t target = wal->appended;
+	wal->buffer = wal->spare;
+	wal->used = 0;
+	pthread_mutex_unlock(&wal->lock);
+
+	bool ok = true;
+	uint32_t done = 0;
+	while(ok && done < size) {
+		ssize_t w = write(wal->fd, out + done, size - done);
+		if(w <= 0) {
+			ok = false;
+		} else {
+			done += w;
+		}
+	}
+	if(ok && sync) {
+		ok = fdatasync(wal->fd) == 0;
+	}
+
+	pthread_mutex_lock(&wal->lock);
+	wal->spare = out;
+	if(ok) {
+		wal->written = target;
+		if(sync) {
+			wal->synced = target;
+			wal->syncs++;
+		}
+	} else {
+		wal->failed = true;
+	}
+	wal->flushing = false;
+	pthread_cond_broadcast(&wal->written_cond);
+}
+
+//Adds a record to the log and returns the position just past it.
+uint64_t db_wal_append(Wal* wal, uint32_t type, uint32_t table, uint32_t page, const void* payload, uint32_t size) {
+	WalRecord record;
+	record.size = size;
+	record.type = type;
+	record.table = table;
+	record.page = page;
+	record.checksum = wal_checksum(&record, payload);
+	uint32_t length = sizeof(record) + size;
+
+	pthread_mutex_lock(&wal->lock);
+	while(wal->used + length > WAL_BUFFER_SIZE) {
+		if(wal->flushing) {
+			pthread_cond_wait(&wal->written_cond, &wal->lock);
+		} else {
+			wal_flush_locked(wal, wal->mode != DB_SYNC_OFF);
+		}
+	}
+	memcpy(wal->buffer + wal->used, &record, sizeof(record));
+	if(size > 0) {
+		memcpy(wal->buffer + wal->used + sizeof(record), payload, size);
+	}
+	wal->used += length;
+	wal->appended += length;
+	uint64_t position = wal->appended;
+	pthread_mutex_unlock(&wal->lock);
+	return position;
+}
+
+//Waits until the log is synced up to position if the sync mode asks for it.
+//Writers arriving while a sync is running are covered by the next one.
+bool db_wal_commit(Wal* wal, uint64_t position) {
+	if(wal->mode != DB_SYNC_FULL) {
+		return !__atomic_load_n(&wal->failed, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_lock(&wal->lock);
+	while(wal->synced < position && !wal->failed) {
+		if(wal->flushing) {
+			pthread_cond_wait(&wal->written_cond, &wal->lock);
+		} else {
+			wal_flush_locked(wal, true);
+		}
+	}
+	bool ok = !wal->failed;
+	pthread_mutex_unlock(&wal->lock);
+	return ok;
+}
+
+//Writes and syncs everything appended so far, whatever the sync mode.
+bool db_wal_sync(Wal* wal) {
+	pthread_mutex_lock(&wal->lock);
+	while(wal->synced < wal->appended && !wal->failed) {
+		if(wal->flushing) {
+			pthread_cond_wait(&wal->written_cond, &wal->lock);
+		} else {
+			wal_flush_locked(wal, true);
+		}
+	}
+	bool ok = !wal->failed;
+	pthread_mutex_unlock(&wal->lock);
+	return ok;
+}
+
+//Empties the log file once a checkpoint has made its records redundant.
+bool db_wal_truncate(Wal* wal) {
+	if(!db_wal_sync(wal)) {
+		return false;
+	}
+	pthread_mutex_lock(&wal->lock);
+	bool ok = ftruncate(wal->fd, 0) == 0;
+	if(ok && wal->mode != DB_SYNC_OFF) {
+		ok = fsync(wal->fd) == 0;
+	}
+	if(!ok) {
+		wal->failed = true;
+	}
+	pthread_mutex_unlock(&wal->lock);
+	return ok;
+}
+
+void db_close_wal(Wal* wal) {
+	if(wal->mode != DB_SYNC_OFF) {
+		db_wal_sync(wal);
+	} else {
+		pthread_mutex_lock(&wal->lock);
+		if(wal->used > 0) {
+			wal_flush_locked(wal, false);
+		}
+		pthread_mutex_unlock(&wal->lock);
+	}
+	close(wal->fd);
+	free(wal->buffer);
+	free(wal->spare);
+	pthread_cond_destroy(&wal->written_cond);
+	pthread_mutex_destroy(&wal->lock);
+	free(wal);
+}
+
+//Reads the log from the start, stopping at its end or at the first record
+//left incomplete or damaged by a crash. False only if it can not be read.
+bool db_wal_replay(const char* path, WalReplayFunc f, void* context) {
+	FILE* file = fopen(path, "rb");
+	if(file == NULL) {
+		return true;
+	}
+	uint8_t* payload = malloc(WAL_MAX_PAYLOAD);
+	if(payload == NULL) {
+		fclose(file);
+		return false;
+	}
+	WalRecord record;
+	while(fread(&record, sizeof(record), 1, file) == 1) {
+		if(record.size > WAL_MAX_PAYLOAD || fread(payload, 1, record.size, file) != record.size) {
+			break;
+		}
+		if(wal_checksum(&record, payload) != record.checksum) {
+			break;
+		}
+		f(context, &record, payload);
+	}
+	free(payload);
+	fclose(file);
+	return true;
+}
@@ -0,0 +1,69 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define WAL_BUFFER_SIZE (256*1024)
+
+//How long a change may stay in memory after the call that made it returns.
+typedef enum {
+	DB_SYNC_FULL,	//Every change is on disk before its call returns
+	DB_SYNC_BATCH,	//Changes are synced whenever the log buffer fills
+	DB_SYNC_OFF	//Changes are written when the buffer fills, never synced
+} DbSyncMode;
+
+typedef enum {
+	WAL_UPSERT = 1,
+	WAL_DELETE,
+	WAL_PAGE,
+	WAL_HEADER,
+	WAL_CHECKPOINT
+} WalRecordType;
+
+typedef struct {
+	uint32_t size;
+	uint32_t checksum;
+	uint32_t type;
+	uint32_t table;
+	uint32_t page;
+} WalRecord;
+
+/*
+A write-ahead log, appended to through an in-memory buffer. Positions in
+the log are counted in bytes since it was opened, and keep counting when
+the file is truncated after a checkpoint.
+
+Commits are grouped: whichever committer finds no write in progress takes
+the whole buffer, swaps in the spare one so others can keep appending, and
+writes and syncs it for everyone waiting.
+*/
+typedef struct {
+	int fd;
+	DbSyncMode mode;
+	pthread_mutex_t lock;
+	pthread_cond_t written_cond;
+	uint8_t* buffer;
+	uint8_t* spare;
+	uint32_t used;
+	uint64_t appended;
+	uint64_t written;
+	uint64_t synced;
+	bool flushing;
+	bool failed;
+	uint64_t syncs;
+} Wal;
+
+//Called for each intact record in order. The payload is record->size bytes.
+typedef void (*WalReplayFunc)(void* context, const WalRecord* record, const void* payload);
+
+Wal* db_open_wal(const char* path, DbSyncMode mode);
+void db_close_wal(Wal* wal);
+uint64_t db_wal_append(Wal* wal, uint32_t type, uint32_t table, uint32_t page, const void* payload, uint32_t size);
+bool db_wal_commit(Wal* wal, uint64_t position);
+bool db_wal_sync(Wal* wal);
+bool db_wal_truncate(Wal* wal);
+bool db_wal_replay(const char* path, WalReplayFunc f, void* context);
+
+#endif
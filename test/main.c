@@ -1,6 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "assert.h"
 #include "memorydebug.h"
 #include "../database/database.h"
@@ -23,6 +29,37 @@ typedef struct {
 	char text[257];
 } Stuff;
 
+typedef struct {
+	uuid_t id;
+	uint32_t number;
+	char padding[12];
+} Small;
+
+//Walks a table asserting ascending keys and returns the number of rows.
+int count_sorted_rows(Database* db, const char* table, uint32_t cell_size) {
+	uint8_t prev[cell_size];
+	uint8_t out[cell_size];
+	char msg[32];
+	int i = 0;
+	Cursor cursor;
+	db_table_start(db, table, &cursor);
+	while(cursor.end == false) {
+		db_cursor_value(&cursor, out);
+		if(i > 0) {
+			sprintf(msg, "Iterator: %i", i);
+			assert_less_than_uuid_m(prev, out, msg);
+		}
+		memcpy(prev, out, cell_size);
+		++i;
+		db_cursor_next(&cursor);
+	}
+	return i;
+}
+
+int compare_uuids(const void* a, const void* b) {
+	return uuid_compare(*(const uuid_t*)a, *(const uuid_t*)b);
+}
+
 void test_database_can_be_opened_and_closed() {
 	Database* db = db_open();
 	assert_not_null(db);
@@ -81,46 +118,1939 @@ void test_database_can_not_create_duplicate_tables() {
 	db_close(db);
 }
 
-void test_database_can_insert_and_select_data() {
+void test_table_handles_stay_valid_as_tables_are_added() {
+	Database* db = db_open();
+
+	int num_tables = 300;
+	char name[16];
+	TableHandle first = NULL;
+	Small in;
+	memset(&in, 0, sizeof(in));
+	for(int i=0; i<num_tables; ++i) {
+		sprintf(name, "table%i", i);
+		assert_equal(DB_OK, db_create_table(db, name, sizeof(Small)));
+		if(i == 0) {
+			first = db_get_table(db, name);
+		}
+		uuid_generate(in.id);
+		in.number = i;
+		assert_equal(DB_OK, db_table_insert(first, &in));
+		if(i > 0) {
+			assert_equal(DB_OK, db_table_insert(db_get_table(db, name), &in));
+		}
+	}
+	assert_equal(true, (db_get_table(db, "table0") == first));
+	assert_null(db_get_table(db, "missing"));
+	assert_equal(DB_ERROR_NO_TABLE, db_table_insert(db_get_table(db, "missing"), &in));
+	assert_equal(DB_ERROR_TABLE_EXISTS, db_create_table(db, "table7", sizeof(Small)));
+
+	assert_equal(num_tables, count_sorted_rows(db, "table0", sizeof(Small)));
+	Small out;
+	assert_equal(true, db_table_select(db_get_table(db, "table299"), in.id, &out));
+	assert_equal((uint32_t)299, out.number);
+	assert_equal(true, db_select(db, "table0", in.id, &out));
+
+	int i = 0;
+	for(const char* table = db_first_table(db); table != NULL; table = db_next_table(db, table)) {
+		sprintf(name, "table%i", i);
+		assert_equal_string(name, table);
+		++i;
+	}
+	assert_equal(num_tables, i);
+
+	db_close(db);
+}
+
+void test_database_can_insert_and_select_data() {
+	Database* db = db_open();
+	const char* table = "stuff";
+	db_create_table(db, table, sizeof(Stuff));
+
+	Stuff in1;
+	uuid_generate(in1.id);
+	strncpy(in1.text, "Hagrid", 256);
+	db_insert(db, table, &in1);
+	Stuff in2;
+	uuid_generate(in2.id);
+	strncpy(in2.text, "Harry", 256);
+	db_insert(db, table, &in2);
+
+	Stuff out;
+	db_select(db, table, in1.id, &out);
+	assert_equal_uuid(in1.id, out.id);
+
+	db_select(db, table, in2.id, &out);
+	assert_equal_uuid(in2.id, out.id);
+
+	db_close(db);
+}
+
+void test_database_can_select_across_pages() {
+	Database* db = db_open();
+	const char* table = "stuff";
+	db_create_table(db, table, sizeof(Stuff));
+
+	int num_items = 5000;
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+	for(int i=0; i<num_items; ++i) {
+		Stuff in;
+		uuid_generate(in.id);
+		uuid_copy(ids[i], in.id);
+		sprintf(in.text, "name%i", i);
+		db_insert(db, table, &in);
+	}
+
+	Stuff out;
+	char text[16];
+	for(int i=0; i<num_items; ++i) {
+		bool found = db_select(db, table, ids[i], &out);
+		assert_equal(true, found);
+		assert_equal_uuid(ids[i], out.id);
+		sprintf(text, "name%i", i);
+		assert_equal_string(text, out.text);
+	}
+
+	uuid_t missing;
+	uuid_generate(missing);
+	assert_equal(false, db_select(db, table, missing, &out));
+
+	free(ids);
+	db_close(db);
+}
+
+void test_database_can_update_and_delete_rows() {
+	Database* db = db_open();
+	const char* table = "stuff";
+	db_create_table(db, table, sizeof(Stuff));
+
+	int num_items = 5000;
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+	Stuff in;
+	for(int i=0; i<num_items; ++i) {
+		uuid_generate(in.id);
+		uuid_copy(ids[i], in.id);
+		sprintf(in.text, "name%i", i);
+		db_insert(db, table, &in);
+	}
+	uint32_t num_pages = db->tables[0]->pager->num_pages;
+
+	for(int i=0; i<num_items; i+=2) {
+		uuid_copy(in.id, ids[i]);
+		sprintf(in.text, "updated%i", i);
+		assert_equal(DB_OK, db_update(db, table, &in));
+	}
+	uuid_generate(in.id);
+	assert_equal(DB_ERROR_NOT_FOUND, db_update(db, table, &in));
+
+	//Delete all but every fifth row
+	int remaining = num_items;
+	for(int i=0; i<num_items; ++i) {
+		if(i % 5 != 0) {
+			assert_equal(DB_OK, db_delete(db, table, ids[i]));
+			--remaining;
+		}
+	}
+	assert_equal(DB_ERROR_NOT_FOUND, db_delete(db, table, ids[1]));
+	assert_equal(remaining, count_sorted_rows(db, table, sizeof(Stuff)));
+
+	Stuff out;
+	char text[32];
+	for(int i=0; i<num_items; ++i) {
+		bool found = db_select(db, table, ids[i], &out);
+		assert_equal(i % 5 == 0, found);
+		if(found) {
+			sprintf(text, i % 2 == 0 ? "updated%i" : "name%i", i);
+			assert_equal_string(text, out.text);
+		}
+	}
+
+	//Freed pages are reused before the table grows
+	for(int i=0; i<num_items; ++i) {
+		if(i % 5 != 0) {
+			uuid_copy(in.id, ids[i]);
+			db_insert(db, table, &in);
+		}
+	}
+	assert_equal(num_items, count_sorted_rows(db, table, sizeof(Stuff)));
+	assert_equal(true, db->tables[0]->pager->num_pages <= num_pages + num_pages/10);
+
+	for(int i=0; i<num_items; ++i) {
+		assert_equal(DB_OK, db_delete(db, table, ids[i]));
+	}
+	Cursor cursor;
+	db_table_start(db, table, &cursor);
+	assert_equal(true, cursor.end);
+	assert_equal(db->tables[0]->pager->num_pages - 1, db->tables[0]->pager->num_free);
+
+	free(ids);
+	db_close(db);
+}
+
+void add_numbers(void* existing, const void* incoming, void* context) {
+	((Small*)existing)->number += ((const Small*)incoming)->number;
+	++*(int*)context;
+}
+
+void test_insert_handles_existing_keys() {
+	Database* db = db_open();
+	const char* table = "small";
+	db_create_table(db, table, sizeof(Small));
+
+	int num_items = 3000;
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+	Small in;
+	memset(&in, 0, sizeof(in));
+	for(int i=0; i<num_items; ++i) {
+		uuid_generate(in.id);
+		uuid_copy(ids[i], in.id);
+		in.number = i;
+		assert_equal(DB_OK, db_insert(db, table, &in));
+	}
+
+	//Duplicates are rejected and leave the stored row alone
+	for(int i=0; i<num_items; ++i) {
+		uuid_copy(in.id, ids[i]);
+		in.number = 0;
+		assert_equal(DB_ERROR_KEY_EXISTS, db_insert(db, table, &in));
+	}
+	assert_equal(num_items, count_sorted_rows(db, table, sizeof(Small)));
+
+	//Upsert replaces existing rows and inserts new ones
+	for(int i=0; i<num_items; i+=2) {
+		uuid_copy(in.id, ids[i]);
+		in.number = i*10;
+		assert_equal(DB_OK, db_upsert(db, table, &in, NULL, NULL));
+	}
+	uuid_generate(in.id);
+	in.number = 7;
+	assert_equal(DB_OK, db_upsert(db, table, &in, NULL, NULL));
+	assert_equal(num_items + 1, count_sorted_rows(db, table, sizeof(Small)));
+
+	//Or merges them through the callback
+	int merged = 0;
+	for(int i=0; i<num_items; ++i) {
+		uuid_copy(in.id, ids[i]);
+		in.number = 1;
+		assert_equal(DB_OK, db_upsert(db, table, &in, add_numbers, &merged));
+	}
+	assert_equal(num_items, merged);
+
+	Small out;
+	for(int i=0; i<num_items; ++i) {
+		assert_equal(true, db_select(db, table, ids[i], &out));
+		assert_equal((uint32_t)(i % 2 == 0 ? i*10 + 1 : i + 1), out.number);
+	}
+
+	free(ids);
+	db_close(db);
+}
+
+void uuid_increment(uuid_t u) {
+	int i = 15;
+	while(u[i] == 255) {
+		u[i] = 0;
+		--i;
+	}
+	++u[i];
+}
+
+void test_append_inserts_keep_leaves_packed() {
+	Database* db = db_open();
+	const char* table = "small";
+	db_create_table(db, table, sizeof(Small));
+
+	int num_items = 20000;
+	int num_random = 2000;
+	uuid_t* ids = malloc(sizeof(uuid_t)*(num_items + num_random));
+	Small in;
+	memset(&in, 0, sizeof(in));
+	in.id[0] = 0x80;
+	for(int i=0; i<num_items; ++i) {
+		uuid_increment(in.id);
+		uuid_copy(ids[i], in.id);
+		in.number = i;
+		assert_equal(DB_OK, db_insert(db, table, &in));
+	}
+	//Half empty leaves would need more than 300 pages
+	uint32_t leaf_cells = (4096 - 12) / sizeof(Small);
+	assert_equal(true, db->tables[0]->pager->num_pages < num_items / (leaf_cells - leaf_cells/5));
+
+	//Keys out of order still land in the right place after appends
+	for(int i=0; i<num_random; ++i) {
+		uuid_generate(in.id);
+		uuid_copy(ids[num_items + i], in.id);
+		assert_equal(DB_OK, db_insert(db, table, &in));
+	}
+	assert_equal(num_items + num_random, count_sorted_rows(db, table, sizeof(Small)));
+
+	Small out;
+	for(int i=0; i<num_items + num_random; ++i) {
+		assert_equal(true, db_select(db, table, ids[i], &out));
+	}
+
+	free(ids);
+	db_close(db);
+}
+
+void test_compressed_keys_raise_internal_fan_out() {
+	Database* db = db_open();
+	TableOptions options = { .compress_keys = true };
+	db_create_table(db, "plain", sizeof(Small));
+	db_create_table_with_options(db, "packed", sizeof(Small), &options);
+
+	//Sequential keys share all but their last few bytes
+	int num_items = 400000;
+	Small in;
+	memset(&in, 0, sizeof(in));
+	in.id[0] = 0x80;
+	for(int i=0; i<num_items; ++i) {
+		uuid_increment(in.id);
+		in.number = i;
+		assert_equal(DB_OK, db_insert(db, "plain", &in));
+		assert_equal(DB_OK, db_insert(db, "packed", &in));
+	}
+	//Same leaves, but a fraction of the internal nodes
+	uint32_t plain_pages = db->tables[0]->pager->num_pages;
+	uint32_t packed_pages = db->tables[1]->pager->num_pages;
+	assert_equal(true, packed_pages + 8 < plain_pages);
+
+	//Random keys break the shared prefix of the nodes they land in
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+	for(int i=0; i<num_items/10; ++i) {
+		uuid_generate(in.id);
+		uuid_copy(ids[i], in.id);
+		assert_equal(DB_OK, db_insert(db, "packed", &in));
+	}
+	assert_equal(num_items + num_items/10, count_sorted_rows(db, "packed", sizeof(Small)));
+
+	Small out;
+	for(int i=0; i<num_items/10; ++i) {
+		assert_equal(true, db_select(db, "packed", ids[i], &out));
+		if(i % 2 == 0) {
+			assert_equal(DB_OK, db_delete(db, "packed", ids[i]));
+		}
+	}
+	memset(&in, 0, sizeof(in));
+	in.id[0] = 0x80;
+	for(int i=0; i<num_items; ++i) {
+		uuid_increment(in.id);
+		assert_equal(true, db_select(db, "packed", in.id, &out));
+		assert_equal(i, out.number);
+		if(i % 4 != 0) {
+			assert_equal(DB_OK, db_delete(db, "packed", in.id));
+		}
+	}
+	assert_equal(num_items/4 + num_items/20, count_sorted_rows(db, "packed", sizeof(Small)));
+	for(int i=1; i<num_items/10; i+=2) {
+		assert_equal(true, db_select(db, "packed", ids[i], &out));
+	}
+
+	free(ids);
+	db_close(db);
+}
+
+//Size of a Stuff row cut off after its text.
+uint32_t stuff_size(Stuff* stuff) {
+	return offsetof(Stuff, text) + strlen(stuff->text) + 1;
+}
+
+void test_variable_rows_take_only_their_size() {
+	Database* db = db_open();
+	TableOptions options = { .variable_rows = true };
+	db_create_table(db, "fixed", sizeof(Stuff));
+	assert_equal(DB_OK, db_create_table_with_options(db, "variable", sizeof(Stuff), &options));
+	assert_equal(DB_ERROR_ROW_SIZE, db_create_table_with_options(db, "huge", DB_MAX_ROW_SIZE + 1, &options));
+
+	int num_items = 20000;
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+	Stuff in;
+	memset(&in, 0, sizeof(in));
+	for(int i=0; i<num_items; ++i) {
+		uuid_generate(ids[i]);
+		uuid_copy(in.id, ids[i]);
+		sprintf(in.text, "name%i", i);
+		assert_equal(DB_OK, db_insert(db, "fixed", &in));
+		assert_equal(DB_OK, db_insert_record(db, "variable", &in, stuff_size(&in)));
+	}
+	//Rows with short text no longer pay for the whole text field
+	assert_equal(true, db->tables[1]->pager->num_pages*3 < db->tables[0]->pager->num_pages);
+
+	//Rows go in with their size, which has to suit the table
+	assert_equal(DB_ERROR_ROW_SIZE, db_insert(db, "variable", &in));
+	assert_equal(DB_ERROR_ROW_SIZE, db_insert_record(db, "variable", &in, sizeof(Stuff) + 1));
+	assert_equal(DB_ERROR_ROW_SIZE, db_insert_record(db, "fixed", &in, stuff_size(&in)));
+	assert_equal(DB_ERROR_KEY_EXISTS, db_insert_record(db, "variable", &in, stuff_size(&in)));
+
+	Stuff out;
+	char text[16];
+	for(int i=0; i<num_items; ++i) {
+		memset(&out, 0, sizeof(out));
+		sprintf(text, "name%i", i);
+		assert_equal((uint32_t)(offsetof(Stuff, text) + strlen(text) + 1), db_select_record(db, "variable", ids[i], &out, sizeof(out)));
+		assert_equal_string(text, out.text);
+	}
+
+	//Rows can grow and shrink in place, past what their leaf holds
+	for(int i=0; i<num_items; i+=2) {
+		uuid_copy(in.id, ids[i]);
+		memset(in.text, 'a' + i%26, 200);
+		in.text[200] = '\0';
+		assert_equal(DB_OK, db_update_record(db, "variable", &in, stuff_size(&in)));
+	}
+	for(int i=0; i<num_items; i+=4) {
+		uuid_copy(in.id, ids[i]);
+		sprintf(in.text, "back%i", i);
+		assert_equal(DB_OK, db_upsert_record(db, "variable", &in, stuff_size(&in)));
+	}
+	for(int i=1; i<num_items; i+=4) {
+		assert_equal(DB_OK, db_delete(db, "variable", ids[i]));
+	}
+	uuid_generate(in.id);
+	assert_equal(DB_ERROR_NOT_FOUND, db_update_record(db, "variable", &in, stuff_size(&in)));
+
+	Cursor cursor;
+	uuid_t prev;
+	int count = 0;
+	db_table_start(db, "variable", &cursor);
+	while(!cursor.end) {
+		memset(&out, 0, sizeof(out));
+		uint32_t size = db_cursor_record(&cursor, &out, sizeof(out));
+		assert_equal(stuff_size(&out), size);
+		if(count > 0) {
+			assert_less_than_uuid(prev, out.id);
+		}
+		uuid_copy(prev, out.id);
+		count++;
+		db_cursor_next(&cursor);
+	}
+	assert_equal(num_items - num_items/4, count);
+	for(int i=0; i<num_items; ++i) {
+		memset(&out, 0, sizeof(out));
+		bool found = db_select(db, "variable", ids[i], &out);
+		assert_equal(i % 4 != 1, found);
+		if(i % 4 == 0) {
+			sprintf(text, "back%i", i);
+			assert_equal_string(text, out.text);
+		} else if(i % 4 == 2) {
+			assert_equal(200, (int)strlen(out.text));
+		}
+	}
+
+	free(ids);
+	db_close(db);
+}
+
+void test_table_can_grow_past_2000_pages() {
+	Database* db = db_open();
+	const char* table = "big";
+	//Two cells fill a leaf, so every leaf ends up holding a single row
+	db_create_table(db, table, 2000);
+
+	int num_items = 2500;
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+	uint8_t in[2000];
+	memset(in, 0, sizeof(in));
+	for(int i=0; i<num_items; ++i) {
+		uuid_generate(in);
+		uuid_copy(ids[i], in);
+		assert_equal(DB_OK, db_insert(db, table, in));
+	}
+	assert_equal(true, db->tables[0]->pager->num_pages > 2000);
+
+	uint8_t out[2000];
+	for(int i=0; i<num_items; ++i) {
+		assert_equal(true, db_select(db, table, ids[i], out));
+	}
+
+	free(ids);
+	db_close(db);
+}
+
+void test_insert_reports_out_of_memory() {
+	Database* db = db_open();
+	const char* table = "stuff";
+	db_create_table(db, table, sizeof(Stuff));
+
+	//Pages come from arenas, so the failure hits once the first one is used up
+	int num_items = 20000;
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+	for(int i=0; i<num_items; ++i) {
+		uuid_generate(ids[i]);
+	}
+
+	fail_allocations_after(0);
+	Stuff in;
+	DbResult result = DB_OK;
+	int inserted = 0;
+	while(result == DB_OK && inserted < num_items) {
+		uuid_copy(in.id, ids[inserted]);
+		sprintf(in.text, "name%i", inserted);
+		result = db_insert(db, table, &in);
+		if(result == DB_OK) {
+			++inserted;
+		}
+	}
+	fail_allocations_after(-1);
+	assert_equal(DB_ERROR_NO_MEMORY, result);
+
+	Stuff out;
+	for(int i=0; i<inserted; ++i) {
+		assert_equal(true, db_select(db, table, ids[i], &out));
+	}
+	assert_equal(false, db_select(db, table, ids[inserted], &out));
+	assert_equal(DB_OK, db_insert(db, table, &in));
+	assert_equal(true, db_select(db, table, ids[inserted], &out));
+
+	free(ids);
+	db_close(db);
+}
+
+#define NUM_WRITERS 6
+#define NUM_READERS 2
+#define ROWS_PER_WRITER 6000
+
+typedef struct {
+	TableHandle table;
+	uint32_t writer;
+	uint64_t seed;
+	uuid_t* ids;
+	uint32_t published;
+} Worker;
+
+uint64_t shared_key_counter;
+bool writers_done;
+Worker workers[NUM_WRITERS];
+
+uint64_t splitmix(uint64_t* state) {
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+//Even writers insert random keys, odd writers take ascending keys from a
+//shared counter so they all append to the same leaf.
+void* concurrent_writer(void* arg) {
+	Worker* w = arg;
+	Small in;
+	Small out;
+	memset(&in, 0, sizeof(in));
+	for(uint32_t i=0; i<ROWS_PER_WRITER; ++i) {
+		if(w->writer % 2 == 0) {
+			uint64_t hi = splitmix(&w->seed) & 0x7FFFFFFFFFFFFFFFull;
+			uint64_t lo = splitmix(&w->seed);
+			for(int b=0; b<8; ++b) {
+				in.id[b] = hi >> (56 - 8*b);
+				in.id[8+b] = lo >> (56 - 8*b);
+			}
+		} else {
+			uint64_t n = __atomic_fetch_add(&shared_key_counter, 1, __ATOMIC_RELAXED);
+			memset(in.id, 0, sizeof(uuid_t));
+			in.id[0] = 0x80;
+			for(int b=0; b<8; ++b) {
+				in.id[8+b] = n >> (56 - 8*b);
+			}
+		}
+		in.number = w->writer*ROWS_PER_WRITER + i;
+		uuid_copy(w->ids[i], in.id);
+		assert_equal(DB_OK, db_table_insert(w->table, &in));
+		assert_equal(true, db_table_select(w->table, in.id, &out));
+		assert_equal(in.number, out.number);
+		if(i % 3 == 0) {
+			assert_equal(DB_OK, db_table_delete(w->table, in.id));
+			assert_equal(false, db_table_select(w->table, in.id, &out));
+		}
+		__atomic_store_n(&w->published, i + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+//Rows that were published and never deleted must stay visible while the
+//writers split and merge the pages around them.
+void* concurrent_reader(void* arg) {
+	Worker* r = arg;
+	Small out;
+	while(__atomic_load_n(&writers_done, __ATOMIC_ACQUIRE) == false) {
+		Worker* w = &workers[splitmix(&r->seed) % NUM_WRITERS];
+		uint32_t published = __atomic_load_n(&w->published, __ATOMIC_ACQUIRE);
+		if(published < 2) {
+			continue;
+		}
+		uint32_t i = splitmix(&r->seed) % published;
+		if(i % 3 == 0) {
+			++i;
+		}
+		if(i >= published) {
+			continue;
+		}
+		assert_equal(true, db_table_select(r->table, w->ids[i], &out));
+		assert_equal(w->writer*ROWS_PER_WRITER + i, out.number);
+	}
+	return NULL;
+}
+
+void* delete_written_rows(void* arg) {
+	Worker* w = arg;
+	for(uint32_t i=0; i<ROWS_PER_WRITER; ++i) {
+		DbResult expected = i % 3 == 0 ? DB_ERROR_NOT_FOUND : DB_OK;
+		assert_equal(expected, db_table_delete(w->table, w->ids[i]));
+	}
+	return NULL;
+}
+
+void test_table_handles_concurrent_writers_and_readers() {
+	Database* db = db_open();
+	const char* table = "small";
+	db_create_table(db, table, sizeof(Small));
+	TableHandle handle = db_get_table(db, table);
+
+	shared_key_counter = 0;
+	writers_done = false;
+	pthread_t writer_threads[NUM_WRITERS];
+	pthread_t reader_threads[NUM_READERS];
+	Worker readers[NUM_READERS];
+	for(uint32_t i=0; i<NUM_WRITERS; ++i) {
+		workers[i].table = handle;
+		workers[i].writer = i;
+		workers[i].seed = i*7919 + 1;
+		workers[i].ids = malloc(sizeof(uuid_t)*ROWS_PER_WRITER);
+		workers[i].published = 0;
+	}
+	for(uint32_t i=0; i<NUM_READERS; ++i) {
+		readers[i].table = handle;
+		readers[i].seed = i*104729 + 3;
+		pthread_create(&reader_threads[i], NULL, concurrent_reader, &readers[i]);
+	}
+	for(uint32_t i=0; i<NUM_WRITERS; ++i) {
+		pthread_create(&writer_threads[i], NULL, concurrent_writer, &workers[i]);
+	}
+	for(uint32_t i=0; i<NUM_WRITERS; ++i) {
+		pthread_join(writer_threads[i], NULL);
+	}
+	__atomic_store_n(&writers_done, true, __ATOMIC_RELEASE);
+	for(uint32_t i=0; i<NUM_READERS; ++i) {
+		pthread_join(reader_threads[i], NULL);
+	}
+
+	int kept = NUM_WRITERS*(ROWS_PER_WRITER - (ROWS_PER_WRITER + 2)/3);
+	assert_equal(kept, count_sorted_rows(db, table, sizeof(Small)));
+	Small out;
+	for(uint32_t w=0; w<NUM_WRITERS; ++w) {
+		for(uint32_t i=0; i<ROWS_PER_WRITER; ++i) {
+			assert_equal(i % 3 != 0, db_table_select(handle, workers[w].ids[i], &out));
+		}
+	}
+
+	//Deleting everything from several threads at once empties the tree
+	for(uint32_t i=0; i<NUM_WRITERS; ++i) {
+		pthread_create(&writer_threads[i], NULL, delete_written_rows, &workers[i]);
+	}
+	for(uint32_t i=0; i<NUM_WRITERS; ++i) {
+		pthread_join(writer_threads[i], NULL);
+		free(workers[i].ids);
+	}
+	assert_equal(0, count_sorted_rows(db, table, sizeof(Small)));
+
+	db_close(db);
+}
+
+#define STABLE_ROWS 20000
+#define CHURN_ROWS 20000
+
+typedef struct {
+	TableHandle table;
+	uint64_t seed;
+	bool batches;
+	uint32_t scans;
+} Scanner;
+
+//Adds and removes rows around the stable ones until the scanners finish.
+void* churn_rows(void* arg) {
+	Worker* w = arg;
+	Small in;
+	memset(&in, 0, sizeof(in));
+	while(__atomic_load_n(&writers_done, __ATOMIC_ACQUIRE) == false) {
+		for(uint32_t i=0; i<CHURN_ROWS; ++i) {
+			uuid_generate(w->ids[i]);
+			uuid_copy(in.id, w->ids[i]);
+			assert_equal(DB_OK, db_table_insert(w->table, &in));
+		}
+		for(uint32_t i=0; i<CHURN_ROWS; ++i) {
+			assert_equal(DB_OK, db_table_delete(w->table, w->ids[i]));
+		}
+	}
+	return NULL;
+}
+
+//Every scan must see each stable row once, in key order, whatever the
+//writers split or merge under the cursor.
+void* scan_stable_rows(void* arg) {
+	Scanner* r = arg;
+	Small rows[37];
+	for(uint32_t scan=0; scan<r->scans; ++scan) {
+		Cursor cursor;
+		db_cursor_start(r->table, &cursor);
+		uuid_t prev;
+		memset(prev, 0, sizeof(prev));
+		uint32_t stable = 0;
+		uint32_t n = 0;
+		while(cursor.end == false) {
+			uint32_t count = 1;
+			if(r->batches) {
+				count = db_cursor_fetch(&cursor, rows, 37);
+			} else {
+				db_cursor_value(&cursor, rows);
+				db_cursor_next(&cursor);
+			}
+			for(uint32_t i=0; i<count; ++i) {
+				if(n > 0) {
+					assert_less_than_uuid_m(prev, rows[i].id, "Concurrent scan");
+				}
+				uuid_copy(prev, rows[i].id);
+				stable += rows[i].number;
+				++n;
+			}
+		}
+		assert_equal(STABLE_ROWS, stable);
+	}
+	return NULL;
+}
+
+void test_cursor_scans_stay_consistent_under_writers() {
+	Database* db = db_open();
+	const char* table = "small";
+	db_create_table(db, table, sizeof(Small));
+	TableHandle handle = db_get_table(db, table);
+
+	Small in;
+	memset(&in, 0, sizeof(in));
+	in.number = 1;
+	for(int i=0; i<STABLE_ROWS; ++i) {
+		uuid_generate(in.id);
+		assert_equal(DB_OK, db_table_insert(handle, &in));
+	}
+
+	writers_done = false;
+	pthread_t writer_threads[2];
+	pthread_t scanner_threads[2];
+	Scanner scanners[2];
+	for(uint32_t i=0; i<2; ++i) {
+		workers[i].table = handle;
+		workers[i].ids = malloc(sizeof(uuid_t)*CHURN_ROWS);
+		pthread_create(&writer_threads[i], NULL, churn_rows, &workers[i]);
+	}
+	for(uint32_t i=0; i<2; ++i) {
+		scanners[i].table = handle;
+		scanners[i].batches = i == 1;
+		scanners[i].scans = 20;
+		pthread_create(&scanner_threads[i], NULL, scan_stable_rows, &scanners[i]);
+	}
+	for(uint32_t i=0; i<2; ++i) {
+		pthread_join(scanner_threads[i], NULL);
+	}
+	__atomic_store_n(&writers_done, true, __ATOMIC_RELEASE);
+	for(uint32_t i=0; i<2; ++i) {
+		pthread_join(writer_threads[i], NULL);
+		free(workers[i].ids);
+	}
+	assert_equal(STABLE_ROWS, count_sorted_rows(db, table, sizeof(Small)));
+
+	db_close(db);
+}
+
+void test_pager_can_be_opened_and_closed() {
+	Pager* pager = db_open_pager(PAGE_SIZE);
+	db_close_pager(pager);
+}
+
+void test_pager_provides_writable_pages() {
+	Pager* pager = db_open_pager(PAGE_SIZE);
+
+	uint32_t n1 = db_get_unused_page(pager);
+	uint32_t n2 = db_get_unused_page(pager);
+	void* page1 = db_get_page(pager, n1);
+	void* page2 = db_get_page(pager, n2);
+	memset(page1, 0, 4096);
+	memset(page2, 1, 4096);
+
+	db_close_pager(pager);
+}
+
+void test_pager_carves_pages_from_aligned_arenas() {
+	Pager* pager = db_open_pager(PAGE_SIZE);
+
+	uint32_t arena_pages = ARENA_SIZE / PAGE_SIZE;
+	uint32_t num_pages = arena_pages*2 + 1;
+	for(uint32_t i=0; i<num_pages; ++i) {
+		assert_equal(i, db_get_unused_page(pager));
+	}
+	assert_equal(3, pager->num_arenas);
+	for(uint32_t i=0; i<num_pages; ++i) {
+		uint8_t* page = db_get_page(pager, i);
+		uint8_t* arena = pager->arenas[i / arena_pages];
+		assert_equal(0, (uintptr_t)arena % ARENA_SIZE);
+		assert_equal(true, (page == arena + (size_t)(i % arena_pages)*PAGE_SIZE));
+		assert_equal(0, page[PAGE_SIZE-1]);
+	}
+
+	db_close_pager(pager);
+}
+
+void test_pager_writes_back_evicted_pages() {
+	char path[] = "/tmp/special-memory-pager-XXXXXX";
+	int fd = mkstemp(path);
+	close(fd);
+	Pager* pager = db_open_file_pager(path, MIN_POOL_PAGES, PAGE_SIZE);
+	assert_not_null(pager);
+
+	uint32_t num_pages = MIN_POOL_PAGES*8;
+	for(uint32_t i=0; i<num_pages; ++i) {
+		uint32_t n = db_get_unused_page(pager);
+		assert_equal(i, n);
+		uint8_t* page = db_get_page(pager, n);
+		assert_not_null(page);
+		memset(page, i, PAGE_SIZE);
+		db_mark_dirty(pager, n);
+		db_release_page(pager, n);
+	}
+	db_close_pager(pager);
+
+	pager = db_open_file_pager(path, MIN_POOL_PAGES, PAGE_SIZE);
+	assert_equal(num_pages, pager->num_pages);
+	for(uint32_t i=0; i<num_pages; ++i) {
+		uint8_t* page = db_get_page(pager, i);
+		assert_equal((uint8_t)i, page[0]);
+		assert_equal((uint8_t)i, page[PAGE_SIZE-1]);
+		db_release_page(pager, i);
+	}
+	db_close_pager(pager);
+	unlink(path);
+}
+
+void remove_file_database(const char* path, const char* table) {
+	char file[64];
+	sprintf(file, "%s/%s.pages", path, table);
+	unlink(file);
+	sprintf(file, "%s/catalog", path);
+	unlink(file);
+	sprintf(file, "%s/wal", path);
+	unlink(file);
+	rmdir(path);
+}
+
+void test_file_database_persists_between_opens() {
+	char path[] = "/tmp/special-memory-db-XXXXXX";
+	assert_not_null(mkdtemp(path));
+	const char* table = "stuff";
+
+	Database* db = db_open_file(path, 16);
+	assert_not_null(db);
+	db_create_table(db, table, sizeof(Stuff));
+
+	int num_items = 3000;
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+	for(int i=0; i<num_items; ++i) {
+		Stuff in;
+		uuid_generate(in.id);
+		uuid_copy(ids[i], in.id);
+		sprintf(in.text, "name%i", i);
+		db_insert(db, table, &in);
+	}
+	db_close(db);
+
+	db = db_open_file(path, 16);
+	assert_not_null(db);
+	assert_equal_string(table, db_first_table(db));
+
+	Stuff out;
+	char text[16];
+	for(int i=0; i<num_items; ++i) {
+		assert_equal(true, db_select(db, table, ids[i], &out));
+		sprintf(text, "name%i", i);
+		assert_equal_string(text, out.text);
+	}
+
+	int count = 0;
+	Cursor cursor;
+	db_table_start(db, table, &cursor);
+	while(cursor.end == false) {
+		++count;
+		db_cursor_next(&cursor);
+	}
+	assert_equal(num_items, count);
+
+	//The free list survives a reopen
+	for(int i=0; i<num_items/2; ++i) {
+		assert_equal(DB_OK, db_delete(db, table, ids[i]));
+	}
+	uint32_t num_pages = db->tables[0]->pager->num_pages;
+	db_close(db);
+
+	db = db_open_file(path, 16);
+	assert_equal(true, db->tables[0]->pager->num_free > 0);
+	Stuff in;
+	for(int i=0; i<num_items/2; ++i) {
+		uuid_copy(in.id, ids[i]);
+		sprintf(in.text, "name%i", i);
+		db_insert(db, table, &in);
+	}
+	assert_equal(true, db->tables[0]->pager->num_pages <= num_pages + num_pages/10);
+	assert_equal(num_items, count_sorted_rows(db, table, sizeof(Stuff)));
+	db_close(db);
+
+	remove_file_database(path, table);
+	free(ids);
+}
+
+void test_table_needs_its_catalog_entry() {
+	char path[] = "/tmp/special-memory-db-XXXXXX";
+	assert_not_null(mkdtemp(path));
+	const char* table = "stuff";
+	char file[64];
+	struct stat st;
+
+	//A catalog that can not be written to leaves no table behind
+	sprintf(file, "%s/catalog", path);
+	assert_equal(0, mkdir(file, 0755));
+	Database* db = db_open_file(path, 16);
+	assert_not_null(db);
+	assert_equal(DB_ERROR_IO, db_create_table(db, table, sizeof(Stuff)));
+	assert_null(db_get_table(db, table));
+	sprintf(file, "%s/%s.pages", path, table);
+	assert_equal(-1, stat(file, &st));
+	db_close(db);
+
+	sprintf(file, "%s/catalog", path);
+	rmdir(file);
+	db = db_open_file(path, 16);
+	assert_equal(DB_OK, db_create_table(db, table, sizeof(Stuff)));
+	Stuff in;
+	uuid_generate(in.id);
+	strcpy(in.text, "kept");
+	assert_equal(DB_OK, db_insert(db, table, &in));
+
+	//Nor is an index kept without its entry
+	char moved[64];
+	sprintf(moved, "%s/catalog.moved", path);
+	assert_equal(0, rename(file, moved));
+	assert_equal(0, mkdir(file, 0755));
+	uint32_t text = offsetof(Stuff, text);
+	assert_equal(DB_ERROR_IO, db_create_index(db, table, text, DB_FIELD_STRING, 8));
+	assert_equal(1u, db->num_tables);
+	rmdir(file);
+	assert_equal(0, rename(moved, file));
+	sprintf(file, "%s/index.0.%u.pages", path, text);
+	assert_equal(-1, stat(file, &st));
+	db_close(db);
+
+	db = db_open_file(path, 16);
+	Stuff out;
+	assert_equal(true, db_select(db, table, in.id, &out));
+	assert_equal(1u, db->num_tables);
+	db_close(db);
+	remove_file_database(path, table);
+}
+
+void test_reopened_pages_drop_their_latches() {
+	char path[] = "/tmp/special-memory-db-XXXXXX";
+	assert_not_null(mkdtemp(path));
+	const char* table = "stuff";
+	Database* db = db_open_file(path, 16);
+	db_create_table(db, table, sizeof(Stuff));
+	Stuff in;
+	uuid_generate(in.id);
+	sprintf(in.text, "first");
+	assert_equal(DB_OK, db_insert(db, table, &in));
+
+	//A page written out while a reader held it keeps the reader's latch word
+	Pager* pager = db->tables[0]->pager;
+	uint32_t* latch = db_get_page(pager, 0);
+	*latch = 1;
+	db_mark_dirty(pager, 0);
+	db_release_page(pager, 0);
+	db_close(db);
+
+	db = db_open_file(path, 16);
+	Stuff second;
+	uuid_generate(second.id);
+	sprintf(second.text, "second");
+	assert_equal(DB_OK, db_insert(db, table, &second));
+	Stuff out;
+	assert_equal(true, db_select(db, table, in.id, &out));
+	assert_equal_string("first", out.text);
+	db_close(db);
+	remove_file_database(path, table);
+}
+
+//Fills a table in a child process that then dies without closing the
+//database, leaving only what the log and checkpoints put on disk.
+void crash_after_writes(const char* path, const char* table, uuid_t* ids, int num_items, DbSyncMode mode) {
+	pid_t pid = fork();
+	if(pid == 0) {
+		Database* db = db_open_file(path, 16);
+		db_set_sync_mode(db, mode);
+		db_create_table(db, table, sizeof(Stuff));
+		Stuff in;
+		for(int i=0; i<num_items; ++i) {
+			uuid_copy(in.id, ids[i]);
+			sprintf(in.text, "name%i", i);
+			db_insert(db, table, &in);
+		}
+		for(int i=0; i<num_items/4; ++i) {
+			db_delete(db, table, ids[i]);
+		}
+		for(int i=num_items/4; i<num_items/2; ++i) {
+			uuid_copy(in.id, ids[i]);
+			sprintf(in.text, "updated%i", i);
+			db_update(db, table, &in);
+		}
+		if(mode != DB_SYNC_FULL) {
+			db_sync(db);
+		}
+		_exit(0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+}
+
+void test_log_recovers_changes_after_a_crash() {
+	char path[] = "/tmp/special-memory-db-XXXXXX";
+	assert_not_null(mkdtemp(path));
+	const char* table = "stuff";
+	int num_items = 2000;
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+	for(int i=0; i<num_items; ++i) {
+		uuid_generate(ids[i]);
+	}
+	crash_after_writes(path, table, ids, num_items, DB_SYNC_FULL);
+
+	//A record torn by the crash is ignored
+	char file[64];
+	sprintf(file, "%s/wal", path);
+	FILE* wal = fopen(file, "ab");
+	fwrite("torn record", 1, 11, wal);
+	fclose(wal);
+
+	Database* db = db_open_file(path, 16);
+	assert_not_null(db);
+	Stuff out;
+	char text[16];
+	for(int i=0; i<num_items; ++i) {
+		if(i < num_items/4) {
+			assert_equal(false, db_select(db, table, ids[i], &out));
+			continue;
+		}
+		assert_equal(true, db_select(db, table, ids[i], &out));
+		sprintf(text, i < num_items/2 ? "updated%i" : "name%i", i);
+		assert_equal_string(text, out.text);
+	}
+	assert_equal(num_items - num_items/4, count_sorted_rows(db, table, sizeof(Stuff)));
+
+	//Recovery leaves the log empty, and later changes are logged again
+	struct stat st;
+	assert_equal(0, stat(file, &st));
+	assert_equal(0, (int)st.st_size);
+	for(int i=0; i<num_items/4; ++i) {
+		uuid_copy(out.id, ids[i]);
+		sprintf(out.text, "name%i", i);
+		assert_equal(DB_OK, db_insert(db, table, &out));
+	}
+	assert_equal(true, db->wal->appended > 0);
+	db_close(db);
+
+	db = db_open_file(path, 16);
+	assert_equal(num_items, count_sorted_rows(db, table, sizeof(Stuff)));
+	db_close(db);
+
+	remove_file_database(path, table);
+	free(ids);
+}
+
+void test_log_batches_syncs() {
+	char path[] = "/tmp/special-memory-db-XXXXXX";
+	assert_not_null(mkdtemp(path));
+	const char* table = "stuff";
+	int num_items = 2000;
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+	for(int i=0; i<num_items; ++i) {
+		uuid_generate(ids[i]);
+	}
+	//Batched changes are durable once db_sync returns
+	crash_after_writes(path, table, ids, num_items, DB_SYNC_BATCH);
+	Database* db = db_open_file(path, 1024);
+	assert_equal(num_items - num_items/4, count_sorted_rows(db, table, sizeof(Stuff)));
+
+	//and, with room to hold off checkpoints, inserts share a handful of syncs
+	db_set_sync_mode(db, DB_SYNC_BATCH);
+	uint64_t syncs = db->wal->syncs;
+	Stuff in;
+	for(int i=0; i<num_items/4; ++i) {
+		uuid_copy(in.id, ids[i]);
+		sprintf(in.text, "name%i", i);
+		assert_equal(DB_OK, db_insert(db, table, &in));
+	}
+	assert_equal(true, db->wal->syncs - syncs < 4);
+	db_close(db);
+
+	remove_file_database(path, table);
+	free(ids);
+}
+
+#define LOGGED_ROWS 500
+
+//Commits each row on its own, waiting for the log to reach the disk.
+void* commit_logged_rows(void* arg) {
+	Worker* w = arg;
+	Stuff in;
+	for(uint32_t i=0; i<LOGGED_ROWS; ++i) {
+		uuid_copy(in.id, w->ids[i]);
+		sprintf(in.text, "name%u", w->writer*LOGGED_ROWS + i);
+		assert_equal(DB_OK, db_table_insert(w->table, &in));
+	}
+	return NULL;
+}
+
+void test_log_shares_syncs_between_writers() {
+	char path[] = "/tmp/special-memory-db-XXXXXX";
+	assert_not_null(mkdtemp(path));
+	const char* table = "stuff";
+	Worker writers[4];
+	uint32_t num_writers = sizeof(writers)/sizeof(writers[0]);
+	for(uint32_t w=0; w<num_writers; ++w) {
+		writers[w].writer = w;
+		writers[w].ids = malloc(sizeof(uuid_t)*LOGGED_ROWS);
+		for(uint32_t i=0; i<LOGGED_ROWS; ++i) {
+			uuid_generate(writers[w].ids[i]);
+		}
+	}
+	//Writers that commit while a sync runs all wait on the next one, and the
+	//child dies without closing, so every row comes back from the log
+	pid_t pid = fork();
+	if(pid == 0) {
+		Database* db = db_open_file(path, 1024);
+		db_set_sync_mode(db, DB_SYNC_FULL);
+		db_create_table(db, table, sizeof(Stuff));
+		uint64_t syncs = db->wal->syncs;
+		pthread_t threads[num_writers];
+		for(uint32_t w=0; w<num_writers; ++w) {
+			writers[w].table = db_get_table(db, table);
+			pthread_create(&threads[w], NULL, commit_logged_rows, &writers[w]);
+		}
+		for(uint32_t w=0; w<num_writers; ++w) {
+			pthread_join(threads[w], NULL);
+		}
+		_exit(db->wal->syncs - syncs < num_writers*LOGGED_ROWS ? 0 : 1);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	assert_equal(true, WIFEXITED(status));
+	assert_equal(0, WEXITSTATUS(status));
+
+	Database* db = db_open_file(path, 1024);
+	assert_equal(num_writers*LOGGED_ROWS, count_sorted_rows(db, table, sizeof(Stuff)));
+	Stuff out;
+	char text[32];
+	for(uint32_t w=0; w<num_writers; ++w) {
+		for(uint32_t i=0; i<LOGGED_ROWS; ++i) {
+			assert_equal(true, db_select(db, table, writers[w].ids[i], &out));
+			sprintf(text, "name%u", w*LOGGED_ROWS + i);
+			assert_equal_string(text, out.text);
+		}
+		free(writers[w].ids);
+	}
+	db_close(db);
+	remove_file_database(path, table);
+}
+
+void test_checkpoint_keeps_log_when_flush_fails() {
+	char path[] = "/tmp/special-memory-db-XXXXXX";
+	assert_not_null(mkdtemp(path));
+	const char* table = "stuff";
+	int num_items = 500;
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+	char file[64];
+	struct stat st;
+
+	Database* db = db_open_file(path, 1024);
+	db_create_table(db, table, sizeof(Stuff));
+	Stuff in;
+	for(int i=0; i<num_items; ++i) {
+		uuid_generate(ids[i]);
+		uuid_copy(in.id, ids[i]);
+		sprintf(in.text, "name%i", i);
+		assert_equal(DB_OK, db_insert(db, table, &in));
+	}
+	//With the page file read only, the log is all that holds the rows
+	Pager* pager = db_get_table(db, table)->pager;
+	int saved = dup(pager->fd);
+	sprintf(file, "%s/%s.pages", path, table);
+	int read_only = open(file, O_RDONLY);
+	dup2(read_only, pager->fd);
+	assert_equal(DB_ERROR_IO, db_checkpoint(db));
+	sprintf(file, "%s/wal", path);
+	assert_equal(0, stat(file, &st));
+	assert_equal(true, st.st_size > 0);
+
+	dup2(saved, pager->fd);
+	close(saved);
+	close(read_only);
+	assert_equal(DB_OK, db_checkpoint(db));
+	assert_equal(0, stat(file, &st));
+	assert_equal(0, (int)st.st_size);
+	db_close(db);
+
+	db = db_open_file(path, 1024);
+	assert_equal(num_items, count_sorted_rows(db, table, sizeof(Stuff)));
+	db_close(db);
+	remove_file_database(path, table);
+	free(ids);
+}
+
+void test_snapshot_reopens_tables_without_reloading() {
+	char path[] = "/tmp/special-memory-snapshot-XXXXXX";
+	int fd = mkstemp(path);
+	assert_equal(true, fd >= 0);
+	close(fd);
+	int num_items = 20000;
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+
+	Database* db = db_open();
+	db_create_table(db, "stuff", sizeof(Stuff));
+	db_create_table(db, "small", sizeof(Small));
+	Stuff in;
+	Small small;
+	for(int i=0; i<num_items; ++i) {
+		uuid_generate(ids[i]);
+		uuid_copy(in.id, ids[i]);
+		sprintf(in.text, "name%i", i);
+		db_insert(db, "stuff", &in);
+		uuid_copy(small.id, ids[i]);
+		small.number = i;
+		db_insert(db, "small", &small);
+	}
+	for(int i=0; i<num_items/2; ++i) {
+		db_delete(db, "small", ids[i]);
+	}
+	assert_equal(DB_OK, db_save_snapshot(db, path));
+	db_close(db);
+
+	db = db_open_snapshot(path);
+	assert_not_null(db);
+	assert_not_null(db->snapshot);
+	assert_equal_string("stuff", db_first_table(db));
+	assert_equal(sizeof(Small), db_get_table(db, "small")->cell_size);
+	Stuff out;
+	char text[16];
+	for(int i=0; i<num_items; ++i) {
+		assert_equal(true, db_select(db, "stuff", ids[i], &out));
+		sprintf(text, "name%i", i);
+		assert_equal_string(text, out.text);
+		assert_equal(i >= num_items/2, db_select(db, "small", ids[i], &small));
+	}
+	assert_equal(num_items/2, count_sorted_rows(db, "small", sizeof(Small)));
+
+	//Changes land on private copies of the mapped pages, and reuse freed ones
+	uint32_t num_pages = db_get_table(db, "small")->pager->num_pages;
+	for(int i=0; i<num_items/2; ++i) {
+		uuid_copy(small.id, ids[i]);
+		small.number = i;
+		assert_equal(DB_OK, db_insert(db, "small", &small));
+		db_delete(db, "stuff", ids[i]);
+	}
+	assert_equal(true, db_get_table(db, "small")->pager->num_pages < num_pages + num_pages/10);
+	assert_equal(DB_OK, db_save_snapshot(db, path));
+	db_close(db);
+
+	db = db_open_snapshot(path);
+	assert_equal(num_items/2, count_sorted_rows(db, "stuff", sizeof(Stuff)));
+	assert_equal(num_items, count_sorted_rows(db, "small", sizeof(Small)));
+	db_close(db);
+
+	unlink(path);
+	free(ids);
+}
+
+void test_read_only_database_uses_the_mapped_pages() {
+	char path[] = "/tmp/special-memory-snapshot-XXXXXX";
+	int fd = mkstemp(path);
+	assert_equal(true, fd >= 0);
+	close(fd);
+	const char* table = "stuff";
+	int num_items = 10000;
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+
+	Database* db = db_open();
+	db_create_table(db, table, sizeof(Stuff));
+	Stuff in;
+	for(int i=0; i<num_items; ++i) {
+		uuid_generate(ids[i]);
+		uuid_copy(in.id, ids[i]);
+		sprintf(in.text, "name%i", i);
+		db_insert(db, table, &in);
+	}
+	assert_equal(DB_OK, db_save_snapshot(db, path));
+	db_close(db);
+
+	//Every reader works off the one mapping, holding no pages of its own
+	Database* first = db_open_readonly(path);
+	Database* second = db_open_readonly(path);
+	assert_not_null(first);
+	assert_not_null(second);
+	Pager* pager = db_get_table(first, table)->pager;
+	uint8_t* page = db_get_page(pager, 1);
+	assert_equal(true, (page >= (uint8_t*)first->snapshot && page < (uint8_t*)first->snapshot + first->snapshot_size));
+	assert_equal(0, pager->num_allocated);
+	assert_null(db_get_page(pager, pager->num_pages));
+
+	Stuff out;
+	char text[16];
+	for(int i=0; i<num_items; ++i) {
+		Database* reader = i % 2 ? first : second;
+		assert_equal(true, db_select(reader, table, ids[i], &out));
+		sprintf(text, "name%i", i);
+		assert_equal_string(text, out.text);
+	}
+	assert_equal(num_items, count_sorted_rows(first, table, sizeof(Stuff)));
+	assert_equal(num_items, count_sorted_rows(second, table, sizeof(Stuff)));
+
+	assert_equal(DB_ERROR_READ_ONLY, db_insert(first, table, &in));
+	assert_equal(DB_ERROR_READ_ONLY, db_update(first, table, &out));
+	assert_equal(DB_ERROR_READ_ONLY, db_delete(first, table, ids[0]));
+	assert_equal(DB_ERROR_READ_ONLY, db_bulk_load(first, table, &in, 1, 100));
+	assert_equal(DB_ERROR_READ_ONLY, db_create_table(first, "other", sizeof(Small)));
+	assert_equal(PAGE_NONE, db_get_unused_page(pager));
+	assert_equal(true, db_select(second, table, ids[0], &out));
+	db_close(first);
+	db_close(second);
+
+	unlink(path);
+	free(ids);
+}
+
+//Fills a row of size bytes whose contents follow from its key.
+void fill_blob(uint8_t* blob, const uuid_t id, uint32_t size) {
+	uuid_copy(blob, id);
+	for(uint32_t i=sizeof(uuid_t); i<size; ++i) {
+		blob[i] = id[i % sizeof(uuid_t)] + i;
+	}
+}
+
+void test_variable_rows_spill_to_overflow_pages() {
+	char path[] = "/tmp/special-memory-db-XXXXXX";
+	assert_not_null(mkdtemp(path));
+	const char* table = "blobs";
+	TableOptions options = { .variable_rows = true };
+	uint32_t max_size = 40000;
+	int num_items = 200;
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+	for(int i=0; i<num_items; ++i) {
+		uuid_generate(ids[i]);
+	}
+	uint8_t* blob = malloc(max_size);
+	uint8_t* out = malloc(max_size);
+
+	//Rows larger than a page are logged whole and redone after a crash
+	pid_t pid = fork();
+	if(pid == 0) {
+		Database* db = db_open_file(path, 16);
+		db_create_table_with_options(db, table, max_size, &options);
+		for(int i=0; i<num_items; ++i) {
+			fill_blob(blob, ids[i], 100 + i*150);
+			db_insert_record(db, table, blob, 100 + i*150);
+		}
+		_exit(0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+
+	Database* db = db_open_file(path, 16);
+	assert_not_null(db);
+	for(int i=0; i<num_items; ++i) {
+		uint32_t size = 100 + i*150;
+		fill_blob(blob, ids[i], size);
+		assert_equal(size, db_select_record(db, table, ids[i], out, max_size));
+		assert_equal(0, memcmp(blob, out, size));
+		//A buffer that is too small gets the start of the row
+		memset(out, 0, max_size);
+		assert_equal(size, db_select_record(db, table, ids[i], out, 80));
+		assert_equal(0, memcmp(blob, out, 80));
+		assert_equal(0, out[80]);
+	}
+
+	//Shrinking or removing rows gives their overflow pages back
+	Pager* pager = db->tables[0]->pager;
+	uint32_t num_free = pager->num_free;
+	for(int i=0; i<num_items; ++i) {
+		if(i % 2 == 0) {
+			fill_blob(blob, ids[i], 50);
+			assert_equal(DB_OK, db_update_record(db, table, blob, 50));
+		} else {
+			assert_equal(DB_OK, db_delete(db, table, ids[i]));
+		}
+	}
+	assert_equal(true, pager->num_free > num_free + num_items);
+	uint32_t num_pages = pager->num_pages;
+	for(int i=1; i<num_items; i+=2) {
+		fill_blob(blob, ids[i], 100 + i*150);
+		assert_equal(DB_OK, db_insert_record(db, table, blob, 100 + i*150));
+	}
+	assert_equal(num_pages, pager->num_pages);
+	db_close(db);
+
+	db = db_open_file(path, 16);
+	for(int i=0; i<num_items; ++i) {
+		uint32_t size = i % 2 == 0 ? 50 : 100 + i*150;
+		fill_blob(blob, ids[i], size);
+		assert_equal(size, db_select_record(db, table, ids[i], out, max_size));
+		assert_equal(0, memcmp(blob, out, size));
+	}
+	db_close(db);
+
+	remove_file_database(path, table);
+	free(blob);
+	free(out);
+	free(ids);
+}
+
+void test_tables_choose_their_page_size() {
+	char path[] = "/tmp/special-memory-db-XXXXXX";
+	assert_not_null(mkdtemp(path));
+	char snapshot[] = "/tmp/special-memory-snapshot-XXXXXX";
+	int fd = mkstemp(snapshot);
+	assert_equal(true, fd >= 0);
+	close(fd);
+	TableOptions large = { .page_size = MAX_PAGE_SIZE };
+	TableOptions blobs = { .variable_rows = true, .page_size = 16*1024 };
+	int num_items = 20000;
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+	for(int i=0; i<num_items; ++i) {
+		uuid_generate(ids[i]);
+	}
+	uint8_t blob[3000];
+	uint8_t out[3000];
+
+	Database* db = db_open_file(path, 16);
+	TableOptions bad = { .page_size = 3000 };
+	assert_equal(DB_ERROR_PAGE_SIZE, db_create_table_with_options(db, "bad", sizeof(Small), &bad));
+	bad.page_size = MAX_PAGE_SIZE*2;
+	assert_equal(DB_ERROR_PAGE_SIZE, db_create_table_with_options(db, "bad", sizeof(Small), &bad));
+	bad.page_size = PAGE_SIZE/2;
+	assert_equal(DB_ERROR_PAGE_SIZE, db_create_table_with_options(db, "bad", sizeof(Small), &bad));
+	assert_equal(DB_OK, db_create_table(db, "small", sizeof(Small)));
+	assert_equal(DB_OK, db_create_table_with_options(db, "large", sizeof(Small), &large));
+	assert_equal(DB_OK, db_create_table_with_options(db, "blobs", sizeof(blob), &blobs));
+	assert_equal(PAGE_SIZE, db_get_table(db, "small")->options.page_size);
+	db_close(db);
+
+	//Large page images and rows are logged and redone like any others
+	pid_t pid = fork();
+	if(pid == 0) {
+		db = db_open_file(path, 16);
+		Small small;
+		for(int i=0; i<num_items; ++i) {
+			uuid_copy(small.id, ids[i]);
+			small.number = i;
+			db_insert(db, "small", &small);
+			db_insert(db, "large", &small);
+			if(i == num_items/2) {
+				db_checkpoint(db);
+			}
+			if(i % 10 == 0) {
+				fill_blob(blob, ids[i], 100 + i % 2900);
+				db_insert_record(db, "blobs", blob, 100 + i % 2900);
+			}
+		}
+		_exit(0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+
+	db = db_open_file(path, 16);
+	assert_not_null(db);
+	assert_equal(MAX_PAGE_SIZE, db_get_table(db, "large")->pager->page_size);
+	//Leaves of the large table hold thousands of rows, which cursors step through
+	assert_equal(num_items, count_sorted_rows(db, "large", sizeof(Small)));
+	assert_equal(num_items, count_sorted_rows(db, "small", sizeof(Small)));
+	assert_equal(true, db_get_table(db, "large")->pager->num_pages*8 < db_get_table(db, "small")->pager->num_pages);
+	Small small;
+	for(int i=0; i<num_items; ++i) {
+		assert_equal(true, db_select(db, "large", ids[i], &small));
+		assert_equal(i, small.number);
+		if(i % 10 == 0) {
+			uint32_t size = 100 + i % 2900;
+			fill_blob(blob, ids[i], size);
+			assert_equal(size, db_select_record(db, "blobs", ids[i], out, sizeof(out)));
+			assert_equal(0, memcmp(blob, out, size));
+		}
+	}
+	for(int i=0; i<num_items/2; ++i) {
+		assert_equal(DB_OK, db_delete(db, "large", ids[i]));
+	}
+	assert_equal(num_items/2, count_sorted_rows(db, "large", sizeof(Small)));
+	assert_equal(DB_OK, db_save_snapshot(db, snapshot));
+	db_close(db);
+
+	//Tables with different page sizes share a snapshot
+	db = db_open_readonly(snapshot);
+	assert_not_null(db);
+	assert_equal(16*1024, db_get_table(db, "blobs")->pager->page_size);
+	assert_equal(num_items/2, count_sorted_rows(db, "large", sizeof(Small)));
+	assert_equal(num_items, count_sorted_rows(db, "small", sizeof(Small)));
+	for(int i=0; i<num_items; ++i) {
+		assert_equal(i >= num_items/2, db_select(db, "large", ids[i], &small));
+	}
+	db_close(db);
+
+	char file[64];
+	sprintf(file, "%s/small.pages", path);
+	unlink(file);
+	sprintf(file, "%s/blobs.pages", path);
+	unlink(file);
+	remove_file_database(path, "large");
+	unlink(snapshot);
+	free(ids);
+}
+
+typedef struct {
+	uuid_t id;
+	int32_t age;
+	int64_t balance;
+	char name[20];
+} Person;
+
+void make_person(Person* person, const uuid_t id, int i) {
+	memset(person, 0, sizeof(*person));
+	uuid_copy(person->id, id);
+	person->age = i % 50 - 25;
+	person->balance = (int64_t)(i - 1000) * ((int64_t)1 << 33);
+	sprintf(person->name, "person%05i", i);
+}
+
+//Cells are only as aligned as their size allows, so the row is copied out.
+void grow_older(void* existing, const void* incoming, void* context) {
+	(void)context;
+	Person person;
+	memcpy(&person, existing, sizeof(person));
+	person.age += ((const Person*)incoming)->age;
+	memcpy(existing, &person, sizeof(person));
+}
+
+//Asserts that every row an index lookup gives has the age asked for.
+uint32_t count_ages(Database* db, int32_t low, int32_t high) {
+	uint32_t max_ids = 8192;
+	uuid_t* ids = malloc(sizeof(uuid_t)*max_ids);
+	uint32_t count = db_index_find_range(db, "people", offsetof(Person, age), &low, &high, ids, max_ids);
+	assert_equal(true, count <= max_ids);
+	Person out;
+	for(uint32_t i=0; i<count; ++i) {
+		assert_equal(true, db_select(db, "people", ids[i], &out));
+		assert_equal(true, out.age >= low && out.age <= high);
+		if(i > 0) {
+			int32_t before = out.age;
+			db_select(db, "people", ids[i-1], &out);
+			assert_equal(true, out.age <= before);
+		}
+	}
+	free(ids);
+	return count;
+}
+
+void test_indexes_follow_row_changes() {
+	char path[] = "/tmp/special-memory-db-XXXXXX";
+	assert_not_null(mkdtemp(path));
+	char snapshot[] = "/tmp/special-memory-snapshot-XXXXXX";
+	int fd = mkstemp(snapshot);
+	assert_equal(true, fd >= 0);
+	close(fd);
+	int num_items = 5000;
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+	for(int i=0; i<num_items; ++i) {
+		uuid_generate(ids[i]);
+	}
+	uint32_t age = offsetof(Person, age);
+	uint32_t balance = offsetof(Person, balance);
+	uint32_t name = offsetof(Person, name);
+
+	//Rows there before the index and rows put after it are both found, and
+	//entries made after the last checkpoint are redone from the log
+	pid_t pid = fork();
+	if(pid == 0) {
+		Database* db = db_open_file(path, 16);
+		db_create_table(db, "people", sizeof(Person));
+		Person in;
+		for(int i=0; i<num_items/2; ++i) {
+			make_person(&in, ids[i], i);
+			db_insert(db, "people", &in);
+		}
+		db_create_index(db, "people", age, DB_FIELD_INT32, sizeof(int32_t));
+		for(int i=num_items/2; i<num_items; ++i) {
+			make_person(&in, ids[i], i);
+			db_insert(db, "people", &in);
+		}
+		_exit(0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+
+	Database* db = db_open_file(path, 16);
+	assert_not_null(db);
+	assert_equal_string("people", db_first_table(db));
+	assert_null(db_next_table(db, "people"));
+	assert_equal(DB_ERROR_TABLE_EXISTS, db_create_index(db, "people", age, DB_FIELD_INT32, sizeof(int32_t)));
+	assert_equal(DB_ERROR_BAD_FIELD, db_create_index(db, "people", age, DB_FIELD_INT32, sizeof(int64_t)));
+	assert_equal(DB_ERROR_BAD_FIELD, db_create_index(db, "people", name, DB_FIELD_STRING, sizeof(Person)));
+	assert_equal(DB_ERROR_NO_TABLE, db_create_index(db, "nobody", age, DB_FIELD_INT32, sizeof(int32_t)));
+	assert_equal(DB_OK, db_create_index(db, "people", balance, DB_FIELD_INT64, sizeof(int64_t)));
+	assert_equal(DB_OK, db_create_index(db, "people", name, DB_FIELD_STRING, sizeof(((Person*)0)->name)));
+
+	assert_equal(num_items/50, count_ages(db, 7, 7));
+	assert_equal(num_items/50*7, count_ages(db, -3, 3));
+	assert_equal(num_items, count_ages(db, INT32_MIN, INT32_MAX));
+	assert_equal(0, count_ages(db, 3, -3));
+	uuid_t found[2];
+	Person in;
+	for(int i=0; i<num_items; i+=97) {
+		make_person(&in, ids[i], i);
+		assert_equal(1, db_index_find(db, "people", name, in.name, found, 2));
+		assert_equal(0, uuid_compare(ids[i], found[0]));
+		assert_equal(1, db_index_find(db, "people", balance, &in.balance, found, 2));
+		assert_equal(0, uuid_compare(ids[i], found[0]));
+	}
+	int64_t low = INT64_MIN;
+	int64_t high = 0;
+	assert_equal(1001, db_index_find_range(db, "people", balance, &low, &high, NULL, 0));
+
+	//Updates, merges and deletes move or drop the entries
+	for(int i=0; i<num_items; i+=50) {
+		make_person(&in, ids[i], i);
+		in.age = 100;
+		assert_equal(DB_OK, db_update(db, "people", &in));
+	}
+	for(int i=1; i<num_items; i+=50) {
+		make_person(&in, ids[i], i);
+		in.age = 1;
+		assert_equal(DB_OK, db_upsert(db, "people", &in, grow_older, NULL));
+	}
+	for(int i=2; i<num_items; i+=50) {
+		assert_equal(DB_OK, db_delete(db, "people", ids[i]));
+	}
+	assert_equal(num_items/50, count_ages(db, 100, 100));
+	assert_equal(0, count_ages(db, -25, -25));
+	assert_equal(0, count_ages(db, -24, -24));
+	assert_equal(num_items/50, count_ages(db, -23, -23));
+	make_person(&in, ids[2], 2);
+	assert_equal(0, db_index_find(db, "people", name, in.name, found, 2));
+	assert_equal(DB_OK, db_save_snapshot(db, snapshot));
+	db_close(db);
+
+	db = db_open_readonly(snapshot);
+	assert_not_null(db);
+	assert_equal(num_items/50, count_ages(db, 100, 100));
+	make_person(&in, ids[3], 3);
+	assert_equal(1, db_index_find(db, "people", name, in.name, found, 2));
+	db_close(db);
+
+	db = db_open_file(path, 16);
+	assert_equal(num_items - num_items/50, count_ages(db, INT32_MIN, INT32_MAX));
+	db_close(db);
+
+	char file[64];
+	for(int i=0; i<3; ++i) {
+		sprintf(file, "%s/index.0.%u.pages", path, i == 0 ? age : i == 1 ? balance : name);
+		unlink(file);
+	}
+	remove_file_database(path, "people");
+	unlink(snapshot);
+	free(ids);
+}
+
+void test_failed_index_changes_leave_rows_alone() {
+	Database* db = db_open();
+	db_create_table(db, "people", sizeof(Person));
+	uint32_t age = offsetof(Person, age);
+	uint32_t balance = offsetof(Person, balance);
+	int num_items = 4000;
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+	bool* stored = malloc(sizeof(bool)*num_items);
+	assert_equal(DB_OK, db_create_index(db, "people", age, DB_FIELD_INT32, sizeof(int32_t)));
+
+	//Splits need memory, so once it runs out, a row going to a full leaf of
+	//the table or of its index is turned away whole
+	Person in;
+	Person out;
+	int num_stored = 0;
+	for(int i=0; i<num_items; ++i) {
+		if(i == num_items/2) {
+			fail_allocations_after(0);
+		}
+		uuid_generate(ids[i]);
+		make_person(&in, ids[i], i);
+		DbResult result = db_insert(db, "people", &in);
+		assert_equal(true, (result == DB_OK || result == DB_ERROR_NO_MEMORY));
+		stored[i] = result == DB_OK;
+		num_stored += stored[i];
+	}
+	int num_moved = 0;
+	for(int i=0; i<num_items; ++i) {
+		make_person(&in, ids[i], i);
+		in.age = 100;
+		if(stored[i] && db_update(db, "people", &in) == DB_OK) {
+			++num_moved;
+		}
+	}
+	fail_allocations_after(-1);
+	assert_equal(true, num_stored < num_items);
+	for(int i=0; i<num_items; ++i) {
+		assert_equal(stored[i], db_select(db, "people", ids[i], &out));
+	}
+	assert_equal(num_stored, count_ages(db, INT32_MIN, INT32_MAX));
+	assert_equal(num_moved, count_ages(db, 100, 100));
+
+	//An index that can not be made is taken back, and can be tried again
+	DbResult result = DB_ERROR_NO_MEMORY;
+	for(int n=0; result == DB_ERROR_NO_MEMORY; ++n) {
+		fail_allocations_after(n);
+		result = db_create_index(db, "people", balance, DB_FIELD_INT64, sizeof(int64_t));
+		fail_allocations_after(-1);
+		assert_equal((result == DB_OK ? 3u : 2u), db->num_tables);
+	}
+	assert_equal(DB_OK, result);
+	int64_t low = INT64_MIN;
+	int64_t high = INT64_MAX;
+	assert_equal(num_stored, db_index_find_range(db, "people", balance, &low, &high, NULL, 0));
+
+	free(stored);
+	free(ids);
+	db_close(db);
+}
+
+//What db_aggregate should give, worked out row by row.
+DbAggregate expected_aggregate(const Person* people, int n, const DbFilter* filter, const DbField* field) {
+	DbAggregate out = { 0, 0, INT64_MAX, INT64_MIN };
+	for(int i=0; i<n; ++i) {
+		const uint8_t* row = (const uint8_t*)&people[i];
+		int64_t v = 0;
+		if(filter->op != DB_FILTER_ALL) {
+			v = filter->field.type == DB_FIELD_INT32 ? *(const int32_t*)(row + filter->field.offset) : *(const int64_t*)(row + filter->field.offset);
+		}
+		bool picked = filter->op == DB_FILTER_ALL
+			|| (filter->op == DB_FILTER_EQUAL && v == filter->value)
+			|| (filter->op == DB_FILTER_LESS && v < filter->value)
+			|| (filter->op == DB_FILTER_RANGE && v >= filter->value && v <= filter->high);
+		if(!picked) {
+			continue;
+		}
+		out.count++;
+		if(field != NULL) {
+			int64_t a = field->type == DB_FIELD_INT32 ? *(const int32_t*)(row + field->offset) : *(const int64_t*)(row + field->offset);
+			out.sum += a;
+			out.min = a < out.min ? a : out.min;
+			out.max = a > out.max ? a : out.max;
+		}
+	}
+	return out;
+}
+
+void assert_aggregate(Database* db, const char* table, const Person* people, int n, const DbFilter* filter, const DbField* field) {
+	DbAggregate expected = expected_aggregate(people, n, filter, field);
+	DbAggregate out;
+	assert_equal(DB_OK, db_aggregate(db, table, filter, field, &out));
+	assert_equal(expected.count, out.count);
+	if(field != NULL) {
+		assert_equal(expected.sum, out.sum);
+		assert_equal(expected.min, out.min);
+		assert_equal(expected.max, out.max);
+	}
+}
+
+void test_aggregates_read_columns_in_place() {
 	Database* db = db_open();
-	const char* table = "stuff";
-	db_create_table(db, table, sizeof(Stuff));
+	const char* table = "people";
+	db_create_table(db, table, sizeof(Person));
+	int num_items = 20000;
+	Person* people = malloc(sizeof(Person)*num_items);
+	for(int i=0; i<num_items; ++i) {
+		uuid_t id;
+		uuid_generate(id);
+		make_person(&people[i], id, i);
+		db_insert(db, table, &people[i]);
+	}
 
-	Stuff in1;
-	uuid_generate(in1.id);
-	strncpy(in1.text, "Hagrid", 256);
-	db_insert(db, table, &in1);
-	Stuff in2;
-	uuid_generate(in2.id);
-	strncpy(in2.text, "Harry", 256);
-	db_insert(db, table, &in2);
+	DbField age = { offsetof(Person, age), DB_FIELD_INT32, sizeof(int32_t) };
+	DbField balance = { offsetof(Person, balance), DB_FIELD_INT64, sizeof(int64_t) };
+	DbFilter filters[] = {
+		{ .op = DB_FILTER_ALL },
+		{ DB_FILTER_EQUAL, age, 7, 0 },
+		{ DB_FILTER_LESS, age, -20, 0 },
+		{ DB_FILTER_RANGE, age, -3, 3 },
+		{ DB_FILTER_RANGE, age, 5, -5 },
+		{ DB_FILTER_RANGE, age, (int64_t)INT32_MAX + 1, INT64_MAX },
+		{ DB_FILTER_LESS, age, INT64_MIN, 0 },
+		{ DB_FILTER_EQUAL, balance, (int64_t)(500 - 1000) * ((int64_t)1 << 33), 0 },
+		{ DB_FILTER_LESS, balance, 0, 0 },
+		{ DB_FILTER_RANGE, balance, INT64_MIN, (int64_t)1 << 40 }
+	};
+	for(uint32_t f=0; f<sizeof(filters)/sizeof(filters[0]); ++f) {
+		assert_aggregate(db, table, people, num_items, &filters[f], NULL);
+		assert_aggregate(db, table, people, num_items, &filters[f], &age);
+		assert_aggregate(db, table, people, num_items, &filters[f], &balance);
+	}
+	DbAggregate out;
+	assert_equal(DB_OK, db_aggregate(db, table, NULL, NULL, &out));
+	assert_equal(num_items, out.count);
+	assert_equal(DB_OK, db_aggregate(db, table, &filters[4], &age, &out));
+	assert_equal(INT64_MAX, out.min);
+	assert_equal(INT64_MIN, out.max);
 
-	Stuff out;
-	db_select(db, table, in1.id, &out);
-	assert_equal_uuid(in1.id, out.id);
+	//A cursor aggregates its own key range
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+	for(int i=0; i<num_items; ++i) {
+		uuid_copy(ids[i], people[i].id);
+	}
+	qsort(ids, num_items, sizeof(uuid_t), compare_uuids);
+	Cursor cursor;
+	db_table_start(db, table, &cursor);
+	db_cursor_seek(&cursor, ids[1000]);
+	db_cursor_set_upper_bound(&cursor, ids[9000]);
+	memset(&out, 0, sizeof(out));
+	assert_equal(DB_OK, db_cursor_aggregate(&cursor, NULL, NULL, &out));
+	assert_equal(8000, out.count);
+	assert_equal(true, cursor.end);
+	db_cursor_close(&cursor);
 
-	db_select(db, table, in2.id, &out);
-	assert_equal_uuid(in2.id, out.id);
+	DbField name = { offsetof(Person, name), DB_FIELD_STRING, 20 };
+	DbField outside = { sizeof(Person) - 4, DB_FIELD_INT64, sizeof(int64_t) };
+	DbFilter by_name = { DB_FILTER_EQUAL, name, 0, 0 };
+	assert_equal(DB_ERROR_BAD_FIELD, db_aggregate(db, table, NULL, &name, &out));
+	assert_equal(DB_ERROR_BAD_FIELD, db_aggregate(db, table, NULL, &outside, &out));
+	assert_equal(DB_ERROR_BAD_FIELD, db_aggregate(db, table, &by_name, NULL, &out));
+	assert_equal(DB_ERROR_NO_TABLE, db_aggregate(db, "none", NULL, NULL, &out));
+
+	//Variable rows are read one by one, and rows too short for a field skipped
+	const char* records = "records";
+	TableOptions options = { .variable_rows = true };
+	db_create_table_with_options(db, records, sizeof(Person), &options);
+	for(int i=0; i<num_items; ++i) {
+		uint32_t size = i % 2 == 0 ? sizeof(Person) : offsetof(Person, balance);
+		db_insert_record(db, records, &people[i], size);
+	}
+	assert_equal(DB_OK, db_aggregate(db, records, &filters[3], &age, &out));
+	assert_equal(expected_aggregate(people, num_items, &filters[3], &age).count, out.count);
+	assert_equal(DB_OK, db_aggregate(db, records, NULL, &balance, &out));
+	assert_equal(num_items/2, out.count);
 
+	free(ids);
+	free(people);
 	db_close(db);
 }
 
-void test_pager_can_be_opened_and_closed() {
-	Pager* pager = db_open_pager();
-	db_close_pager(pager);
+//Looks keys up in a batch and one by one, asserting the same rows, and row
+//sizes, come back.
+void assert_select_many(Database* db, const char* table, const uuid_t* keys, uint32_t n, uint32_t cell_size) {
+	uint8_t* rows = malloc((size_t)n*cell_size);
+	uint8_t* row = malloc(cell_size);
+	bool* found = malloc(n*sizeof(bool));
+	uint32_t* sizes = malloc(n*sizeof(uint32_t));
+	memset(rows, 0xAB, (size_t)n*cell_size);
+	uint32_t count = db_select_many(db, table, keys, n, rows, found);
+	assert_equal(count, db_select_many_records(db, table, keys, n, rows, sizes));
+	uint32_t expected = 0;
+	for(uint32_t i=0; i<n; ++i) {
+		uuid_t key;
+		uuid_copy(key, keys[i]);
+		memset(row, 0xAB, cell_size);
+		bool exists = db_select(db, table, key, row);
+		assert_equal(exists, found[i]);
+		assert_equal(0, memcmp(row, rows + (size_t)i*cell_size, cell_size));
+		assert_equal(db_select_record(db, table, key, row, cell_size), sizes[i]);
+		expected += exists;
+	}
+	assert_equal(expected, count);
+	free(rows);
+	free(row);
+	free(found);
+	free(sizes);
 }
 
-void test_pager_provides_writable_pages() {
-	Pager* pager = db_open_pager();
+void test_select_many_finds_rows_in_one_walk() {
+	char path[] = "/tmp/special-memory-db-XXXXXX";
+	assert_not_null(mkdtemp(path));
+	const char* table = "stuff";
+	Database* db = db_open_file(path, 16);
+	db_create_table(db, table, sizeof(Stuff));
 
-	uint32_t n1 = db_get_unused_page(pager);
-	uint32_t n2 = db_get_unused_page(pager);
-	void* page1 = db_get_page(pager, n1);
-	void* page2 = db_get_page(pager, n2);
-	memset(page1, 0, 4096);
-	memset(page2, 1, 4096);
+	int num_items = 20000;
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+	for(int i=0; i<num_items; ++i) {
+		Stuff in;
+		uuid_generate(in.id);
+		uuid_copy(ids[i], in.id);
+		sprintf(in.text, "name%i", i);
+		db_insert(db, table, &in);
+	}
 
-	db_close_pager(pager);
+	//Keys in no order, some missing and some asked for twice
+	uint32_t n = 1000;
+	uuid_t* keys = malloc(sizeof(uuid_t)*n);
+	for(uint32_t i=0; i<n; ++i) {
+		if(i % 3 == 0) {
+			uuid_generate(keys[i]);
+		} else if(i % 7 == 0 && i > 0) {
+			uuid_copy(keys[i], keys[i-1]);
+		} else {
+			uuid_copy(keys[i], ids[(i*7919) % num_items]);
+		}
+	}
+	assert_select_many(db, table, keys, n, sizeof(Stuff));
+	assert_select_many(db, table, keys, 1, sizeof(Stuff));
+	assert_select_many(db, table, ids, num_items, sizeof(Stuff));
+	assert_equal(0, db_select_many(db, table, keys, 0, NULL, NULL));
+
+	Pager* pager = db->tables[0]->pager;
+	for(uint32_t f=0; f<pager->num_frames; ++f) {
+		assert_equal(0, pager->frames[f].pins);
+	}
+	bool found[4];
+	Stuff out[4];
+	assert_equal(0, db_select_many(db, "none", keys, 4, out, found));
+	assert_equal(false, found[3]);
+
+	//A root that is still a leaf, and variable rows
+	const char* blobs = "blobs";
+	TableOptions options = { .variable_rows = true };
+	db_create_table_with_options(db, blobs, 3000, &options);
+	assert_select_many(db, blobs, keys, n, 3000);
+	uint8_t blob[3000];
+	for(int i=0; i<2000; ++i) {
+		uint32_t size = sizeof(uuid_t) + i*7 % 2900;
+		fill_blob(blob, ids[i], size);
+		db_insert_record(db, blobs, blob, size);
+		if(i == 10) {
+			assert_select_many(db, blobs, ids, 20, 3000);
+		}
+	}
+	assert_select_many(db, blobs, ids, 4000, 3000);
+	db_close(db);
+
+	//Read only pages are looked up without latches
+	char snapshot[] = "/tmp/special-memory-snapshot-XXXXXX";
+	int fd = mkstemp(snapshot);
+	close(fd);
+	db = db_open_file(path, 16);
+	assert_equal(DB_OK, db_save_snapshot(db, snapshot));
+	db_close(db);
+	db = db_open_readonly(snapshot);
+	assert_not_null(db);
+	assert_select_many(db, table, keys, n, sizeof(Stuff));
+	db_close(db);
+	unlink(snapshot);
+
+	char file[64];
+	sprintf(file, "%s/%s.pages", path, blobs);
+	unlink(file);
+	remove_file_database(path, table);
+	free(keys);
+	free(ids);
 }
 
 void test_cursor_can_step_through_a_table() {
@@ -206,6 +2136,345 @@ void test_cursor_can_traverse_pages() {
 	db_close(db);
 }
 
+void test_cursor_can_scan_a_key_range() {
+	Database* db = db_open();
+	const char* table = "stuff";
+	db_create_table(db, table, sizeof(Stuff));
+
+	Cursor cursor;
+	db_table_start(db, table, &cursor);
+	assert_equal(true, cursor.end);
+
+	int num_items = 5000;
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+	for(int i=0; i<num_items; ++i) {
+		Stuff in;
+		uuid_generate(in.id);
+		uuid_copy(ids[i], in.id);
+		sprintf(in.text, "name%i", i);
+		db_insert(db, table, &in);
+	}
+	qsort(ids, num_items, sizeof(uuid_t), compare_uuids);
+
+	Stuff out;
+	db_table_start(db, table, &cursor);
+	db_cursor_seek(&cursor, ids[1000]);
+	db_cursor_set_upper_bound(&cursor, ids[2000]);
+	int i = 1000;
+	while(cursor.end == false) {
+		db_cursor_value(&cursor, &out);
+		assert_equal_uuid(ids[i], out.id);
+		++i;
+		db_cursor_next(&cursor);
+	}
+	assert_equal(2000, i);
+
+	//Seeking between keys lands on the next one
+	uuid_t key;
+	uuid_copy(key, ids[3000]);
+	memset(key+8, 255, 8);
+	db_table_start(db, table, &cursor);
+	db_cursor_seek(&cursor, key);
+	assert_equal(false, cursor.end);
+	db_cursor_value(&cursor, &out);
+	assert_equal_uuid(ids[3001], out.id);
+
+	//An empty range ends straight away
+	db_cursor_set_upper_bound(&cursor, key);
+	assert_equal(true, cursor.end);
+
+	memset(key, 255, sizeof(key));
+	db_table_start(db, table, &cursor);
+	db_cursor_seek(&cursor, key);
+	assert_equal(true, cursor.end);
+
+	free(ids);
+	db_close(db);
+}
+
+void test_cursor_can_fetch_rows_in_batches() {
+	char path[] = "/tmp/special-memory-db-XXXXXX";
+	assert_not_null(mkdtemp(path));
+	const char* table = "stuff";
+	Database* db = db_open_file(path, 16);
+	db_create_table(db, table, sizeof(Stuff));
+
+	int num_items = 3000;
+	uuid_t* ids = malloc(sizeof(uuid_t)*num_items);
+	for(int i=0; i<num_items; ++i) {
+		Stuff in;
+		uuid_generate(in.id);
+		uuid_copy(ids[i], in.id);
+		sprintf(in.text, "name%i", i);
+		db_insert(db, table, &in);
+	}
+	qsort(ids, num_items, sizeof(uuid_t), compare_uuids);
+
+	Stuff* batch = malloc(sizeof(Stuff)*100);
+	Cursor cursor;
+	db_table_start(db, table, &cursor);
+	int i = 0;
+	uint32_t count;
+	while((count = db_cursor_fetch(&cursor, batch, 100)) > 0) {
+		for(uint32_t j=0; j<count; ++j) {
+			assert_equal_uuid(ids[i], batch[j].id);
+			++i;
+		}
+	}
+	assert_equal(num_items, i);
+
+	const void* cells;
+	db_table_start(db, table, &cursor);
+	db_cursor_seek(&cursor, ids[500]);
+	db_cursor_set_upper_bound(&cursor, ids[2500]);
+	i = 500;
+	while((count = db_cursor_next_run(&cursor, &cells)) > 0) {
+		const Stuff* rows = cells;
+		for(uint32_t j=0; j<count; ++j) {
+			assert_equal_uuid(ids[i], rows[j].id);
+			++i;
+		}
+	}
+	db_cursor_close(&cursor);
+	assert_equal(2500, i);
+
+	Pager* pager = db->tables[0]->pager;
+	for(uint32_t f=0; f<pager->num_frames; ++f) {
+		assert_equal(0, pager->frames[f].pins);
+	}
+	db_close(db);
+
+	remove_file_database(path, table);
+	free(batch);
+	free(ids);
+}
+
+typedef struct {
+	uint32_t* seen;
+	uint32_t num_threads;
+	bool stray;
+	uint64_t rows[8];
+	uint64_t bytes[8];
+} ScanTotals;
+
+void count_scanned_row(void* context, uint32_t worker, const void* row, uint32_t size) {
+	ScanTotals* totals = context;
+	if(worker >= totals->num_threads) {
+		totals->stray = true;
+		return;
+	}
+	Small small;
+	memcpy(&small, row, sizeof(small) < size ? sizeof(small) : size);
+	if(totals->seen != NULL) {
+		__atomic_add_fetch(&totals->seen[small.number], 1, __ATOMIC_RELAXED);
+	}
+	totals->rows[worker]++;
+	totals->bytes[worker] += size;
+}
+
+void test_parallel_scan_sees_every_row_once() {
+	Database* db = db_open();
+	const char* table = "small";
+	db_create_table(db, table, sizeof(Small));
+
+	int num_items = 100000;
+	for(int i=0; i<num_items; ++i) {
+		Small in;
+		uuid_generate(in.id);
+		in.number = i;
+		db_insert(db, table, &in);
+	}
+
+	ScanTotals totals;
+	memset(&totals, 0, sizeof(totals));
+	totals.seen = calloc(num_items, sizeof(uint32_t));
+	totals.num_threads = 4;
+	assert_equal(DB_OK, db_parallel_scan(db, table, 4, count_scanned_row, &totals));
+	uint64_t rows = 0;
+	for(int w=0; w<8; ++w) {
+		rows += totals.rows[w];
+	}
+	assert_equal(num_items, rows);
+	assert_equal(false, totals.stray);
+	for(int i=0; i<num_items; ++i) {
+		assert_equal(1, totals.seen[i]);
+	}
+
+	//More threads than ranges leaves some with nothing to do
+	const char* tiny = "tiny";
+	db_create_table(db, tiny, sizeof(Small));
+	for(int i=0; i<10; ++i) {
+		Small in;
+		uuid_generate(in.id);
+		in.number = i;
+		db_insert(db, tiny, &in);
+	}
+	memset(totals.seen, 0, sizeof(uint32_t)*num_items);
+	memset(totals.rows, 0, sizeof(totals.rows));
+	totals.num_threads = 8;
+	assert_equal(DB_OK, db_parallel_scan(db, tiny, 8, count_scanned_row, &totals));
+	assert_equal(false, totals.stray);
+	for(int i=0; i<10; ++i) {
+		assert_equal(1, totals.seen[i]);
+	}
+
+	const char* empty = "empty";
+	db_create_table(db, empty, sizeof(Small));
+	memset(totals.rows, 0, sizeof(totals.rows));
+	assert_equal(DB_OK, db_parallel_scan(db, empty, 0, count_scanned_row, &totals));
+	assert_equal(0, totals.rows[0]);
+	assert_equal(DB_ERROR_NO_TABLE, db_parallel_scan(db, "none", 2, count_scanned_row, &totals));
+
+	free(totals.seen);
+
+	//Variable rows come with their own size
+	const char* blobs = "blobs";
+	TableOptions options = { .variable_rows = true };
+	db_create_table_with_options(db, blobs, 3000, &options);
+	uint8_t blob[3000];
+	uint64_t bytes = 0;
+	for(int i=0; i<2000; ++i) {
+		uuid_t id;
+		uuid_generate(id);
+		uint32_t size = sizeof(Small) + i % 2900;
+		fill_blob(blob, id, size);
+		db_insert_record(db, blobs, blob, size);
+		bytes += size;
+	}
+	memset(&totals, 0, sizeof(totals));
+	totals.num_threads = 3;
+	assert_equal(DB_OK, db_parallel_scan(db, blobs, 3, count_scanned_row, &totals));
+	assert_equal(false, totals.stray);
+	assert_equal(2000, totals.rows[0] + totals.rows[1] + totals.rows[2]);
+	assert_equal(bytes, totals.bytes[0] + totals.bytes[1] + totals.bytes[2]);
+
+	db_close(db);
+}
+
+void test_parallel_scan_reads_read_only_snapshots() {
+	char path[] = "/tmp/special-memory-snapshot-XXXXXX";
+	int fd = mkstemp(path);
+	assert_equal(true, fd >= 0);
+	close(fd);
+	Database* db = db_open();
+	const char* table = "small";
+	db_create_table(db, table, sizeof(Small));
+	int num_items = 20000;
+	for(int i=0; i<num_items; ++i) {
+		Small in;
+		uuid_generate(in.id);
+		in.number = i;
+		db_insert(db, table, &in);
+	}
+	assert_equal(DB_OK, db_save_snapshot(db, path));
+	db_close(db);
+
+	//The ranges are found without latching the mapped pages
+	db = db_open_readonly(path);
+	assert_not_null(db);
+	ScanTotals totals;
+	memset(&totals, 0, sizeof(totals));
+	totals.seen = calloc(num_items, sizeof(uint32_t));
+	totals.num_threads = 4;
+	assert_equal(DB_OK, db_parallel_scan(db, table, 4, count_scanned_row, &totals));
+	uint64_t rows = 0;
+	for(int w=0; w<8; ++w) {
+		rows += totals.rows[w];
+	}
+	assert_equal(num_items, rows);
+	assert_equal(false, totals.stray);
+	for(int i=0; i<num_items; ++i) {
+		assert_equal(1, totals.seen[i]);
+	}
+	free(totals.seen);
+	db_close(db);
+	unlink(path);
+}
+
+void test_cursor_prefetches_leaves_ahead() {
+	char path[] = "/tmp/special-memory-db-XXXXXX";
+	assert_not_null(mkdtemp(path));
+	const char* table = "stuff";
+	Database* db = db_open_file(path, 16);
+	db_create_table(db, table, sizeof(Stuff));
+	int num_items = 3000;
+	for(int i=0; i<num_items; ++i) {
+		Stuff in;
+		uuid_generate(in.id);
+		sprintf(in.text, "name%i", i);
+		db_insert(db, table, &in);
+	}
+	db_close(db);
+
+	//Pages read from the file are read ahead without taking frames, only
+	//the path down to the cursor's leaf is in the pool
+	db = db_open_file(path, 16);
+	Pager* pager = db->tables[0]->pager;
+	assert_equal(false, db_prefetch_page(pager, pager->num_pages));
+	assert_equal(true, db_prefetch_page(pager, pager->num_pages - 1));
+	Cursor cursor;
+	db_table_start(db, table, &cursor);
+	db_cursor_set_prefetch(&cursor, 12);
+	db_cursor_next(&cursor);
+	assert_equal(12, cursor.ahead);
+	uint32_t used = 0;
+	for(uint32_t f=0; f<pager->num_frames; ++f) {
+		used += pager->frames[f].page != FRAME_NONE;
+	}
+	assert_equal(true, used <= 3);
+	db_cursor_close(&cursor);
+	for(uint32_t depth=0; depth<=12; depth+=4) {
+		Cursor cursor;
+		db_table_start(db, table, &cursor);
+		db_cursor_set_prefetch(&cursor, depth);
+		Stuff out;
+		uuid_t prev;
+		int i = 0;
+		uint32_t deepest = 0;
+		while(!cursor.end) {
+			db_cursor_value(&cursor, &out);
+			if(i > 0) {
+				assert_less_than_uuid(prev, out.id);
+			}
+			uuid_copy(prev, out.id);
+			deepest = cursor.ahead > deepest ? cursor.ahead : deepest;
+			db_cursor_next(&cursor);
+			++i;
+		}
+		assert_equal(num_items, i);
+		assert_equal(depth, deepest);
+		assert_equal(depth > 0, cursor.ahead_end);
+		for(uint32_t f=0; f<pager->num_frames; ++f) {
+			assert_equal(0, pager->frames[f].pins);
+		}
+	}
+	db_close(db);
+	remove_file_database(path, table);
+
+	//Pages in memory are pulled into the cache
+	db = db_open();
+	db_create_table(db, table, sizeof(Stuff));
+	for(int i=0; i<num_items; ++i) {
+		Stuff in;
+		uuid_generate(in.id);
+		sprintf(in.text, "name%i", i);
+		db_insert(db, table, &in);
+	}
+	pager = db->tables[0]->pager;
+	assert_equal(false, db_prefetch_page(pager, pager->num_allocated));
+	db_table_start(db, table, &cursor);
+	db_cursor_set_prefetch(&cursor, 16);
+	Stuff* batch = malloc(sizeof(Stuff)*100);
+	int i = 0;
+	uint32_t count;
+	while((count = db_cursor_fetch(&cursor, batch, 100)) > 0) {
+		i += count;
+	}
+	assert_equal(num_items, i);
+	free(batch);
+	db_close(db);
+}
+
 void test_key_dataset(char keys[][37], uint32_t num_items) {
 	Database* db = db_open();
 	const char* table = "stuff";
@@ -308,6 +2577,167 @@ void test_file_dataset(char* filename) {
 	db_close(db);
 }
 
+void test_bulk_load_file_dataset() {
+	Database* db = db_open();
+	const char* table = "stuff";
+	db_create_table(db, table, sizeof(Stuff));
+
+	FILE* f = fopen("../test/data/dataset3.txt", "r");
+	int num_items = 0;
+	Stuff* rows = malloc(sizeof(Stuff)*2500);
+	char line[64];
+	while(fgets(line, sizeof(line), f) != NULL && num_items < 2500) {
+		line[36] = '\0';
+		uuid_parse(line, rows[num_items].id);
+		sprintf(rows[num_items].text, "name%i", num_items);
+		++num_items;
+	}
+	fclose(f);
+
+	assert_equal(DB_OK, db_bulk_load(db, table, rows, num_items, 100));
+	assert_equal(num_items, count_sorted_rows(db, table, sizeof(Stuff)));
+	//13 rows per leaf plus the root
+	assert_equal(true, db->tables[0]->pager->num_pages <= (uint32_t)num_items/13 + 2);
+
+	Stuff out;
+	for(int i=0; i<num_items; ++i) {
+		assert_equal(true, db_select(db, table, rows[i].id, &out));
+		assert_equal_string(rows[i].text, out.text);
+	}
+
+	free(rows);
+	db_close(db);
+}
+
+void test_bulk_load_builds_deep_trees_that_accept_inserts() {
+	Database* db = db_open();
+	const char* table = "small";
+	db_create_table(db, table, sizeof(Small));
+
+	int num_items = 20000;
+	Small* rows = malloc(sizeof(Small)*num_items);
+	memset(rows, 0, sizeof(Small)*num_items);
+	for(int i=0; i<num_items; ++i) {
+		uuid_generate(rows[i].id);
+		rows[i].number = i;
+	}
+	//A repeated key keeps the last row given for it
+	uuid_copy(rows[num_items-1].id, rows[0].id);
+
+	assert_equal(DB_OK, db_bulk_load(db, table, rows, num_items, 50));
+	assert_equal(num_items-1, count_sorted_rows(db, table, sizeof(Small)));
+
+	Small out;
+	assert_equal(true, db_select(db, table, rows[0].id, &out));
+	assert_equal(num_items-1, out.number);
+
+	Small in;
+	memset(&in, 0, sizeof(in));
+	for(int i=0; i<2000; ++i) {
+		uuid_generate(in.id);
+		assert_equal(DB_OK, db_insert(db, table, &in));
+	}
+	assert_equal(num_items-1+2000, count_sorted_rows(db, table, sizeof(Small)));
+	for(int i=1; i<num_items-1; ++i) {
+		assert_equal(true, db_select(db, table, rows[i].id, &out));
+		assert_equal(i, out.number);
+	}
+
+	//A table that already has rows is loaded row by row
+	for(int i=0; i<1000; ++i) {
+		uuid_generate(rows[i].id);
+	}
+	assert_equal(DB_OK, db_bulk_load(db, table, rows, 1000, 100));
+	assert_equal(num_items-1+3000, count_sorted_rows(db, table, sizeof(Small)));
+
+	free(rows);
+	db_close(db);
+}
+
+void test_bulk_load_reuses_freed_pages() {
+	Database* db = db_open();
+	const char* table = "small";
+	db_create_table(db, table, sizeof(Small));
+
+	int num_items = 20000;
+	Small* rows = malloc(sizeof(Small)*num_items);
+	memset(rows, 0, sizeof(Small)*num_items);
+	for(int i=0; i<num_items; ++i) {
+		uuid_generate(rows[i].id);
+		assert_equal(DB_OK, db_insert(db, table, &rows[i]));
+	}
+	//Emptying the table leaves its pages scattered over the free list
+	for(int i=0; i<num_items; ++i) {
+		assert_equal(DB_OK, db_delete(db, table, rows[i].id));
+	}
+	assert_equal(0, count_sorted_rows(db, table, sizeof(Small)));
+
+	for(int i=0; i<num_items; ++i) {
+		uuid_generate(rows[i].id);
+		rows[i].number = i;
+	}
+	assert_equal(DB_OK, db_bulk_load(db, table, rows, num_items, 100));
+	assert_equal(num_items, count_sorted_rows(db, table, sizeof(Small)));
+
+	//Inserts take what is left on the free list, which must not hold tree pages
+	Small in;
+	memset(&in, 0, sizeof(in));
+	for(int i=0; i<2000; ++i) {
+		uuid_generate(in.id);
+		assert_equal(DB_OK, db_insert(db, table, &in));
+	}
+	assert_equal(num_items+2000, count_sorted_rows(db, table, sizeof(Small)));
+
+	Small out;
+	for(int i=0; i<num_items; ++i) {
+		assert_equal(true, db_select(db, table, rows[i].id, &out));
+		assert_equal(i, out.number);
+	}
+
+	free(rows);
+	db_close(db);
+}
+
+void test_bulk_load_checkpoints_as_it_goes() {
+	char path[] = "/tmp/special-memory-db-XXXXXX";
+	assert_not_null(mkdtemp(path));
+	const char* table = "small";
+	Database* db = db_open_file(path, 16);
+	db_create_table(db, table, sizeof(Small));
+	assert_equal(DB_OK, db_create_index(db, table, offsetof(Small, number), DB_FIELD_INT32, sizeof(uint32_t)));
+
+	int num_items = 50000;
+	Small* rows = malloc(sizeof(Small)*num_items);
+	memset(rows, 0, sizeof(Small)*num_items);
+	for(int i=0; i<num_items; ++i) {
+		uuid_generate(rows[i].id);
+		rows[i].number = i;
+	}
+	//The pool stays near its size instead of holding the whole table dirty
+	Pager* pager = db_get_table(db, table)->pager;
+	assert_equal(DB_OK, db_bulk_load(db, table, rows, num_items, 100));
+	assert_equal(true, pager->num_pages > 8*pager->pool_pages);
+	assert_equal(true, pager->num_frames <= 2*pager->pool_pages);
+	db_close(db);
+
+	db = db_open_file(path, 16);
+	assert_equal(num_items, count_sorted_rows(db, table, sizeof(Small)));
+	Small out;
+	uuid_t found[2];
+	for(int i=0; i<num_items; i+=97) {
+		assert_equal(true, db_select(db, table, rows[i].id, &out));
+		assert_equal(i, (int)out.number);
+		assert_equal(1, db_index_find(db, table, offsetof(Small, number), &rows[i].number, found, 2));
+	}
+	db_close(db);
+
+	char file[64];
+	sprintf(file, "%s/index.0.%zu.pages", path, offsetof(Small, number));
+	unlink(file);
+	remove_file_database(path, table);
+	free(rows);
+}
+
 void test_file_dataset_2() {
 	test_file_dataset("../test/data/dataset2.txt");
 }
@@ -369,7 +2799,6 @@ typedef struct {
 /*
 TODO:
 Implement btree.
-Don't define columns, but create index giving type and offset.
 */
 int main(int argc, char* argv[]) {
 	//printf("Stuff: %li\n", sizeof(Stuff));
@@ -379,24 +2808,62 @@ int main(int argc, char* argv[]) {
 	clear_allocations();
 
 	int num_tests = 0;
-	Test tests[16];
+	Test tests[64];
 	
 	add_test(test_database_can_be_opened_and_closed);
 	add_test(test_database_can_create_a_table);
 	add_test(test_database_can_create_multiple_tables);
 	add_test(test_database_can_not_create_duplicate_tables);
+	add_test(test_table_handles_stay_valid_as_tables_are_added);
 	add_test(test_database_can_insert_and_select_data);
+	add_test(test_database_can_select_across_pages);
+	add_test(test_database_can_update_and_delete_rows);
+	add_test(test_insert_handles_existing_keys);
+	add_test(test_append_inserts_keep_leaves_packed);
+	add_test(test_compressed_keys_raise_internal_fan_out);
+	add_test(test_variable_rows_take_only_their_size);
+	add_test(test_table_can_grow_past_2000_pages);
+	add_test(test_insert_reports_out_of_memory);
+	add_test(test_table_handles_concurrent_writers_and_readers);
+	add_test(test_cursor_scans_stay_consistent_under_writers);
 
 	add_test(test_pager_can_be_opened_and_closed);
 	add_test(test_pager_provides_writable_pages);
+	add_test(test_pager_carves_pages_from_aligned_arenas);
+	add_test(test_pager_writes_back_evicted_pages);
+	add_test(test_file_database_persists_between_opens);
+	add_test(test_reopened_pages_drop_their_latches);
+	add_test(test_table_needs_its_catalog_entry);
+	add_test(test_log_recovers_changes_after_a_crash);
+	add_test(test_log_batches_syncs);
+	add_test(test_log_shares_syncs_between_writers);
+	add_test(test_checkpoint_keeps_log_when_flush_fails);
+	add_test(test_snapshot_reopens_tables_without_reloading);
+	add_test(test_read_only_database_uses_the_mapped_pages);
+	add_test(test_variable_rows_spill_to_overflow_pages);
+	add_test(test_tables_choose_their_page_size);
+	add_test(test_indexes_follow_row_changes);
+	add_test(test_failed_index_changes_leave_rows_alone);
+	add_test(test_aggregates_read_columns_in_place);
+	add_test(test_select_many_finds_rows_in_one_walk);
 
 	add_test(test_cursor_can_step_through_a_table);
 	add_test(test_cursor_can_traverse_pages);
+	add_test(test_cursor_can_scan_a_key_range);
+	add_test(test_cursor_can_fetch_rows_in_batches);
+	add_test(test_parallel_scan_sees_every_row_once);
+	add_test(test_parallel_scan_reads_read_only_snapshots);
+	add_test(test_cursor_prefetches_leaves_ahead);
 
 	add_test(test_key_dataset_1);
 	add_test(test_file_dataset_2);
 	add_test(test_file_dataset_3);
 
+	add_test(test_bulk_load_file_dataset);
+	add_test(test_bulk_load_builds_deep_trees_that_accept_inserts);
+	add_test(test_bulk_load_reuses_freed_pages);
+	add_test(test_bulk_load_checkpoints_as_it_goes);
+
 	for(int i=0; i<num_tests; ++i) {
 		memset(last_reverse_id, 255, sizeof(uuid_t));
 		char buf[BUFSIZ];
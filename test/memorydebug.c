@@ -9,13 +9,36 @@ typedef struct {
 	bool freed;
 } Allocation;
 
-#define MAX_ALLOCATIONS 1024
+#define MAX_ALLOCATIONS 16384
 Allocation allocations[MAX_ALLOCATIONS];
 int num_allocations = 0;
+int allocations_until_failure = -1;
+//Allocations may come from several threads at once
+bool tracking_lock = false;
+
+void lock_tracking() {
+	while(__atomic_test_and_set(&tracking_lock, __ATOMIC_ACQUIRE)) {
+	}
+}
+
+void unlock_tracking() {
+	__atomic_clear(&tracking_lock, __ATOMIC_RELEASE);
+}
+
+void fail_allocations_after(int n) {
+	allocations_until_failure = n;
+}
+
+void track_allocation(void* p) {
+	if(num_allocations < MAX_ALLOCATIONS) {
+		allocations[num_allocations].ptr = p;
+		num_allocations++;
+	}
+}
 
 void free_allocation(void* p) {
 	for(int i=0; i<MAX_ALLOCATIONS; ++i) {
-		if(allocations[i].ptr == p) {
+		if(allocations[i].ptr == p && !allocations[i].freed) {
 			allocations[i].freed = true;
 			break;
 		}
@@ -23,30 +46,48 @@ void free_allocation(void* p) {
 }
 
 void *malloc(size_t size) {
+	lock_tracking();
+	if(allocations_until_failure == 0) {
+		unlock_tracking();
+		return NULL;
+	}
+	if(allocations_until_failure > 0) {
+		--allocations_until_failure;
+	}
 	void* (*original_malloc)(size_t) = dlsym(RTLD_NEXT, "malloc");
 	void* p = original_malloc(size);
-	allocations[num_allocations].ptr = p;
-	num_allocations++;
+	track_allocation(p);
+	unlock_tracking();
 	return p;
 }
 
 void *realloc(void* ptr, size_t size) {
+	lock_tracking();
+	if(allocations_until_failure == 0) {
+		unlock_tracking();
+		return NULL;
+	}
+	if(allocations_until_failure > 0) {
+		--allocations_until_failure;
+	}
 	void* (*original_realloc)(void*, size_t) = dlsym(RTLD_NEXT, "realloc");
 	void* p = original_realloc(ptr, size);
 	if(p != ptr) {
-		allocations[num_allocations].ptr = p;
-		num_allocations++;
+		track_allocation(p);
 		if(ptr != NULL) {
 			free_allocation(ptr);
 		}
 	}
+	unlock_tracking();
 	return p;
 }
 
 void free(void* ptr) {
+	lock_tracking();
 	void (*original_free)(void*) = dlsym(RTLD_NEXT, "free");
 	original_free(ptr);
 	free_allocation(ptr);
+	unlock_tracking();
 }
 
 void clear_allocations() {
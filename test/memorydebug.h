@@ -2,4 +2,5 @@
 
 void clear_allocations();
 bool check_allocations();
+void fail_allocations_after(int n);
 void hexDump(char *desc, void *addr, int len);
\ No newline at end of file